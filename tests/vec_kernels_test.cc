@@ -0,0 +1,200 @@
+// vec_kernels_test.cc
+
+// Copyright 2019 E. Decker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks every SSE2, AVX2 and AVX-512 variant of the kernels in
+// "vec_kernels.cc" (for "float"s, "double"s and int8 codes) and of the
+// Hamming filter against the scalar versions, for sizes around the widths of
+// the registers and for vectors starting 0 to 3 elements after a cache line
+// (so the remaining elements don't fill a whole register). The sums of the
+// variants may only differ by the order of the summation; the int8 kernels and
+// the Hamming filter have to match exactly. Variants the CPU doesn't support
+// are skipped. Rows stored as "Half"s or "BFloat16"s are compared by the
+// scalar templates in "word_vec_lib.h", so there are no variants for them.
+// Run by "make test"; returns 1 if any check failed.
+
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../word_vec_lib/vec_kernels.cc" // the variants are only visible in this translation unit
+
+namespace {
+
+const unsigned kSizes[] = {0, 1, 7, 8, 15, 16, 17, 33, 301};
+const unsigned kMaxOffset = 3; // the vectors start up to 3 elements after a cache line
+const unsigned kMaxSize = 301;
+const double kTolerance = 1e-9; // relative to the magnitude of the scalar result
+const char* const kOperationNames[3] = {"DotProduct", "SquaredEuclideanDistance", "ManhattanDistance"};
+
+struct Variant { // kernels of one instruction set (only called if "is_supported")
+  bool is_supported;
+  Kernels kernels;
+};
+
+std::vector<Variant> GetVariants() {
+// Returns the variants of the kernels that are compiled for this CPU
+// architecture together with whether the CPU supports them.
+  std::vector<Variant> variants;
+#ifdef WORD_VEC_LIB_X86_KERNELS
+  __builtin_cpu_init();
+  variants.push_back({__builtin_cpu_supports("sse2") != 0,
+                      {"SSE2",
+                       {Sse2Kernel<kDotProduct>, Sse2Kernel<kSquaredEuclideanDistance>, Sse2Kernel<kManhattanDistance>},
+                       {Sse2Kernel<kDotProduct>, Sse2Kernel<kSquaredEuclideanDistance>, Sse2Kernel<kManhattanDistance>},
+                       Sse2CosineSimilarity, Sse2CosineSimilarity,
+                       Sse2Int8Kernel<kDotProduct>, Sse2Int8Kernel<kSquaredEuclideanDistance>, NULL}});
+  variants.push_back({__builtin_cpu_supports("avx2") != 0,
+                      {"AVX2",
+                       {Avx2Kernel<kDotProduct>, Avx2Kernel<kSquaredEuclideanDistance>, Avx2Kernel<kManhattanDistance>},
+                       {Avx2Kernel<kDotProduct>, Avx2Kernel<kSquaredEuclideanDistance>, Avx2Kernel<kManhattanDistance>},
+                       Avx2CosineSimilarity, Avx2CosineSimilarity,
+                       Avx2Int8Kernel<kDotProduct>, Avx2Int8Kernel<kSquaredEuclideanDistance>, NULL}});
+  variants.push_back({__builtin_cpu_supports("avx512f") != 0,
+                      {"AVX-512",
+                       {Avx512Kernel<kDotProduct>, Avx512Kernel<kSquaredEuclideanDistance>, Avx512Kernel<kManhattanDistance>},
+                       {Avx512Kernel<kDotProduct>, Avx512Kernel<kSquaredEuclideanDistance>, Avx512Kernel<kManhattanDistance>},
+                       Avx512CosineSimilarity, Avx512CosineSimilarity,
+                       NULL, NULL, NULL}}); // AVX-512 uses the AVX2 variants of the int8 kernels
+  variants.push_back({__builtin_cpu_supports("popcnt") != 0,
+                      {"POPCNT", {NULL, NULL, NULL}, {NULL, NULL, NULL}, NULL, NULL, NULL, NULL, PopcntHammingFilter}});
+  variants.push_back({__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"),
+                      {"AVX-512 VPOPCNTDQ", {NULL, NULL, NULL}, {NULL, NULL, NULL}, NULL, NULL, NULL, NULL, Avx512HammingFilter}});
+#endif
+  return variants;
+}
+
+class KernelTest {
+// Counts the checks of the variants and prints the failed ones.
+ public:
+  KernelTest() : num_of_checks_(0), num_of_failures_(0) {}
+
+  void Check(const std::string& name, const unsigned size, const unsigned offset, const double result, const double expected) {
+  // Compares "result" with "expected" (the result of the scalar version); both
+  // may be NaN (e.g. the cosine similarity of empty vectors).
+    num_of_checks_++;
+    const bool is_equal((std::isnan(expected))? std::isnan(result) : std::fabs(result-expected) <= kTolerance*(1+std::fabs(expected)));
+    if (!is_equal) {
+      num_of_failures_++;
+      std::cout << "FAILED: " << name << " (size = " << size << ", offset = " << offset << "): " << result << " instead of " << expected << '\n';
+    }
+  }
+
+  unsigned NumOfChecks() const {
+    return num_of_checks_;
+  }
+
+  unsigned NumOfFailures() const {
+    return num_of_failures_;
+  }
+
+ private:
+  unsigned num_of_checks_, num_of_failures_;
+};
+
+template <typename T>
+void FillRandomly(AlignedArray<T>& vec, std::mt19937& generator) {
+  std::uniform_real_distribution<double> distribution(-1, 1);
+  for (std::size_t i = 0; i < vec.Size(); ++i)
+    vec.Data()[i] = static_cast<T>(distribution(generator));
+}
+
+template <typename T>
+void CheckKernels(const char* instruction_set, double (* const kernels[3])(const T*, const T*, const unsigned), double (*cosine_similarity)(const T*, const T*, const unsigned), const char* type, std::mt19937& generator, KernelTest& test) {
+// Compares the kernels of one variant for "T"s with the scalar versions.
+  AlignedArray<T> vec0(kMaxSize+kMaxOffset), vec1(kMaxSize+kMaxOffset);
+  FillRandomly(vec0, generator);
+  FillRandomly(vec1, generator);
+  for (const unsigned size : kSizes) {
+    for (unsigned offset = 0; offset <= kMaxOffset; ++offset) {
+      const T* x(vec0.Data()+offset);
+      const T* y(vec1.Data()+offset);
+      const std::string prefix(std::string(instruction_set)+" "+type+" ");
+      test.Check(prefix+kOperationNames[kDotProduct], size, offset, kernels[kDotProduct](x, y, size), ScalarKernel<kDotProduct, T>(x, y, size));
+      test.Check(prefix+kOperationNames[kSquaredEuclideanDistance], size, offset, kernels[kSquaredEuclideanDistance](x, y, size), ScalarKernel<kSquaredEuclideanDistance, T>(x, y, size));
+      test.Check(prefix+kOperationNames[kManhattanDistance], size, offset, kernels[kManhattanDistance](x, y, size), ScalarKernel<kManhattanDistance, T>(x, y, size));
+      test.Check(prefix+"CosineSimilarity", size, offset, cosine_similarity(x, y, size), ScalarCosineSimilarity<T>(x, y, size));
+    }
+  }
+}
+
+void CheckInt8Kernels(const Kernels& kernels, std::mt19937& generator, KernelTest& test) {
+// Compares the int8 kernels of one variant with the scalar versions (using
+// codes from -127 to 127 like the quantized rows of a "VecStore").
+  AlignedArray<int8_t> vec0(kMaxSize+kMaxOffset), vec1(kMaxSize+kMaxOffset);
+  std::uniform_int_distribution<int> distribution(-127, 127);
+  for (std::size_t i = 0; i < vec0.Size(); ++i) {
+    vec0.Data()[i] = (int8_t)distribution(generator);
+    vec1.Data()[i] = (int8_t)distribution(generator);
+  }
+  for (const unsigned size : kSizes) {
+    for (unsigned offset = 0; offset <= kMaxOffset; ++offset) {
+      const int8_t* x(vec0.Data()+offset);
+      const int8_t* y(vec1.Data()+offset);
+      test.Check(std::string(kernels.instruction_set)+" int8 DotProduct", size, offset, kernels.int8_dot_product(x, y, size), ScalarInt8DotProduct(x, y, size));
+      test.Check(std::string(kernels.instruction_set)+" int8 SquaredEuclideanDistance", size, offset, kernels.int8_squared_euclidean_distance(x, y, size), ScalarInt8SquaredEuclideanDistance(x, y, size));
+    }
+  }
+}
+
+void CheckHammingFilter(const Kernels& kernels, std::mt19937& generator, KernelTest& test) {
+// Compares the rows found by the Hamming filter of one variant with the ones
+// found by the scalar version (for signatures of 1 to 17 words, so the last
+// group of words of the AVX-512 variant is incomplete as well).
+  const std::size_t kNumOfRows = 100;
+  for (const unsigned num_of_words : {1u, 2u, 7u, 8u, 9u, 17u}) {
+    std::vector<uint64_t> signatures(kNumOfRows*num_of_words), query(num_of_words);
+    for (auto& word : signatures)
+      word = ((uint64_t)generator() << 32) | generator();
+    for (auto& word : query)
+      word = ((uint64_t)generator() << 32) | generator();
+    for (const unsigned max_distance : {0u, 24u, 28u, 32u, 64u}) {
+      std::vector<uint32_t> rows(kNumOfRows), expected_rows(kNumOfRows);
+      const std::size_t num_of_found_rows(kernels.hamming_filter(signatures.data(), query.data(), num_of_words, kNumOfRows, max_distance, rows.data()));
+      const std::size_t num_of_expected_rows(ScalarHammingFilter(signatures.data(), query.data(), num_of_words, kNumOfRows, max_distance, expected_rows.data()));
+      rows.resize(num_of_found_rows);
+      expected_rows.resize(num_of_expected_rows);
+      test.Check(std::string(kernels.instruction_set)+" FilterByHammingDistance (max. distance "+std::to_string(max_distance)+", number of rows found)", num_of_words, 0, num_of_found_rows, num_of_expected_rows);
+      test.Check(std::string(kernels.instruction_set)+" FilterByHammingDistance (max. distance "+std::to_string(max_distance)+", rows found)", num_of_words, 0, rows == expected_rows, 1);
+    }
+  }
+}
+
+} // namespace
+
+int main() {
+  std::mt19937 generator(2019);
+  KernelTest test;
+  for (const auto& variant : GetVariants()) {
+    if (!variant.is_supported) {
+      std::cout << variant.kernels.instruction_set << ": skipped (not supported by this CPU)" << '\n';
+      continue;
+    }
+    const unsigned num_of_checks(test.NumOfChecks()), num_of_failures(test.NumOfFailures());
+    if (variant.kernels.float_kernels[0]) {
+      CheckKernels<float>(variant.kernels.instruction_set, variant.kernels.float_kernels, variant.kernels.float_cosine_similarity, "float", generator, test);
+      CheckKernels<double>(variant.kernels.instruction_set, variant.kernels.double_kernels, variant.kernels.double_cosine_similarity, "double", generator, test);
+    }
+    if (variant.kernels.int8_dot_product)
+      CheckInt8Kernels(variant.kernels, generator, test);
+    if (variant.kernels.hamming_filter)
+      CheckHammingFilter(variant.kernels, generator, test);
+    std::cout << variant.kernels.instruction_set << ": " << test.NumOfChecks()-num_of_checks << " checks, " << test.NumOfFailures()-num_of_failures << " failed" << '\n';
+  }
+  std::cout << "Kernels chosen for this CPU: " << VecCalc::InstructionSet() << std::endl;
+  return (test.NumOfFailures() > 0)? 1 : 0;
+}
@@ -0,0 +1,332 @@
+// vec_sim_table_test.cc
+
+// Copyright 2019 E. Decker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Reference checks of "VecSimTable" on a generated word vector file (with
+// some words sharing their vectors, so there are ties):
+//   pair indices   "PairIndex()" and "GetPair()" are inverse to each other and
+//                  enumerate the pairs row by row (for all pairs of the test
+//                  file and the first and last pairs of rows of tables with up
+//                  to 3,000,000 words)
+//   lazy tables    a table without planes ("VecSimMeasures::kNone") returns
+//                  exactly the same values and pairs as a table with planes
+//   value index    the pairs found with "BuildValueIndex()" are exactly the
+//                  ones found by scanning the planes
+//   disk table     an interrupted build only calculates the missing tiles and
+//                  results in the same file as an uninterrupted one
+// Run by "make test"; returns 1 if any check failed.
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../word_vec_lib/vec_sim_table_disk.cc" // the layout of the disk table ("DiskTableHeader") is only visible in this translation unit
+
+namespace {
+
+const int kNumOfWords = 600; // a disk table of these words has got 3 tile rows (6 tiles)
+const int kNumOfDuplicates = 20; // additional words sharing the vectors of the first words
+const int kVecSize = 24;
+const unsigned kNumsOfPairs[5] = {0, 1, 3, 10, 57}; // "k" of the queries of the value index
+
+class QuietOutput {
+// Discards everything written to std::cout while it exists (the progress
+// messages of the "VecSimTable").
+ public:
+  QuietOutput() : buffer_(std::cout.rdbuf(stream_.rdbuf())) {}
+
+  ~QuietOutput() {
+    std::cout.rdbuf(buffer_);
+  }
+
+ private:
+  std::ostringstream stream_;
+  std::streambuf* buffer_;
+};
+
+void WriteVecFile(const std::string& file) {
+// Writes "kNumOfWords" random word vectors (and "kNumOfDuplicates" copies of
+// the first ones) to "file".
+  std::mt19937 generator(2019);
+  std::normal_distribution<double> distribution(0, 1);
+  std::vector<std::string> lines(kNumOfWords);
+  std::ofstream file_stream(file);
+  for (int i = 0; i < kNumOfWords; ++i) {
+    std::ostringstream line;
+    for (int j = 0; j < kVecSize; ++j)
+      line << ' ' << distribution(generator);
+    lines[i] = line.str();
+    file_stream << 'w' << i << lines[i] << '\n';
+  }
+  for (int i = 0; i < kNumOfDuplicates; ++i)
+    file_stream << 'd' << i << lines[i] << '\n';
+}
+
+std::string ReadFile(const std::string& file) {
+  std::ifstream file_stream(file, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file_stream), std::istreambuf_iterator<char>());
+}
+
+} // namespace
+
+class VecSimTableTest {
+// Runs the checks on the word vectors in "vec_file" and counts the failed
+// ones (a friend of "VecSimTable", so the pair indices can be checked
+// directly).
+ public:
+  VecSimTableTest(const std::string& vec_file, const std::string& disk_table_file, const std::string& reference_disk_table_file)
+      : vec_file_(vec_file),
+        disk_table_file_(disk_table_file),
+        reference_disk_table_file_(reference_disk_table_file),
+        num_of_checks_(0),
+        num_of_failures_(0) {}
+
+  void CheckPairIndices();
+
+  void CheckLazyTable();
+
+  void CheckValueIndex();
+
+  void CheckDiskTableResume();
+
+  unsigned NumOfFailures() const {
+    return num_of_failures_;
+  }
+
+ private:
+  const std::string vec_file_, disk_table_file_, reference_disk_table_file_;
+  unsigned num_of_checks_, num_of_failures_;
+
+  std::unique_ptr<VecSimTable> LoadTable(const VecPrecision precision, const VecSimMeasures measures) {
+    QuietOutput quiet_output;
+    return std::unique_ptr<VecSimTable>(new VecSimTable(vec_file_, true, 1., precision, measures));
+  }
+
+  void Check(const bool passed, const std::string& description) {
+    num_of_checks_++;
+    if (!passed) {
+      num_of_failures_++;
+      std::cout << "FAILED: " << description << '\n';
+    }
+  }
+
+  template <typename Function>
+  void RunChecks(const std::string& name, Function&& function) {
+  // Calls "function()" and prints the number of checks it made.
+    const unsigned num_of_checks(num_of_checks_), num_of_failures(num_of_failures_);
+    function();
+    std::cout << name << ": " << num_of_checks_-num_of_checks << " checks, " << num_of_failures_-num_of_failures << " failed" << std::endl;
+  }
+
+  void CheckEqualValues(VecSimTable& table, VecSimTable& reference_table, const double tolerance, const std::string& description);
+};
+
+void VecSimTableTest::CheckPairIndices() {
+// Checks all pairs of the test file and, for larger tables (only "vec_num_"
+// is changed; the planes aren't needed), the first and last pairs of some
+// rows, the last pair of the table and pairs at random indices.
+  RunChecks("Pair indices", [&]() {
+    std::unique_ptr<VecSimTable> table(LoadTable(VecPrecision::kDouble, VecSimMeasures::kNone));
+    const int vec_num(table->vec_num_);
+    std::size_t index(0);
+    bool is_valid(true);
+    for (int i = 0; i < vec_num; ++i) {
+      for (int j = i+1; j < vec_num; ++j, ++index)
+        is_valid = is_valid && table->PairIndex(i, j) == index && table->PairIndex(j, i) == index && table->GetPair(index) == std::make_pair(i, j);
+    }
+    Check(is_valid && index == table->NumOfPairs(), "the pairs of " + std::to_string(vec_num) + " words aren't numbered row by row");
+    std::mt19937_64 generator(2019);
+    for (const int n : {2, 3, 4097, 92682, 92683, 200000, 3000000}) {
+      table->vec_num_ = n;
+      const std::string words(" (" + std::to_string(n) + " words)");
+      Check(table->HasWideValueIndex() == (n > 92682), "the value index has got the wrong width" + words);
+      Check(table->GetPair(0) == std::make_pair(0, 1) && table->GetPair(table->NumOfPairs()-1) == std::make_pair(n-2, n-1), "the first or last pair is wrong" + words);
+      for (const int i : {0, 1, n/3, n/2, n-3, n-2}) {
+        if (i < 0 || i > n-2)
+          continue;
+        Check(table->GetPair(table->RowStart(i)) == std::make_pair(i, i+1), "the first pair of row " + std::to_string(i) + " is wrong" + words);
+        Check(table->GetPair(table->PairIndex(i, n-1)) == std::make_pair(i, n-1), "the last pair of row " + std::to_string(i) + " is wrong" + words);
+        Check(table->PairIndex(i, n-1)+1 == ((i < n-2)? table->RowStart(i+1) : table->NumOfPairs()), "row " + std::to_string(i) + " doesn't end where the next one starts" + words);
+      }
+      std::uniform_int_distribution<std::size_t> distribution(0, table->NumOfPairs()-1);
+      is_valid = true;
+      for (int k = 0; k < 10000; ++k) {
+        const std::size_t random_index(distribution(generator));
+        const std::pair<int, int> pair(table->GetPair(random_index));
+        is_valid = is_valid && pair.first >= 0 && pair.first < pair.second && pair.second < n && table->PairIndex(pair.first, pair.second) == random_index;
+      }
+      Check(is_valid, "\"GetPair()\" isn't the inverse of \"PairIndex()\" at random indices" + words);
+    }
+    table->vec_num_ = vec_num;
+  });
+}
+
+void VecSimTableTest::CheckEqualValues(VecSimTable& table, VecSimTable& reference_table, const double tolerance, const std::string& description) {
+// Compares the cosine similarities and Euclidean distances of all pairs of
+// "table" with the ones of "reference_table" (relative to their magnitude).
+  unsigned num_of_differences(0);
+  const std::vector<std::string>& words(reference_table.words_);
+  for (std::size_t i = 0; i < words.size(); ++i) {
+    for (std::size_t j = i+1; j < words.size(); ++j) {
+      const double cos_sim(reference_table.GetCosSim(words[i], words[j])), eucl_dist(reference_table.GetEuclDist(words[i], words[j]));
+      if (std::fabs(table.GetCosSim(words[i], words[j])-cos_sim) > tolerance*(1+std::fabs(cos_sim)))
+        num_of_differences++;
+      if (std::fabs(table.GetEuclDist(words[i], words[j])-eucl_dist) > tolerance*(1+eucl_dist))
+        num_of_differences++;
+    }
+  }
+  Check(num_of_differences == 0, description + " (" + std::to_string(num_of_differences) + " values differ)");
+}
+
+void VecSimTableTest::CheckLazyTable() {
+// Compares a table calculating the values on demand (with a small pair cache,
+// so values get evicted) with a table holding both planes.
+  RunChecks("Lazy tables", [&]() {
+    for (const VecPrecision precision : {VecPrecision::kDouble, VecPrecision::kFloat, VecPrecision::kHalf}) {
+      const std::string name(" (precision " + std::to_string((int)precision) + ")");
+      std::unique_ptr<VecSimTable> table(LoadTable(precision, VecSimMeasures::kAll)), lazy_table(LoadTable(precision, VecSimMeasures::kNone));
+      lazy_table->SetPairCacheSize(64);
+      CheckEqualValues(*lazy_table, *table, 0, "the values of the lazy table differ" + name);
+      for (const char* mode : {"cos", "eucldist"}) {
+        for (const auto& pair : std::vector<std::pair<std::string, std::string>>{{"w3", "w9"}, {"w0", "d0"}, {"w17", "w599"}}) {
+          const std::string query(" for (" + pair.first + ", " + pair.second + ", " + mode + ")" + name);
+          Check(lazy_table->SimilarPairs(pair, mode, 0.05) == table->SimilarPairs(pair, mode, 0.05), "\"SimilarPairs()\" differs" + query);
+          Check(lazy_table->MostSimilarPairs(pair, mode, 30) == table->MostSimilarPairs(pair, mode, 30), "\"MostSimilarPairs()\" differs" + query);
+        }
+        Check(lazy_table->MostSimilarPairs(0.7, mode, 7) == table->MostSimilarPairs(0.7, mode, 7), "\"MostSimilarPairs(0.7)\" differs for " + std::string(mode) + name);
+      }
+    }
+  });
+}
+
+void VecSimTableTest::CheckValueIndex() {
+// Compares the pairs found with and without the value index for random
+// values, the values of stored pairs and the values of the duplicates (ties).
+  RunChecks("Value index", [&]() {
+    for (const VecSimMeasures measures : {VecSimMeasures::kAll, VecSimMeasures::kCosine, VecSimMeasures::kEuclidean}) {
+      const std::string name(" (measures " + std::to_string((int)measures) + ")");
+      std::unique_ptr<VecSimTable> table(LoadTable(VecPrecision::kDouble, measures)), indexed_table(LoadTable(VecPrecision::kDouble, measures));
+      {
+        QuietOutput quiet_output;
+        Check(indexed_table->BuildValueIndex(), "the value index couldn't be built" + name);
+      }
+      std::mt19937 generator(2019);
+      for (int q = 0; q < 200; ++q) {
+        const bool cos_sim(q%2 == 1);
+        const char* mode((cos_sim)? "cos" : "eucl_dist");
+        double value((cos_sim)? std::uniform_real_distribution<double>(-1.2, 1.2)(generator) : std::uniform_real_distribution<double>(-1, 12)(generator));
+        if (q%7 == 0)
+          value = (cos_sim)? table->GetCosSim("w1", "w5") : table->GetEuclDist("w1", "w5");
+        if (q%11 == 0)
+          value = (cos_sim)? 1 : 0; // the value of the duplicates
+        const unsigned k(kNumsOfPairs[q%5]);
+        const std::string word0("w" + std::to_string(q%30)), word1((q%3 == 0)? "d" + std::to_string(q%kNumOfDuplicates) : "w" + std::to_string(q+40));
+        const std::string query(" for " + std::to_string(value) + " (" + mode + ", k = " + std::to_string(k) + ")" + name);
+        Check(indexed_table->MostSimilarPairs(value, mode, k) == table->MostSimilarPairs(value, mode, k), "\"MostSimilarPairs()\" differs" + query);
+        Check(indexed_table->SimilarPairs(value, mode, 0.01) == table->SimilarPairs(value, mode, 0.01), "\"SimilarPairs()\" differs" + query);
+        Check(indexed_table->MostSimilarPairs(word0, word1, mode, k) == table->MostSimilarPairs(word0, word1, mode, k), "\"MostSimilarPairs()\" differs for (" + word0 + ", " + word1 + ")" + query);
+        Check(indexed_table->SimilarPairs(word0, word1, mode, 0.02) == table->SimilarPairs(word0, word1, mode, 0.02), "\"SimilarPairs()\" differs for (" + word0 + ", " + word1 + ")" + query);
+      }
+    }
+  });
+}
+
+void VecSimTableTest::CheckDiskTableResume() {
+// Builds a reference disk table, removes three tiles from a copy of it (their
+// flags and values) and overwrites the values of a fourth tile that stays
+// marked as finished: the resumed build has to restore exactly the removed
+// tiles and must not touch the finished one. A build with other settings has
+// to fail and keep the mapped table.
+  RunChecks("Disk table", [&]() {
+    std::remove(reference_disk_table_file_.c_str());
+    std::remove(disk_table_file_.c_str());
+    std::unique_ptr<VecSimTable> table(LoadTable(VecPrecision::kDouble, VecSimMeasures::kAll)), disk_table(LoadTable(VecPrecision::kDouble, VecSimMeasures::kNone));
+    {
+      QuietOutput quiet_output;
+      Check(disk_table->BuildDiskTable(reference_disk_table_file_, VecPrecision::kFloat) && disk_table->BuildDiskTable(disk_table_file_, VecPrecision::kFloat), "the disk tables couldn't be built");
+    }
+    const std::string reference(ReadFile(reference_disk_table_file_));
+    Check(ReadFile(disk_table_file_) == reference, "two builds of the same disk table differ");
+    DiskTableHeader header;
+    std::memcpy(&header, reference.data(), sizeof(header));
+    const std::size_t tile_bytes((std::size_t)header.tile_rows*header.tile_rows*SizeOfPrecision((VecPrecision)header.scalar_type));
+    Check(header.num_of_tiles == 6, "the test file doesn't result in 6 tiles");
+    auto overwrite_tile([&](const int tile, const bool is_finished) {
+      std::fstream file_stream(disk_table_file_, std::ios::in | std::ios::out | std::ios::binary);
+      file_stream.seekp(header.tile_flags_offset+tile);
+      file_stream.put(is_finished);
+      const std::string garbage(tile_bytes, 0x55);
+      for (int plane = 0; plane < 2; ++plane) {
+        file_stream.seekp(header.planes_offset+plane*header.plane_size+tile*tile_bytes);
+        file_stream.write(garbage.data(), garbage.size());
+      }
+    });
+    for (const int tile : {0, 2, 5})
+      overwrite_tile(tile, false);
+    overwrite_tile(4, true);
+    std::unique_ptr<VecSimTable> resumed_table(LoadTable(VecPrecision::kDouble, VecSimMeasures::kNone));
+    {
+      QuietOutput quiet_output;
+      Check(resumed_table->BuildDiskTable(disk_table_file_, VecPrecision::kFloat), "the build couldn't be resumed");
+    }
+    std::string resumed(ReadFile(disk_table_file_));
+    bool is_garbage(resumed.size() == reference.size());
+    for (int plane = 0; is_garbage && plane < 2; ++plane) {
+      const std::size_t offset(header.planes_offset+plane*header.plane_size+4*tile_bytes);
+      is_garbage = (resumed.compare(offset, tile_bytes, std::string(tile_bytes, 0x55)) == 0);
+      resumed.replace(offset, tile_bytes, reference, offset, tile_bytes);
+    }
+    Check(is_garbage, "the resumed build calculated a finished tile again");
+    Check(resumed == reference, "the resumed build doesn't restore the missing tiles");
+    overwrite_tile(4, false);
+    {
+      QuietOutput quiet_output;
+      Check(resumed_table->BuildDiskTable(disk_table_file_, VecPrecision::kFloat), "the build couldn't be resumed a second time");
+    }
+    Check(ReadFile(disk_table_file_) == reference, "the second resumed build doesn't restore the missing tile");
+    CheckEqualValues(*resumed_table, *table, 1e-6, "the values of the disk table differ from the ones in memory");
+    {
+      QuietOutput quiet_output;
+      Check(!resumed_table->BuildDiskTable(disk_table_file_, VecPrecision::kHalf), "a disk table with other settings was accepted");
+    }
+    CheckEqualValues(*resumed_table, *table, 1e-6, "the disk table wasn't kept after a failed build");
+    resumed_table->CloseDiskTable();
+    disk_table->CloseDiskTable();
+    std::remove(reference_disk_table_file_.c_str());
+    std::remove(disk_table_file_.c_str());
+  });
+}
+
+int main() {
+  const std::filesystem::path directory(std::filesystem::temp_directory_path());
+  const std::string vec_file((directory/"word_vec_lib_test_vecs.txt").string());
+  WriteVecFile(vec_file);
+  VecSimTableTest test(vec_file, (directory/"word_vec_lib_test_table.wvls").string(), (directory/"word_vec_lib_test_reference_table.wvls").string());
+  test.CheckPairIndices();
+  test.CheckLazyTable();
+  test.CheckValueIndex();
+  test.CheckDiskTableResume();
+  std::remove(vec_file.c_str());
+  return (test.NumOfFailures() > 0)? 1 : 0;
+}
@@ -0,0 +1,198 @@
+// vec_store_test.cc
+
+// Copyright 2019 E. Decker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Reference checks of "VecStore" on a generated word vector file:
+//   pruned search   the searches with "SetPrunedSearch(true)" return exactly
+//                   the same words as full scans (also for k = 0 and for k
+//                   larger than the number of words)
+//   similarities    "GetSimilarity()" of rows stored as "Half"s or "BFloat16"s
+//                   is as precise as the stored vectors allow (i.e. it only
+//                   differs from the value calculated from the vectors
+//                   returned by "GetVec()" by the rounding of "float"s)
+// Run by "make test"; returns 1 if any check failed.
+
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../word_vec_lib/word_vec_lib.h"
+
+namespace {
+
+const int kNumOfWords = 500;
+const int kVecSize = 24;
+const int kNumOfQueries = 10;
+const unsigned kNumsOfWordVecs[4] = {0, 1, 7, kNumOfWords+5}; // "k" of the searches
+const VecPrecision kPrecisions[4] = {VecPrecision::kDouble, VecPrecision::kFloat, VecPrecision::kHalf, VecPrecision::kBFloat16};
+const char* const kPrecisionNames[4] = {"double", "float", "half", "bfloat16"};
+const double kTolerance = 1e-5; // relative difference allowed between the similarities
+
+class QuietOutput {
+// Discards everything written to std::cout while it exists (the progress
+// messages of the "VecStore").
+ public:
+  QuietOutput() : buffer_(std::cout.rdbuf(stream_.rdbuf())) {}
+
+  ~QuietOutput() {
+    std::cout.rdbuf(buffer_);
+  }
+
+ private:
+  std::ostringstream stream_;
+  std::streambuf* buffer_;
+};
+
+void WriteVecFile(const std::string& file) {
+// Writes "kNumOfWords" random word vectors (with norms from about 1 to 5, so
+// the pruned searches can skip rows) to "file".
+  std::mt19937 generator(2019);
+  std::normal_distribution<double> distribution(0, 1);
+  std::uniform_real_distribution<double> scale_distribution(0.2, 1.);
+  std::ofstream file_stream(file);
+  for (int i = 0; i < kNumOfWords; ++i) {
+    const double scale(scale_distribution(generator));
+    file_stream << 'w' << i;
+    for (int j = 0; j < kVecSize; ++j)
+      file_stream << ' ' << scale*distribution(generator);
+    file_stream << '\n';
+  }
+}
+
+std::vector<std::string> Words(const std::list<WordVec*>& word_vecs) {
+  std::vector<std::string> words;
+  for (const WordVec* wv : word_vecs)
+    words.push_back(wv->word);
+  return words;
+}
+
+std::vector<std::vector<double>> GetQueries() {
+  std::mt19937 generator(2020);
+  std::normal_distribution<double> distribution(0, 1);
+  std::vector<std::vector<double>> queries(kNumOfQueries, std::vector<double>(kVecSize));
+  for (auto& query : queries) {
+    for (auto& value : query)
+      value = distribution(generator);
+  }
+  return queries;
+}
+
+} // namespace
+
+class VecStoreTest {
+// Runs the checks on the word vectors in "vec_file" and counts the failed
+// ones.
+ public:
+  VecStoreTest(const std::string& vec_file) : vec_file_(vec_file), num_of_checks_(0), num_of_failures_(0) {}
+
+  void CheckPrunedSearch();
+
+  void CheckSimilarities();
+
+  unsigned NumOfFailures() const {
+    return num_of_failures_;
+  }
+
+ private:
+  const std::string vec_file_;
+  unsigned num_of_checks_, num_of_failures_;
+
+  std::unique_ptr<VecStore> LoadStore(const VecPrecision precision) {
+    QuietOutput quiet_output;
+    return std::unique_ptr<VecStore>(new VecStore(vec_file_, true, 1., precision));
+  }
+
+  void Check(const bool passed, const std::string& description) {
+    num_of_checks_++;
+    if (!passed) {
+      num_of_failures_++;
+      std::cout << "FAILED: " << description << '\n';
+    }
+  }
+
+  template <typename Function>
+  void RunChecks(const std::string& name, Function&& function) {
+  // Calls "function()" and prints the number of checks it made.
+    const unsigned num_of_checks(num_of_checks_), num_of_failures(num_of_failures_);
+    function();
+    std::cout << name << ": " << num_of_checks_-num_of_checks << " checks, " << num_of_failures_-num_of_failures << " failed" << std::endl;
+  }
+};
+
+void VecStoreTest::CheckPrunedSearch() {
+// Compares the closest and the most distant words found with and without
+// "SetPrunedSearch()" for every precision.
+  RunChecks("Pruned search", [&]() {
+    const std::vector<std::vector<double>> queries(GetQueries());
+    for (int p = 0; p < 4; ++p) {
+      std::unique_ptr<VecStore> store(LoadStore(kPrecisions[p]));
+      for (const unsigned k : kNumsOfWordVecs) {
+        for (std::size_t q = 0; q < queries.size(); ++q) {
+          const std::string description(std::string(" (") + kPrecisionNames[p] + ", k = " + std::to_string(k) + ", query " + std::to_string(q) + ")");
+          store->SetPrunedSearch(false);
+          const std::vector<std::string> closest(Words(store->KClosestWordVecs(queries[q], k))), most_distant(Words(store->KMostDistantWordVecs(queries[q], k)));
+          store->SetPrunedSearch(true);
+          const std::vector<std::string> pruned_closest(Words(store->KClosestWordVecs(queries[q], k))), pruned_most_distant(Words(store->KMostDistantWordVecs(queries[q], k)));
+          Check(pruned_closest == closest, "the pruned search found other closest words" + description);
+          Check(pruned_most_distant == most_distant, "the pruned search found other most distant words" + description);
+          Check(pruned_closest.size() == std::min<unsigned>(k, kNumOfWords), "the pruned search found the wrong number of words" + description);
+        }
+      }
+    }
+  });
+}
+
+void VecStoreTest::CheckSimilarities() {
+// Compares the Euclidean distances and cosine similarities of pairs of words
+// with the ones calculated in "double"s from the stored vectors.
+  RunChecks("Similarities", [&]() {
+    for (int p = 0; p < 4; ++p) {
+      std::unique_ptr<VecStore> store(LoadStore(kPrecisions[p]));
+      for (int i = 0; i+1 < kNumOfWords; i += 25) {
+        const std::string word0("w" + std::to_string(i)), word1("w" + std::to_string(i+1));
+        const std::vector<double> vec0(store->GetVec(word0)), vec1(store->GetVec(word1));
+        double squared_distance(0), dot_product(0), norm0(0), norm1(0);
+        for (int j = 0; j < kVecSize; ++j) {
+          squared_distance += (vec0[j]-vec1[j])*(vec0[j]-vec1[j]);
+          dot_product += vec0[j]*vec1[j];
+          norm0 += vec0[j]*vec0[j];
+          norm1 += vec1[j]*vec1[j];
+        }
+        const double distance(std::sqrt(squared_distance)), cosine_similarity(dot_product/std::sqrt(norm0*norm1));
+        const std::string description(std::string(" (") + kPrecisionNames[p] + ", " + word0 + " and " + word1 + ")");
+        Check(std::fabs(store->GetSimilarity({word0, word1}, "euclidean distance")-distance) <= kTolerance*distance, "the Euclidean distance is imprecise" + description);
+        Check(std::fabs(store->GetSimilarity({word0, word1})-cosine_similarity) <= kTolerance, "the cosine similarity is imprecise" + description);
+      }
+    }
+  });
+}
+
+int main() {
+  const std::string vec_file((std::filesystem::temp_directory_path()/"word_vec_lib_test_store_vecs.txt").string());
+  WriteVecFile(vec_file);
+  VecStoreTest test(vec_file);
+  test.CheckPrunedSearch();
+  test.CheckSimilarities();
+  std::remove(vec_file.c_str());
+  return (test.NumOfFailures() > 0)? 1 : 0;
+}
@@ -71,12 +71,8 @@ void VecPrint::PrintWordPairList(const std::list<std::pair<std::pair<std::string
   std::cout << "--- END WordPairList.   ---" << std::endl;
 }
 
-std::vector<double> VecCalc::Add(const std::list<WordVec*> wvs) {
+std::vector<double> VecCalc::Add(const std::list<WordVec*>& wvs) {
 // Adds all vectors of the "WordVec"s stored in a std::vector ("wvs") and
-// returns the resulting vector.
-  std::vector<std::vector<double>> vecs;
-  vecs.reserve(wvs.size());
-  for (auto wv : wvs)
-    vecs.push_back(wv->vec);
-  return Add(vecs);
+// returns the resulting vector (without copying them first).
+  return Sum(wvs);
 }
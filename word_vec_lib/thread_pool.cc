@@ -0,0 +1,92 @@
+// thread_pool.cc
+
+// Copyright 2019 E. Decker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "word_vec_lib.h"
+
+ThreadPool::ThreadPool(const unsigned num_of_threads)
+// Starts "num_of_threads"-1 worker threads (the thread calling
+// "ParallelFor()" is the last one); if "num_of_threads" is 0 one thread per
+// core will be used.
+    : task_(NULL),
+      num_of_tasks_(0),
+      next_task_(0),
+      unfinished_tasks_(0),
+      generation_(0),
+      stop_(false) {
+  const unsigned num_of_workers(((num_of_threads > 0)? num_of_threads : std::max(1u, std::thread::hardware_concurrency()))-1);
+  for (unsigned i = 0; i < num_of_workers; ++i)
+    workers_.emplace_back(&ThreadPool::Work, this);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  start_.notify_all();
+  for (auto& worker : workers_)
+    worker.join();
+}
+
+void ThreadPool::ParallelFor(const unsigned num_of_tasks, const std::function<void(const unsigned)>& task) {
+// Calls "task(i)" for every i from 0 to "num_of_tasks"-1 on the threads of
+// the pool and returns when all calls have returned. Loops started by several
+// threads at the same time run one after another; "task" mustn't start a loop
+// on the same pool itself.
+  if (workers_.empty() || num_of_tasks < 2) {
+    for (unsigned i = 0; i < num_of_tasks; ++i)
+      task(i);
+    return;
+  }
+  std::lock_guard<std::mutex> run_lock(run_mutex_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  task_ = &task;
+  num_of_tasks_ = num_of_tasks;
+  next_task_ = 0;
+  unfinished_tasks_ = num_of_tasks;
+  generation_++;
+  start_.notify_all();
+  RunTasks(lock);
+  done_.wait(lock, [this] {return (unfinished_tasks_ == 0);});
+  task_ = NULL;
+}
+
+void ThreadPool::RunTasks(std::unique_lock<std::mutex>& lock) {
+// Runs the tasks of the current loop that haven't been started yet ("lock"
+// is released while a task runs).
+  while (next_task_ < num_of_tasks_) {
+    const unsigned i(next_task_++);
+    lock.unlock();
+    (*task_)(i);
+    lock.lock();
+    if (--unfinished_tasks_ == 0)
+      done_.notify_all();
+  }
+}
+
+void ThreadPool::Work() {
+// Main function of the worker threads: waits for a loop to be started and
+// helps running its tasks.
+  std::unique_lock<std::mutex> lock(mutex_);
+  uint64_t generation(0);
+  while (true) {
+    start_.wait(lock, [&] {return (stop_ || generation_ != generation);});
+    if (stop_)
+      return;
+    generation = generation_;
+    RunTasks(lock);
+  }
+}
@@ -0,0 +1,433 @@
+// vec_file.cc
+
+// Copyright 2019 E. Decker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define WORD_VEC_LIB_HAS_MMAP
+#endif
+
+#include "word_vec_lib.h"
+
+MappedFile::MappedFile(const std::string& file, const MappedFileAccess access)
+    : data_(NULL),
+      size_(0),
+      is_open_(false),
+      is_mapped_(false) {
+#ifdef WORD_VEC_LIB_HAS_MMAP
+  const int fd(open(file.c_str(), O_RDONLY));
+  if (fd < 0)
+    return;
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == 0) {
+    size_ = file_stat.st_size;
+    if (size_ == 0) {
+      is_open_ = true;
+    } else {
+      void* mapping(mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0));
+      if (mapping != MAP_FAILED) {
+        if (access != MappedFileAccess::kNormal)
+          madvise(mapping, size_, (access == MappedFileAccess::kSequential)? MADV_SEQUENTIAL : MADV_RANDOM);
+        data_ = static_cast<const char*>(mapping);
+        is_open_ = is_mapped_ = true;
+      }
+    }
+  }
+  close(fd);
+  if (is_open_)
+    return;
+#endif
+  // Fallback: reads the whole file into "buffer_".
+  std::ifstream file_stream(file, std::ios::binary);
+  if (!file_stream.is_open())
+    return;
+  buffer_.assign(std::istreambuf_iterator<char>(file_stream), std::istreambuf_iterator<char>());
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+  is_open_ = true;
+}
+
+MappedFile::~MappedFile() {
+#ifdef WORD_VEC_LIB_HAS_MMAP
+  if (is_mapped_)
+    munmap(const_cast<char*>(data_), size_);
+#endif
+}
+
+namespace {
+
+struct Chunk { // the lines of one part of a word vector file that become rows
+  const char* begin;
+  const char* end; // "begin" and "end" are aligned to the beginning of a line
+  std::vector<std::string> words;
+  std::vector<const char*> values; // the values of "words[i]" start at "values[i]"
+  std::size_t first_row; // row of "words[0]" in the matrix
+  std::size_t num_of_malformed_lines;
+  Chunk() : begin(NULL), end(NULL), first_row(0), num_of_malformed_lines(0) {}
+};
+
+inline bool IsSpace(const char c) {
+  return (c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f');
+}
+
+inline const char* SkipSpaces(const char* it, const char* const end) {
+  while (it != end && IsSpace(*it))
+    ++it;
+  return it;
+}
+
+inline const char* SkipToken(const char* it, const char* const end) {
+  while (it != end && !IsSpace(*it))
+    ++it;
+  return it;
+}
+
+inline const char* LineEnd(const char* it, const char* const end) {
+// Returns the position of the next '\n' (or "end").
+  const char* line_end(static_cast<const char*>(std::memchr(it, '\n', end-it)));
+  return (line_end)? line_end : end;
+}
+
+int CountTokens(const char* it, const char* const end) {
+// Returns the number of whitespace separated tokens between "it" and "end".
+  int count(0);
+  while ((it = SkipSpaces(it, end)) != end) {
+    it = SkipToken(it, end);
+    count++;
+  }
+  return count;
+}
+
+const char* SkipLines(const char* it, const char* const end, std::size_t num_of_lines) {
+// Returns the beginning of the line following the next "num_of_lines" lines
+// (or "end" if there are fewer lines).
+  for (; num_of_lines > 0 && it != end; --num_of_lines)
+    it = std::min(LineEnd(it, end)+1, end);
+  return it;
+}
+
+template <typename Function>
+void RunOnThreads(const unsigned num_of_threads, const Function& function) {
+// Calls "function(i)" for i = 0, ..., "num_of_threads"-1 on "num_of_threads"
+// threads (including the calling one).
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < num_of_threads; ++i)
+    threads.emplace_back([&function, i]() {function(i);});
+  function(0);
+  for (auto& thread : threads)
+    thread.join();
+}
+
+bool ParseValues(const char* it, const char* const end, const int vec_size, double* vec) {
+// Scans the values of a line of the vector file in place: the "vec_size"
+// tokens between "it" and "end" get converted and written straight to "vec".
+// (The tokens may be separated by any number of spaces or tabs.) Returns
+// "false" if the line is malformed.
+  for (int i = 0; i < vec_size; ++i) {
+    it = SkipSpaces(it, end);
+    if (it != end && *it == '+') // "std::from_chars()" does not accept a leading plus sign
+      ++it;
+    const std::from_chars_result result(std::from_chars(it, end, vec[i]));
+    if (result.ec != std::errc() || (result.ptr != end && !IsSpace(*result.ptr)))
+      return false;
+    it = result.ptr;
+  }
+  return (SkipSpaces(it, end) == end);
+}
+
+bool IsHeaderLine(const char* it, const char* const end, long& vec_num, int& vec_size) {
+// Checks whether a line is a word2vec header ("<number of vectors>
+// <dimensions>"); if so "vec_num" and "vec_size" will be set accordingly.
+  long values[2];
+  for (auto& value : values) {
+    it = SkipSpaces(it, end);
+    const std::from_chars_result result(std::from_chars(it, end, value));
+    if (result.ec != std::errc() || (result.ptr != end && !IsSpace(*result.ptr)))
+      return false;
+    it = result.ptr;
+  }
+  if (SkipSpaces(it, end) != end || values[0] < 0 || values[1] < 1)
+    return false;
+  vec_num = values[0];
+  vec_size = values[1];
+  return true;
+}
+
+void FindRows(const bool case_sensitive, const std::regex* pattern, Chunk& chunk) {
+// Collects the words of all non-empty lines of "chunk" (that match "pattern")
+// and the positions of their values.
+  for (const char* it = chunk.begin; it < chunk.end;) {
+    const char* line_end(LineEnd(it, chunk.end));
+    const char* word(SkipSpaces(it, line_end));
+    const char* word_end(SkipToken(word, line_end));
+    if (word != word_end) {
+      chunk.words.emplace_back(word, word_end);
+      if (!case_sensitive)
+        VecStore::SetToLowerCase(chunk.words.back());
+      if (!pattern || std::regex_match(chunk.words.back(), *pattern))
+        chunk.values.push_back(word_end);
+      else
+        chunk.words.pop_back();
+    }
+    it = line_end+1;
+  }
+}
+
+template <typename T, typename S>
+void StoreRow(const S* vec, const int vec_size, const std::size_t row_bytes, unsigned char* row) {
+// Converts "vec" into a row of "T"s and fills the padding of the row with
+// zeros.
+  T* values(reinterpret_cast<T*>(row));
+  for (int i = 0; i < vec_size; ++i)
+    values[i] = static_cast<T>(vec[i]);
+  std::memset(row+vec_size*sizeof(T), 0, row_bytes-vec_size*sizeof(T));
+}
+
+void AllocateMatrix(const std::size_t vec_num, VecFileContents& contents) {
+// Allocates "contents.matrix" for "vec_num" rows of "contents.vec_size"
+// values of the type given by "contents.precision".
+  contents.row_bytes = RowBytes(contents.vec_size, contents.precision);
+  contents.matrix = AlignedArray<unsigned char>(vec_num*contents.row_bytes);
+}
+
+void RemoveRows(const std::vector<char>& malformed, VecFileContents& contents) {
+// Removes the rows marked in "malformed" (keeping the order of the others);
+// the matrix gets reallocated to fit the remaining rows.
+  const std::size_t vec_num(std::count(malformed.begin(), malformed.end(), 0));
+  AlignedArray<unsigned char> matrix(vec_num*contents.row_bytes);
+  std::size_t row(0);
+  for (std::size_t i = 0; i < malformed.size(); ++i) {
+    if (malformed[i])
+      continue;
+    std::memcpy(matrix.Data()+row*contents.row_bytes, contents.matrix.Data()+i*contents.row_bytes, contents.row_bytes);
+    if (row != i)
+      contents.words[row] = std::move(contents.words[i]);
+    row++;
+  }
+  contents.words.resize(vec_num);
+  contents.matrix = std::move(matrix);
+}
+
+bool IsBinary(const char* it, const char* const end, const int vec_size) {
+// Checks whether the data following a word2vec header is stored in the binary
+// format (i.e. the first word is followed by "vec_size" raw float32 values
+// instead of their textual representations). Only the first record is
+// looked at (the words of the following lines may contain any bytes): it is
+// binary if there is a non-printable byte before the first line break, or if
+// the line ends within the bytes of the float32 values (which may contain the
+// byte of a '\n') and can't be parsed as "vec_size" textual values.
+  it = SkipToken(SkipSpaces(it, end), end);
+  if (it == end)
+    return false;
+  const char* const line_end(LineEnd(it, end));
+  const char* const values_end(it+1+std::min((std::size_t)(end-it-1), vec_size*sizeof(float)));
+  const char* value_it(it+1);
+  for (; value_it != values_end && value_it != line_end; ++value_it) {
+    const unsigned char c(*value_it);
+    if ((c < 0x20 && c != '\t' && c != '\r') || c >= 0x7f)
+      return true;
+  }
+  if (value_it == values_end)
+    return false;
+  std::vector<double> vec(vec_size);
+  return !ParseValues(it, line_end, vec_size, vec.data());
+}
+
+void ReadBinary(const char* it, const char* const end, const long vec_num_in_header, const bool case_sensitive, const double percentage, const std::regex* pattern, VecFileContents& contents) {
+// Reads the records of a binary word2vec file: every word is followed by a
+// single space and "vec_size" raw float32 values. The records to keep are
+// collected first, so their values can be converted straight into a matrix
+// of the final size.
+  const std::size_t record_bytes(contents.vec_size*sizeof(float));
+  const std::size_t max_vec_num((pattern)? vec_num_in_header : vec_num_in_header*std::max(0., std::min(1., percentage))+0.5);
+  std::vector<const char*> values;
+  std::size_t num_of_records(0);
+  while (contents.words.size() < max_vec_num && num_of_records < (std::size_t)vec_num_in_header) {
+    while (it != end && (*it == '\n' || IsSpace(*it))) // skips the line break some writers put after every record
+      ++it;
+    const char* word_end(it);
+    while (word_end != end && *word_end != ' ')
+      ++word_end;
+    if (word_end == end || (std::size_t)(end-word_end-1) < record_bytes) {
+      std::cout << "\tWARNING: the file ends after " << num_of_records << " of " << vec_num_in_header << " word vectors." << '\n';
+      break;
+    }
+    num_of_records++;
+    contents.words.emplace_back(it, word_end);
+    it = word_end+1+record_bytes;
+    if (!case_sensitive)
+      VecStore::SetToLowerCase(contents.words.back());
+    if (pattern && !std::regex_match(contents.words.back(), *pattern))
+      contents.words.pop_back();
+    else
+      values.push_back(word_end+1);
+  }
+  contents.vec_num = contents.words.size();
+  AllocateMatrix(contents.vec_num, contents);
+  DispatchPrecision(contents.precision, [&](auto zero) {
+    typedef decltype(zero) T;
+    std::vector<float> vec(contents.vec_size);
+    for (int row = 0; row < contents.vec_num; ++row) {
+      std::memcpy(vec.data(), values[row], record_bytes); // the values aren't necessarily aligned
+      StoreRow<T>(vec.data(), contents.vec_size, contents.row_bytes, contents.matrix.Data()+row*contents.row_bytes);
+    }
+  });
+}
+
+const char* EndOfKeptLines(const char* const data, const char* const data_end, const long vec_num_in_header, const double percentage, const unsigned num_of_threads) {
+// Returns the end of the first "percentage" percent of the lines between
+// "data" and "data_end" (or of the vectors given by the header), so only
+// these lines have to be parsed. Without a header the lines get counted
+// (in parallel) first.
+  if (percentage >= 1)
+    return data_end;
+  if (vec_num_in_header >= 0)
+    return SkipLines(data, data_end, vec_num_in_header*((percentage > 0)? percentage : 0)+0.5);
+  std::vector<std::size_t> num_of_line_breaks(num_of_threads, 0);
+  RunOnThreads(num_of_threads, [&](const unsigned t) {
+    const char* it(data+(data_end-data)/num_of_threads*t);
+    const char* const end((t+1 == num_of_threads)? data_end : data+(data_end-data)/num_of_threads*(t+1));
+    while ((it = static_cast<const char*>(std::memchr(it, '\n', end-it))) != NULL) {
+      num_of_line_breaks[t]++;
+      ++it;
+    }
+  });
+  std::size_t num_of_lines(0);
+  for (auto& x : num_of_line_breaks)
+    num_of_lines += x;
+  if (data != data_end && data_end[-1] != '\n')
+    num_of_lines++; // the last line isn't terminated
+  std::size_t lines_left(num_of_lines*((percentage > 0)? percentage : 0)+0.5);
+  for (unsigned t = 0; t < num_of_threads; ++t) {
+    if (lines_left <= num_of_line_breaks[t])
+      return SkipLines(data+(data_end-data)/num_of_threads*t, data_end, lines_left);
+    lines_left -= num_of_line_breaks[t];
+  }
+  return data_end;
+}
+
+void ReadText(const char* const data, const char* data_end, const long vec_num_in_header, const bool case_sensitive, const double percentage, const std::regex* pattern, VecFileContents& contents) {
+// Parses the first "percentage" percent of the lines between "data" and
+// "data_end" in two parallel passes over line-aligned chunks: the first one
+// collects the words (and applies "pattern"), so the matrix can be allocated
+// with its final size; the second one converts the values straight into
+// their rows.
+  const std::size_t min_chunk_size(1 << 20); // small files are not worth more than one thread per MiB
+  unsigned num_of_threads(std::max(1u, std::min(std::thread::hardware_concurrency(), (unsigned)((data_end-data)/min_chunk_size+1))));
+  if (!pattern)
+    data_end = EndOfKeptLines(data, data_end, vec_num_in_header, percentage, num_of_threads);
+  num_of_threads = std::max(1u, std::min(num_of_threads, (unsigned)((data_end-data)/min_chunk_size+1)));
+  std::vector<Chunk> chunks(num_of_threads);
+  chunks[0].begin = data;
+  for (unsigned i = 1; i < num_of_threads; ++i) {
+    const char* bound(std::max(chunks[i-1].begin, data+(data_end-data)/num_of_threads*i));
+    chunks[i-1].end = chunks[i].begin = std::min(LineEnd(bound, data_end)+1, data_end);
+  }
+  chunks.back().end = data_end;
+  RunOnThreads(num_of_threads, [&](const unsigned t) {
+    FindRows(case_sensitive, pattern, chunks[t]);
+  });
+  std::size_t vec_num(0);
+  for (auto& chunk : chunks) {
+    chunk.first_row = vec_num;
+    vec_num += chunk.words.size();
+  }
+  AllocateMatrix(vec_num, contents);
+  std::vector<char> malformed(vec_num, 0);
+  DispatchPrecision(contents.precision, [&](auto zero) {
+    typedef decltype(zero) T;
+    RunOnThreads(num_of_threads, [&](const unsigned t) {
+      Chunk& chunk(chunks[t]);
+      std::vector<double> vec(contents.vec_size);
+      for (std::size_t i = 0; i < chunk.values.size(); ++i) {
+        const std::size_t row(chunk.first_row+i);
+        if (!ParseValues(chunk.values[i], LineEnd(chunk.values[i], chunk.end), contents.vec_size, vec.data())) {
+          malformed[row] = 1;
+          chunk.num_of_malformed_lines++;
+        }
+        StoreRow<T>(vec.data(), contents.vec_size, contents.row_bytes, contents.matrix.Data()+row*contents.row_bytes);
+      }
+      std::vector<const char*>().swap(chunk.values);
+    });
+  });
+  contents.words.reserve(vec_num);
+  std::size_t num_of_malformed_lines(0);
+  for (auto& chunk : chunks) {
+    std::move(chunk.words.begin(), chunk.words.end(), std::back_inserter(contents.words));
+    std::vector<std::string>().swap(chunk.words);
+    num_of_malformed_lines += chunk.num_of_malformed_lines;
+  }
+  if (num_of_malformed_lines) {
+    std::cout << "\tWARNING: skipped " << num_of_malformed_lines << " line(s) not containing a word and exactly " << contents.vec_size << " values." << '\n';
+    RemoveRows(malformed, contents);
+  }
+  contents.vec_num = contents.words.size();
+}
+
+VecFileContents ReadFile(const std::string& file, const std::string& reader, const bool case_sensitive, const double percentage, const std::regex* pattern, const VecPrecision precision) {
+// Maps "file" into memory, parses it and returns the first "percentage"
+// percent of its word vectors (or all word vectors matching "pattern") as
+// values of the type given by "precision". Both text files and binary
+// word2vec files are supported.
+  VecFileContents contents;
+  contents.precision = precision;
+  const MappedFile mapped_file(file, MappedFileAccess::kSequential);
+  if (!mapped_file.IsOpen()) {
+    std::cout << "ERROR: OPENING \"" << file << "\" FAILED!\nMake sure that the file exists and that the path is correct." << std::endl;
+    return contents;
+  }
+  std::cout << "CREATING A \"" << reader << "\"." << '\n' << "Input file (\"word vector file\"): " << file << '\n';
+  const char* data(mapped_file.Data());
+  const char* const data_end(data+mapped_file.Size());
+  const char* first_line_end(LineEnd(data, data_end));
+  long vec_num_in_header(-1);
+  if (IsHeaderLine(data, first_line_end, vec_num_in_header, contents.vec_size))
+    data = std::min(first_line_end+1, data_end); // skips the header of a word2vec file
+  else
+    contents.vec_size = CountTokens(data, first_line_end)-1; // assumes that all the word vectors got the same number of dimensions
+  if (contents.vec_size < 1)
+    return contents;
+  std::cout << "\tLoading data..." << std::endl;
+  if (vec_num_in_header >= 0 && IsBinary(data, data_end, contents.vec_size))
+    ReadBinary(data, data_end, vec_num_in_header, case_sensitive, percentage, pattern, contents);
+  else
+    ReadText(data, data_end, vec_num_in_header, case_sensitive, percentage, pattern, contents);
+  std::cout << "\t---Completed." << std::endl;
+  return contents;
+}
+
+} // namespace
+
+VecFileContents VecFile::Read(const std::string& file, const std::string& reader, const bool case_sensitive, const double percentage, const VecPrecision precision) {
+// Returns the first "percentage" percent of the word vectors stored in "file"
+// (assuming that each line of a text file contains exactly one vector).
+  return ReadFile(file, reader, case_sensitive, percentage, NULL, precision);
+}
+
+VecFileContents VecFile::Read(const std::string& file, const std::string& reader, const std::regex& pattern, const bool case_sensitive, const VecPrecision precision) {
+// Returns all word vectors stored in "file" whose word matches the regex
+// "pattern".
+  return ReadFile(file, reader, case_sensitive, 1., &pattern, precision);
+}
@@ -0,0 +1,593 @@
+// vec_kernels.cc
+
+// Copyright 2019 E. Decker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The kernels every scan of a "VecStore" and every similarity of a
+// "VecSimTable" is calculated with. On x86 there are SSE2, AVX2 and AVX-512
+// variants of them; the best one the CPU supports is chosen the first time a
+// kernel is called. All variants calculate the element-wise products and
+// differences in the type of the vectors and sum them up as "double"s (like
+// the scalar versions in "word_vec_lib.h"), so they only differ from the
+// scalar versions by the order of the summation.
+// The Hamming filter of the LSH index of a "VecStore" is chosen separately
+// (it uses POPCNT or AVX-512 VPOPCNTDQ).
+
+#include <cstdint>
+
+#include "word_vec_lib.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WORD_VEC_LIB_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace {
+
+enum Operation {kDotProduct, kSquaredEuclideanDistance, kManhattanDistance};
+
+template <int operation, typename T>
+double ScalarKernel(const T* vec0, const T* vec1, const unsigned size) {
+  if (operation == kDotProduct)
+    return VecCalc::DotProduct<T, T>(vec0, vec1, size);
+  if (operation == kSquaredEuclideanDistance)
+    return VecCalc::SquaredEuclideanDistance<T, T>(vec0, vec1, size);
+  return VecCalc::ManhattanDistance<T, T>(vec0, vec1, size);
+}
+
+template <typename T>
+double ScalarCosineSimilarity(const T* vec0, const T* vec1, const unsigned size) {
+  return VecCalc::CosineSimilarity<T, T>(vec0, vec1, size);
+}
+
+int32_t ScalarInt8DotProduct(const int8_t* vec0, const int8_t* vec1, const unsigned size) {
+  int32_t x(0);
+  for (unsigned i = 0; i < size; ++i)
+    x += (int32_t)vec0[i]*vec1[i];
+  return x;
+}
+
+int32_t ScalarInt8SquaredEuclideanDistance(const int8_t* vec0, const int8_t* vec1, const unsigned size) {
+  int32_t x(0);
+  for (unsigned i = 0; i < size; ++i) {
+    const int32_t difference((int32_t)vec0[i]-vec1[i]);
+    x += difference*difference;
+  }
+  return x;
+}
+
+unsigned ScalarPopCount(uint64_t x) {
+  x -= (x >> 1) & 0x5555555555555555ull;
+  x = (x & 0x3333333333333333ull)+((x >> 2) & 0x3333333333333333ull);
+  x = (x+(x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+  return (x*0x0101010101010101ull) >> 56;
+}
+
+std::size_t ScalarHammingFilter(const uint64_t* signatures, const uint64_t* query, const unsigned num_of_words, const std::size_t num_of_rows, const unsigned max_distance, uint32_t* rows) {
+  std::size_t num_of_found_rows(0);
+  for (std::size_t row = 0; row < num_of_rows; ++row) {
+    const uint64_t* signature(signatures+row*num_of_words);
+    for (unsigned i = 0; i < num_of_words; ++i) {
+      if (ScalarPopCount(signature[i]^query[i]) <= max_distance) {
+        rows[num_of_found_rows++] = row;
+        break;
+      }
+    }
+  }
+  return num_of_found_rows;
+}
+
+template <int operation, typename T>
+double Combine(const T x, const T y) {
+// The element-wise part of an "operation" (used for the remaining elements
+// that don't fill a whole register).
+  if (operation == kDotProduct)
+    return x*y;
+  if (operation == kSquaredEuclideanDistance)
+    return (x-y)*(x-y);
+  return std::fabs(x-y);
+}
+
+#ifdef WORD_VEC_LIB_X86_KERNELS
+
+// SSE2
+
+template <int operation>
+__attribute__((target("sse2"))) __m128 CombineSse2(const __m128 x, const __m128 y) {
+  if (operation == kDotProduct)
+    return _mm_mul_ps(x, y);
+  const __m128 difference(_mm_sub_ps(x, y));
+  if (operation == kSquaredEuclideanDistance)
+    return _mm_mul_ps(difference, difference);
+  return _mm_andnot_ps(_mm_set1_ps(-0.f), difference);
+}
+
+template <int operation>
+__attribute__((target("sse2"))) __m128d CombineSse2(const __m128d x, const __m128d y) {
+  if (operation == kDotProduct)
+    return _mm_mul_pd(x, y);
+  const __m128d difference(_mm_sub_pd(x, y));
+  if (operation == kSquaredEuclideanDistance)
+    return _mm_mul_pd(difference, difference);
+  return _mm_andnot_pd(_mm_set1_pd(-0.), difference);
+}
+
+__attribute__((target("sse2"))) __m128d AddWidenedSse2(const __m128d sum, const __m128 x) {
+// Adds all four "float"s of "x" (converted to "double"s) to "sum".
+  return _mm_add_pd(_mm_add_pd(sum, _mm_cvtps_pd(x)), _mm_cvtps_pd(_mm_movehl_ps(x, x)));
+}
+
+__attribute__((target("sse2"))) double SumSse2(const __m128d x) {
+  return _mm_cvtsd_f64(_mm_add_sd(x, _mm_unpackhi_pd(x, x)));
+}
+
+template <int operation>
+__attribute__((target("sse2"))) double Sse2Kernel(const float* vec0, const float* vec1, const unsigned size) {
+  __m128d sum(_mm_setzero_pd());
+  unsigned i(0);
+  for (; i+4 <= size; i += 4)
+    sum = AddWidenedSse2(sum, CombineSse2<operation>(_mm_loadu_ps(vec0+i), _mm_loadu_ps(vec1+i)));
+  double x(SumSse2(sum));
+  for (; i < size; ++i)
+    x += Combine<operation>(vec0[i], vec1[i]);
+  return x;
+}
+
+template <int operation>
+__attribute__((target("sse2"))) double Sse2Kernel(const double* vec0, const double* vec1, const unsigned size) {
+  __m128d sum0(_mm_setzero_pd()), sum1(_mm_setzero_pd());
+  unsigned i(0);
+  for (; i+4 <= size; i += 4) {
+    sum0 = _mm_add_pd(sum0, CombineSse2<operation>(_mm_loadu_pd(vec0+i), _mm_loadu_pd(vec1+i)));
+    sum1 = _mm_add_pd(sum1, CombineSse2<operation>(_mm_loadu_pd(vec0+i+2), _mm_loadu_pd(vec1+i+2)));
+  }
+  double x(SumSse2(_mm_add_pd(sum0, sum1)));
+  for (; i < size; ++i)
+    x += Combine<operation>(vec0[i], vec1[i]);
+  return x;
+}
+
+__attribute__((target("sse2"))) double Sse2CosineSimilarity(const float* vec0, const float* vec1, const unsigned size) {
+  __m128d dot_product(_mm_setzero_pd()), norm0(_mm_setzero_pd()), norm1(_mm_setzero_pd());
+  unsigned i(0);
+  for (; i+4 <= size; i += 4) {
+    const __m128 x(_mm_loadu_ps(vec0+i)), y(_mm_loadu_ps(vec1+i));
+    dot_product = AddWidenedSse2(dot_product, _mm_mul_ps(x, y));
+    norm0 = AddWidenedSse2(norm0, _mm_mul_ps(x, x));
+    norm1 = AddWidenedSse2(norm1, _mm_mul_ps(y, y));
+  }
+  double xy(SumSse2(dot_product)), xx(SumSse2(norm0)), yy(SumSse2(norm1));
+  for (; i < size; ++i) {
+    xy += vec0[i]*vec1[i];
+    xx += vec0[i]*vec0[i];
+    yy += vec1[i]*vec1[i];
+  }
+  return xy/(std::sqrt(xx)*std::sqrt(yy));
+}
+
+__attribute__((target("sse2"))) double Sse2CosineSimilarity(const double* vec0, const double* vec1, const unsigned size) {
+  __m128d dot_product(_mm_setzero_pd()), norm0(_mm_setzero_pd()), norm1(_mm_setzero_pd());
+  unsigned i(0);
+  for (; i+2 <= size; i += 2) {
+    const __m128d x(_mm_loadu_pd(vec0+i)), y(_mm_loadu_pd(vec1+i));
+    dot_product = _mm_add_pd(dot_product, _mm_mul_pd(x, y));
+    norm0 = _mm_add_pd(norm0, _mm_mul_pd(x, x));
+    norm1 = _mm_add_pd(norm1, _mm_mul_pd(y, y));
+  }
+  double xy(SumSse2(dot_product)), xx(SumSse2(norm0)), yy(SumSse2(norm1));
+  for (; i < size; ++i) {
+    xy += vec0[i]*vec1[i];
+    xx += vec0[i]*vec0[i];
+    yy += vec1[i]*vec1[i];
+  }
+  return xy/(std::sqrt(xx)*std::sqrt(yy));
+}
+
+__attribute__((target("sse2"))) __m128i WidenInt8Sse2(const __m128i x, const bool high) {
+// Sign-extends the lower (or higher) eight int8 of "x" to int16.
+  return _mm_srai_epi16((high)? _mm_unpackhi_epi8(x, x) : _mm_unpacklo_epi8(x, x), 8);
+}
+
+__attribute__((target("sse2"))) int32_t SumInt32Sse2(__m128i x) {
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(x);
+}
+
+template <int operation>
+__attribute__((target("sse2"))) int32_t Sse2Int8Kernel(const int8_t* vec0, const int8_t* vec1, const unsigned size) {
+  __m128i sum(_mm_setzero_si128());
+  unsigned i(0);
+  for (; i+16 <= size; i += 16) {
+    const __m128i x(_mm_loadu_si128(reinterpret_cast<const __m128i*>(vec0+i))), y(_mm_loadu_si128(reinterpret_cast<const __m128i*>(vec1+i)));
+    for (const bool high : {false, true}) {
+      __m128i x16(WidenInt8Sse2(x, high)), y16(WidenInt8Sse2(y, high));
+      if (operation == kSquaredEuclideanDistance)
+        x16 = y16 = _mm_sub_epi16(x16, y16);
+      sum = _mm_add_epi32(sum, _mm_madd_epi16(x16, y16));
+    }
+  }
+  return SumInt32Sse2(sum)+((operation == kDotProduct)? ScalarInt8DotProduct(vec0+i, vec1+i, size-i) : ScalarInt8SquaredEuclideanDistance(vec0+i, vec1+i, size-i));
+}
+
+// AVX2
+
+template <int operation>
+__attribute__((target("avx2"))) __m256 CombineAvx2(const __m256 x, const __m256 y) {
+  if (operation == kDotProduct)
+    return _mm256_mul_ps(x, y);
+  const __m256 difference(_mm256_sub_ps(x, y));
+  if (operation == kSquaredEuclideanDistance)
+    return _mm256_mul_ps(difference, difference);
+  return _mm256_andnot_ps(_mm256_set1_ps(-0.f), difference);
+}
+
+template <int operation>
+__attribute__((target("avx2"))) __m256d CombineAvx2(const __m256d x, const __m256d y) {
+  if (operation == kDotProduct)
+    return _mm256_mul_pd(x, y);
+  const __m256d difference(_mm256_sub_pd(x, y));
+  if (operation == kSquaredEuclideanDistance)
+    return _mm256_mul_pd(difference, difference);
+  return _mm256_andnot_pd(_mm256_set1_pd(-0.), difference);
+}
+
+__attribute__((target("avx2"))) __m256d AddWidenedAvx2(const __m256d sum, const __m256 x) {
+// Adds all eight "float"s of "x" (converted to "double"s) to "sum".
+  return _mm256_add_pd(_mm256_add_pd(sum, _mm256_cvtps_pd(_mm256_castps256_ps128(x))), _mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)));
+}
+
+__attribute__((target("avx2"))) double SumAvx2(const __m256d x) {
+  return SumSse2(_mm_add_pd(_mm256_castpd256_pd128(x), _mm256_extractf128_pd(x, 1)));
+}
+
+template <int operation>
+__attribute__((target("avx2"))) double Avx2Kernel(const float* vec0, const float* vec1, const unsigned size) {
+  __m256d sum0(_mm256_setzero_pd()), sum1(_mm256_setzero_pd());
+  unsigned i(0);
+  for (; i+16 <= size; i += 16) {
+    sum0 = AddWidenedAvx2(sum0, CombineAvx2<operation>(_mm256_loadu_ps(vec0+i), _mm256_loadu_ps(vec1+i)));
+    sum1 = AddWidenedAvx2(sum1, CombineAvx2<operation>(_mm256_loadu_ps(vec0+i+8), _mm256_loadu_ps(vec1+i+8)));
+  }
+  for (; i+8 <= size; i += 8)
+    sum0 = AddWidenedAvx2(sum0, CombineAvx2<operation>(_mm256_loadu_ps(vec0+i), _mm256_loadu_ps(vec1+i)));
+  double x(SumAvx2(_mm256_add_pd(sum0, sum1)));
+  for (; i < size; ++i)
+    x += Combine<operation>(vec0[i], vec1[i]);
+  return x;
+}
+
+template <int operation>
+__attribute__((target("avx2"))) double Avx2Kernel(const double* vec0, const double* vec1, const unsigned size) {
+  __m256d sum0(_mm256_setzero_pd()), sum1(_mm256_setzero_pd());
+  unsigned i(0);
+  for (; i+8 <= size; i += 8) {
+    sum0 = _mm256_add_pd(sum0, CombineAvx2<operation>(_mm256_loadu_pd(vec0+i), _mm256_loadu_pd(vec1+i)));
+    sum1 = _mm256_add_pd(sum1, CombineAvx2<operation>(_mm256_loadu_pd(vec0+i+4), _mm256_loadu_pd(vec1+i+4)));
+  }
+  for (; i+4 <= size; i += 4)
+    sum0 = _mm256_add_pd(sum0, CombineAvx2<operation>(_mm256_loadu_pd(vec0+i), _mm256_loadu_pd(vec1+i)));
+  double x(SumAvx2(_mm256_add_pd(sum0, sum1)));
+  for (; i < size; ++i)
+    x += Combine<operation>(vec0[i], vec1[i]);
+  return x;
+}
+
+__attribute__((target("avx2"))) double Avx2CosineSimilarity(const float* vec0, const float* vec1, const unsigned size) {
+  __m256d dot_product(_mm256_setzero_pd()), norm0(_mm256_setzero_pd()), norm1(_mm256_setzero_pd());
+  unsigned i(0);
+  for (; i+8 <= size; i += 8) {
+    const __m256 x(_mm256_loadu_ps(vec0+i)), y(_mm256_loadu_ps(vec1+i));
+    dot_product = AddWidenedAvx2(dot_product, _mm256_mul_ps(x, y));
+    norm0 = AddWidenedAvx2(norm0, _mm256_mul_ps(x, x));
+    norm1 = AddWidenedAvx2(norm1, _mm256_mul_ps(y, y));
+  }
+  double xy(SumAvx2(dot_product)), xx(SumAvx2(norm0)), yy(SumAvx2(norm1));
+  for (; i < size; ++i) {
+    xy += vec0[i]*vec1[i];
+    xx += vec0[i]*vec0[i];
+    yy += vec1[i]*vec1[i];
+  }
+  return xy/(std::sqrt(xx)*std::sqrt(yy));
+}
+
+__attribute__((target("avx2"))) double Avx2CosineSimilarity(const double* vec0, const double* vec1, const unsigned size) {
+  __m256d dot_product(_mm256_setzero_pd()), norm0(_mm256_setzero_pd()), norm1(_mm256_setzero_pd());
+  unsigned i(0);
+  for (; i+4 <= size; i += 4) {
+    const __m256d x(_mm256_loadu_pd(vec0+i)), y(_mm256_loadu_pd(vec1+i));
+    dot_product = _mm256_add_pd(dot_product, _mm256_mul_pd(x, y));
+    norm0 = _mm256_add_pd(norm0, _mm256_mul_pd(x, x));
+    norm1 = _mm256_add_pd(norm1, _mm256_mul_pd(y, y));
+  }
+  double xy(SumAvx2(dot_product)), xx(SumAvx2(norm0)), yy(SumAvx2(norm1));
+  for (; i < size; ++i) {
+    xy += vec0[i]*vec1[i];
+    xx += vec0[i]*vec0[i];
+    yy += vec1[i]*vec1[i];
+  }
+  return xy/(std::sqrt(xx)*std::sqrt(yy));
+}
+
+template <int operation>
+__attribute__((target("avx2"))) int32_t Avx2Int8Kernel(const int8_t* vec0, const int8_t* vec1, const unsigned size) {
+  __m256i sum(_mm256_setzero_si256());
+  unsigned i(0);
+  for (; i+16 <= size; i += 16) {
+    __m256i x16(_mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(vec0+i)))), y16(_mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(vec1+i))));
+    if (operation == kSquaredEuclideanDistance)
+      x16 = y16 = _mm256_sub_epi16(x16, y16);
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(x16, y16));
+  }
+  return SumInt32Sse2(_mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1)))+((operation == kDotProduct)? ScalarInt8DotProduct(vec0+i, vec1+i, size-i) : ScalarInt8SquaredEuclideanDistance(vec0+i, vec1+i, size-i));
+}
+
+// AVX-512
+
+// Some versions of GCC warn about the "undefined" registers used inside the
+// AVX-512 intrinsics.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+template <int operation>
+__attribute__((target("avx512f"))) __m512 CombineAvx512(const __m512 x, const __m512 y) {
+  if (operation == kDotProduct)
+    return _mm512_mul_ps(x, y);
+  const __m512 difference(_mm512_sub_ps(x, y));
+  if (operation == kSquaredEuclideanDistance)
+    return _mm512_mul_ps(difference, difference);
+  return _mm512_abs_ps(difference);
+}
+
+template <int operation>
+__attribute__((target("avx512f"))) __m512d CombineAvx512(const __m512d x, const __m512d y) {
+  if (operation == kDotProduct)
+    return _mm512_mul_pd(x, y);
+  const __m512d difference(_mm512_sub_pd(x, y));
+  if (operation == kSquaredEuclideanDistance)
+    return _mm512_mul_pd(difference, difference);
+  return _mm512_abs_pd(difference);
+}
+
+__attribute__((target("avx512f"))) __m512d AddWidenedAvx512(const __m512d sum, const __m512 x) {
+// Adds all sixteen "float"s of "x" (converted to "double"s) to "sum".
+  const __m256 high(_mm512_castps512_ps256(_mm512_shuffle_f32x4(x, x, _MM_SHUFFLE(3, 2, 3, 2))));
+  return _mm512_add_pd(_mm512_add_pd(sum, _mm512_cvtps_pd(_mm512_castps512_ps256(x))), _mm512_cvtps_pd(high));
+}
+
+__attribute__((target("avx512f"))) double SumAvx512(const __m512d x) {
+  return SumAvx2(_mm256_add_pd(_mm512_castpd512_pd256(x), _mm512_castpd512_pd256(_mm512_shuffle_f64x2(x, x, _MM_SHUFFLE(3, 2, 3, 2)))));
+}
+
+template <int operation>
+__attribute__((target("avx512f"))) double Avx512Kernel(const float* vec0, const float* vec1, const unsigned size) {
+  __m512d sum(_mm512_setzero_pd());
+  unsigned i(0);
+  for (; i+16 <= size; i += 16)
+    sum = AddWidenedAvx512(sum, CombineAvx512<operation>(_mm512_loadu_ps(vec0+i), _mm512_loadu_ps(vec1+i)));
+  double x(SumAvx512(sum));
+  for (; i < size; ++i)
+    x += Combine<operation>(vec0[i], vec1[i]);
+  return x;
+}
+
+template <int operation>
+__attribute__((target("avx512f"))) double Avx512Kernel(const double* vec0, const double* vec1, const unsigned size) {
+  __m512d sum0(_mm512_setzero_pd()), sum1(_mm512_setzero_pd());
+  unsigned i(0);
+  for (; i+16 <= size; i += 16) {
+    sum0 = _mm512_add_pd(sum0, CombineAvx512<operation>(_mm512_loadu_pd(vec0+i), _mm512_loadu_pd(vec1+i)));
+    sum1 = _mm512_add_pd(sum1, CombineAvx512<operation>(_mm512_loadu_pd(vec0+i+8), _mm512_loadu_pd(vec1+i+8)));
+  }
+  for (; i+8 <= size; i += 8)
+    sum0 = _mm512_add_pd(sum0, CombineAvx512<operation>(_mm512_loadu_pd(vec0+i), _mm512_loadu_pd(vec1+i)));
+  double x(SumAvx512(_mm512_add_pd(sum0, sum1)));
+  for (; i < size; ++i)
+    x += Combine<operation>(vec0[i], vec1[i]);
+  return x;
+}
+
+__attribute__((target("avx512f"))) double Avx512CosineSimilarity(const float* vec0, const float* vec1, const unsigned size) {
+  __m512d dot_product(_mm512_setzero_pd()), norm0(_mm512_setzero_pd()), norm1(_mm512_setzero_pd());
+  unsigned i(0);
+  for (; i+16 <= size; i += 16) {
+    const __m512 x(_mm512_loadu_ps(vec0+i)), y(_mm512_loadu_ps(vec1+i));
+    dot_product = AddWidenedAvx512(dot_product, _mm512_mul_ps(x, y));
+    norm0 = AddWidenedAvx512(norm0, _mm512_mul_ps(x, x));
+    norm1 = AddWidenedAvx512(norm1, _mm512_mul_ps(y, y));
+  }
+  double xy(SumAvx512(dot_product)), xx(SumAvx512(norm0)), yy(SumAvx512(norm1));
+  for (; i < size; ++i) {
+    xy += vec0[i]*vec1[i];
+    xx += vec0[i]*vec0[i];
+    yy += vec1[i]*vec1[i];
+  }
+  return xy/(std::sqrt(xx)*std::sqrt(yy));
+}
+
+__attribute__((target("avx512f"))) double Avx512CosineSimilarity(const double* vec0, const double* vec1, const unsigned size) {
+  __m512d dot_product(_mm512_setzero_pd()), norm0(_mm512_setzero_pd()), norm1(_mm512_setzero_pd());
+  unsigned i(0);
+  for (; i+8 <= size; i += 8) {
+    const __m512d x(_mm512_loadu_pd(vec0+i)), y(_mm512_loadu_pd(vec1+i));
+    dot_product = _mm512_add_pd(dot_product, _mm512_mul_pd(x, y));
+    norm0 = _mm512_add_pd(norm0, _mm512_mul_pd(x, x));
+    norm1 = _mm512_add_pd(norm1, _mm512_mul_pd(y, y));
+  }
+  double xy(SumAvx512(dot_product)), xx(SumAvx512(norm0)), yy(SumAvx512(norm1));
+  for (; i < size; ++i) {
+    xy += vec0[i]*vec1[i];
+    xx += vec0[i]*vec0[i];
+    yy += vec1[i]*vec1[i];
+  }
+  return xy/(std::sqrt(xx)*std::sqrt(yy));
+}
+
+// POPCNT and AVX-512 VPOPCNTDQ (Hamming distances of packed signatures)
+
+__attribute__((target("popcnt"))) std::size_t PopcntHammingFilter(const uint64_t* signatures, const uint64_t* query, const unsigned num_of_words, const std::size_t num_of_rows, const unsigned max_distance, uint32_t* rows) {
+  std::size_t num_of_found_rows(0);
+  for (std::size_t row = 0; row < num_of_rows; ++row) {
+    const uint64_t* signature(signatures+row*num_of_words);
+    for (unsigned i = 0; i < num_of_words; ++i) {
+      if ((unsigned)__builtin_popcountll(signature[i]^query[i]) <= max_distance) {
+        rows[num_of_found_rows++] = row;
+        break;
+      }
+    }
+  }
+  return num_of_found_rows;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) std::size_t Avx512HammingFilter(const uint64_t* signatures, const uint64_t* query, const unsigned num_of_words, const std::size_t num_of_rows, const unsigned max_distance, uint32_t* rows) {
+// Compares eight words of a signature at once; the last (incomplete) group of
+// words is loaded using a mask.
+  const __m512i max_distances(_mm512_set1_epi64(max_distance));
+  std::size_t num_of_found_rows(0);
+  for (std::size_t row = 0; row < num_of_rows; ++row) {
+    const uint64_t* signature(signatures+row*num_of_words);
+    for (unsigned i = 0; i < num_of_words; i += 8) {
+      const __mmask8 mask((num_of_words-i >= 8)? 0xff : (__mmask8)((1u << (num_of_words-i))-1));
+      const __m512i distances(_mm512_popcnt_epi64(_mm512_xor_si512(_mm512_maskz_loadu_epi64(mask, signature+i), _mm512_maskz_loadu_epi64(mask, query+i))));
+      if (_mm512_mask_cmple_epu64_mask(mask, distances, max_distances) != 0) {
+        rows[num_of_found_rows++] = row;
+        break;
+      }
+    }
+  }
+  return num_of_found_rows;
+}
+
+#pragma GCC diagnostic pop
+
+#endif // WORD_VEC_LIB_X86_KERNELS
+
+typedef std::size_t (*HammingFilter)(const uint64_t*, const uint64_t*, const unsigned, const std::size_t, const unsigned, uint32_t*);
+
+struct Kernels { // the variants of all kernels chosen for this CPU
+  const char* instruction_set;
+  double (*float_kernels[3])(const float*, const float*, const unsigned); // indexed by "Operation"
+  double (*double_kernels[3])(const double*, const double*, const unsigned);
+  double (*float_cosine_similarity)(const float*, const float*, const unsigned);
+  double (*double_cosine_similarity)(const double*, const double*, const unsigned);
+  int32_t (*int8_dot_product)(const int8_t*, const int8_t*, const unsigned);
+  int32_t (*int8_squared_euclidean_distance)(const int8_t*, const int8_t*, const unsigned);
+  HammingFilter hamming_filter;
+};
+
+HammingFilter SelectHammingFilter() {
+// Returns the best variant of the Hamming filter the CPU supports (POPCNT and
+// VPOPCNTDQ don't come with the instruction sets of the other kernels).
+#ifdef WORD_VEC_LIB_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+    return Avx512HammingFilter;
+  if (__builtin_cpu_supports("popcnt"))
+    return PopcntHammingFilter;
+#endif
+  return ScalarHammingFilter;
+}
+
+Kernels SelectKernels() {
+// Returns the best variants of the kernels the CPU supports.
+#ifdef WORD_VEC_LIB_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return {"AVX-512",
+            {Avx512Kernel<kDotProduct>, Avx512Kernel<kSquaredEuclideanDistance>, Avx512Kernel<kManhattanDistance>},
+            {Avx512Kernel<kDotProduct>, Avx512Kernel<kSquaredEuclideanDistance>, Avx512Kernel<kManhattanDistance>},
+            Avx512CosineSimilarity, Avx512CosineSimilarity,
+            Avx2Int8Kernel<kDotProduct>, Avx2Int8Kernel<kSquaredEuclideanDistance>, SelectHammingFilter()};
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return {"AVX2",
+            {Avx2Kernel<kDotProduct>, Avx2Kernel<kSquaredEuclideanDistance>, Avx2Kernel<kManhattanDistance>},
+            {Avx2Kernel<kDotProduct>, Avx2Kernel<kSquaredEuclideanDistance>, Avx2Kernel<kManhattanDistance>},
+            Avx2CosineSimilarity, Avx2CosineSimilarity,
+            Avx2Int8Kernel<kDotProduct>, Avx2Int8Kernel<kSquaredEuclideanDistance>, SelectHammingFilter()};
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return {"SSE2",
+            {Sse2Kernel<kDotProduct>, Sse2Kernel<kSquaredEuclideanDistance>, Sse2Kernel<kManhattanDistance>},
+            {Sse2Kernel<kDotProduct>, Sse2Kernel<kSquaredEuclideanDistance>, Sse2Kernel<kManhattanDistance>},
+            Sse2CosineSimilarity, Sse2CosineSimilarity,
+            Sse2Int8Kernel<kDotProduct>, Sse2Int8Kernel<kSquaredEuclideanDistance>, SelectHammingFilter()};
+  }
+#endif
+  return {"scalar",
+          {ScalarKernel<kDotProduct, float>, ScalarKernel<kSquaredEuclideanDistance, float>, ScalarKernel<kManhattanDistance, float>},
+          {ScalarKernel<kDotProduct, double>, ScalarKernel<kSquaredEuclideanDistance, double>, ScalarKernel<kManhattanDistance, double>},
+          ScalarCosineSimilarity<float>, ScalarCosineSimilarity<double>,
+          ScalarInt8DotProduct, ScalarInt8SquaredEuclideanDistance, ScalarHammingFilter};
+}
+
+const Kernels& GetKernels() {
+  static const Kernels kernels(SelectKernels());
+  return kernels;
+}
+
+} // namespace
+
+namespace VecCalc {
+
+double DotProduct(const float* vec0, const float* vec1, const unsigned size) {
+  return GetKernels().float_kernels[kDotProduct](vec0, vec1, size);
+}
+
+double DotProduct(const double* vec0, const double* vec1, const unsigned size) {
+  return GetKernels().double_kernels[kDotProduct](vec0, vec1, size);
+}
+
+double SquaredEuclideanDistance(const float* vec0, const float* vec1, const unsigned size) {
+  return GetKernels().float_kernels[kSquaredEuclideanDistance](vec0, vec1, size);
+}
+
+double SquaredEuclideanDistance(const double* vec0, const double* vec1, const unsigned size) {
+  return GetKernels().double_kernels[kSquaredEuclideanDistance](vec0, vec1, size);
+}
+
+double ManhattanDistance(const float* vec0, const float* vec1, const unsigned size) {
+  return GetKernels().float_kernels[kManhattanDistance](vec0, vec1, size);
+}
+
+double ManhattanDistance(const double* vec0, const double* vec1, const unsigned size) {
+  return GetKernels().double_kernels[kManhattanDistance](vec0, vec1, size);
+}
+
+double CosineSimilarity(const float* vec0, const float* vec1, const unsigned size) {
+  return GetKernels().float_cosine_similarity(vec0, vec1, size);
+}
+
+double CosineSimilarity(const double* vec0, const double* vec1, const unsigned size) {
+  return GetKernels().double_cosine_similarity(vec0, vec1, size);
+}
+
+int32_t DotProduct(const int8_t* vec0, const int8_t* vec1, const unsigned size) {
+  return GetKernels().int8_dot_product(vec0, vec1, size);
+}
+
+int32_t SquaredEuclideanDistance(const int8_t* vec0, const int8_t* vec1, const unsigned size) {
+  return GetKernels().int8_squared_euclidean_distance(vec0, vec1, size);
+}
+
+std::size_t FilterByHammingDistance(const uint64_t* signatures, const uint64_t* query, const unsigned num_of_words, const std::size_t num_of_rows, const unsigned max_distance, uint32_t* rows) {
+  return GetKernels().hamming_filter(signatures, query, num_of_words, num_of_rows, max_distance, rows);
+}
+
+const char* InstructionSet() {
+  return GetKernels().instruction_set;
+}
+
+} // namespace VecCalc
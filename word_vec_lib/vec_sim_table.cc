@@ -14,171 +14,301 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#include <fstream>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <iostream>
-#include <sstream>
+#include <limits>
+#include <numeric>
+#include <type_traits>
 
 #include "word_vec_lib.h"
 
-VecSimTable::VecSimTable(const std::string& file, const std::regex& pattern)
+PairCache::PairCache(const std::size_t capacity) {
+  SetCapacity(capacity);
+}
+
+void PairCache::SetCapacity(const std::size_t capacity) {
+// Empties the cache and sets the number of values it can hold (rounded up to a
+// multiple of "kWays"; 0 disables the cache). Mustn't be called while other
+// threads use the cache.
+  sets_.assign((capacity+kWays-1)/kWays, Set());
+}
+
+bool PairCache::Find(const std::size_t key, double& value) {
+// Writes the value cached for "key" into "value" and returns "true"; returns
+// "false" if "key" isn't cached.
+  if (sets_.empty())
+    return false;
+  const std::size_t set_index(SetOf(key));
+  Set& set(sets_[set_index]);
+  std::lock_guard<std::mutex> lock(mutexes_[set_index%kNumOfLocks]);
+  for (unsigned way = 0; way < kWays; ++way) {
+    if (set.keys[way] == key) {
+      value = set.values[way];
+      set.referenced |= 1 << way;
+      return true;
+    }
+  }
+  return false;
+}
+
+void PairCache::Insert(const std::size_t key, const double value) {
+// Caches "value" for "key". The hand of the set of "key" moves on to the first
+// value that hasn't been read since it passed it last (clearing the marks of
+// the ones that have been read on its way), which gets replaced.
+  if (sets_.empty())
+    return;
+  const std::size_t set_index(SetOf(key));
+  Set& set(sets_[set_index]);
+  std::lock_guard<std::mutex> lock(mutexes_[set_index%kNumOfLocks]);
+  for (unsigned way = 0; way < kWays; ++way) {
+    if (set.keys[way] == key) {
+      set.values[way] = value;
+      return;
+    }
+  }
+  while (set.referenced & (1 << set.hand)) {
+    set.referenced &= ~(1 << set.hand);
+    set.hand = (set.hand+1)%kWays;
+  }
+  set.keys[set.hand] = key;
+  set.values[set.hand] = value;
+  set.hand = (set.hand+1)%kWays;
+}
+
+VecSimTable::VecSimTable(const std::string& file, const std::regex& pattern, const VecPrecision precision, const VecSimMeasures measures)
 // Constructor of a "VecSimTable" using a regex pattern to choose the word
 // vectors that shall be stored.
-    : vec_size_(GetSizeOfVectors(file)),
-      case_sensitive_(true) {
-  word_vecs_.reserve(1000);
-  vec_num_ = StoreVecsWithPattern(file, pattern);
-  sim_table_.resize(vec_num_);
-  unsigned j(1);
-  for (int i = 0; i < vec_num_; ++i)
-    sim_table_[i].reserve(vec_num_-(j++));
-  CalculateSimilarities();
-}
+    : VecSimTable(VecFile::Read(file, "VecSimTable", pattern, true, precision), true, precision, measures) {}
 
-VecSimTable::VecSimTable(const std::string& file, const bool case_sensitive, const double percentage)
+VecSimTable::VecSimTable(const std::string& file, const bool case_sensitive, const double percentage, const VecPrecision precision, const VecSimMeasures measures)
 // Constructor of a "VecSimTable" that stores the word vectors in order of their
 // occurrence in the word vector file ("file"). If percentage != 1 only a
 // certain percentage of the word vectors will be stored (i.e. the first
 // "percentage" percent).
-    : vec_size_(GetSizeOfVectors(file)),
-      case_sensitive_(case_sensitive) {
-  vec_num_ = CountVectors(file)*((percentage > 1)? 1 : percentage)+0.5;
-  word_vecs_.resize(vec_num_);
-  sim_table_.resize(vec_num_);
-  unsigned j(1);
-  for (int i = 0; i < vec_num_; ++i)
-    sim_table_[i].reserve(vec_num_-(j++));
-  StoreWordVecs(file, case_sensitive, percentage);
+    : VecSimTable(VecFile::Read(file, "VecSimTable", case_sensitive, percentage, precision), case_sensitive, precision, measures) {}
+
+VecSimTable::VecSimTable(VecFileContents&& contents, const bool case_sensitive, const VecPrecision precision, const VecSimMeasures measures)
+    : vec_size_(contents.vec_size),
+      case_sensitive_(case_sensitive),
+      precision_(precision),
+      measures_(measures),
+      vec_num_((vec_size_ < 1)? 0 : contents.vec_num),
+      row_bytes_((vec_size_ < 1)? 0 : RowBytes(vec_size_, precision_)),
+      pair_cache_((measures_ == VecSimMeasures::kAll)? 0 : kPairCacheSize),
+      disk_precision_(VecPrecision::kFloat),
+      disk_num_of_tile_rows_(0),
+      disk_cos_sims_(NULL),
+      disk_eucl_dists_(NULL) {
+  StoreWordVecs(contents);
   CalculateSimilarities();
 }
 
-VecSimTable::~VecSimTable() {
-  for (auto& wv : word_vecs_)
-    delete wv;
-  for (int i = 0; i < vec_num_; ++i) {
-    for (int j = 0; j < vec_num_-(i+1); ++j)
-      delete sim_table_[i][j];
+void VecSimTable::StoreWordVecs(VecFileContents& contents) {
+// Takes over the matrix read by "VecFile::Read()" and sorts its rows by their
+// words in place: row i gets the row "order[i]", so every cycle of this
+// permutation is followed with a single row buffered.
+  std::vector<int> order(vec_num_);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&contents](const int i, const int j) {return (contents.words[i] < contents.words[j]);});
+  words_.resize(vec_num_);
+  for (int i = 0; i < vec_num_; ++i)
+    words_[i] = std::move(contents.words[order[i]]);
+  matrix_ = std::move(contents.matrix);
+  std::vector<unsigned char> buffered_row(row_bytes_);
+  std::vector<bool> is_sorted(vec_num_, false);
+  for (int first = 0; first < vec_num_; ++first) {
+    if (is_sorted[first] || order[first] == first)
+      continue;
+    std::memcpy(buffered_row.data(), matrix_.Data()+first*row_bytes_, row_bytes_);
+    int i(first);
+    for (; order[i] != first; i = order[i]) {
+      std::memcpy(matrix_.Data()+i*row_bytes_, matrix_.Data()+order[i]*row_bytes_, row_bytes_);
+      is_sorted[i] = true;
+    }
+    std::memcpy(matrix_.Data()+i*row_bytes_, buffered_row.data(), row_bytes_);
+    is_sorted[i] = true;
   }
 }
 
-const int VecSimTable::GetSizeOfVectors(const std::string& file) {
-// Returns the number of dimensions of the word vectors found in "file"
-// (assuming that each line of the file contains exactly one vector and that
-// all the word vectors got the same number of dimensions).
-  std::ifstream file_stream(file);
-  if (!file_stream.is_open()) {
-    std::cout << "ERROR: OPENING \"" << file << "\" FAILED!\nMake sure that the file exists and that the path is correct." << std::endl;
-    return -1;
-  } else if (file_stream.bad()) {
-    std::cout << "ERROR: OPENING \"" << file << "\" FAILED!" << std::endl;
-    return -1;
+void VecSimTable::CalculateSimilarities() {
+// Calculates the squared norms of all vectors and stores the cosine
+// similarities and/or Euclidean distances (see "measures_") of all word pairs
+// provided by "matrix_" in their planes (see "ForEachPair()"). Without any
+// planes ("VecSimMeasures::kNone") nothing else has to be calculated now.
+  squared_norms_ = AlignedArray<double>(vec_num_);
+  DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    std::vector<typename ComputeType<T>::type> rows;
+    for (int i = 0; i < vec_num_; ++i) {
+      const typename ComputeType<T>::type* vec(ComputeRows<T>(i, i+1, rows));
+      squared_norms_[i] = VecCalc::DotProduct(vec, vec, vec_size_);
+    }
+  });
+  if (measures_ == VecSimMeasures::kNone)
+    return;
+  std::cout << "\tCalculating similarities..." << std::endl;
+  const std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+  if (measures_ != VecSimMeasures::kEuclidean)
+    cos_sims_ = AlignedArray<double>(NumOfPairs());
+  if (measures_ != VecSimMeasures::kCosine)
+    eucl_dists_ = AlignedArray<double>(NumOfPairs());
+  DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    ForEachPair<T>([&](const unsigned, const int i, const int j, const std::size_t index, const double dot_product) {
+      if (cos_sims_.Size() > 0)
+        cos_sims_[index] = CosSim(i, j, dot_product);
+      if (eucl_dists_.Size() > 0)
+        eucl_dists_[index] = EuclDist(i, j, dot_product);
+    });
+  });
+  const double seconds(std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count());
+  std::cout << "\t---Completed (" << NumOfPairs() << " pairs in " << seconds << " s, i.e. " << ((seconds > 0)? NumOfPairs()/seconds : 0) << " pairs/s)." << std::endl;
+}
+
+template <typename T, typename PairFunction>
+void VecSimTable::ForEachPair(const PairFunction& pair_function) {
+// Calls "pair_function(task, i, j, index, dot_product)" for every word pair
+// ("words_[i]", "words_[j]") (i < j; "index" is its index in the planes). The
+// table is calculated like a Gram matrix in square tiles of "TileRows()" rows
+// (see "ForEachPairOfTile()"): the rows of a tile row stay in the cache while
+// the rows of the following tiles are compared with them. The tile rows are
+// spread over "NumOfTileTasks()" tasks on one thread per core; task t
+// calculates the tile rows t and "num_of_tiles"-1-t, so every task gets the
+// same number of tiles of the triangular table.
+  typedef typename ComputeType<T>::type ComputeT;
+  const int tile_rows(TileRows());
+  const int num_of_tiles((vec_num_+tile_rows-1)/tile_rows);
+  const unsigned num_of_tasks(NumOfTileTasks());
+  const auto calculate_tile_row([&](const unsigned task, const int tile, std::vector<ComputeT>& rows, std::vector<ComputeT>& cols) {
+    const int first_row(tile*tile_rows), last_row(std::min(vec_num_, first_row+tile_rows));
+    for (int first_col = first_row; first_col < vec_num_; first_col += tile_rows) {
+      ForEachPairOfTile<T>(first_row, last_row, first_col, std::min(vec_num_, first_col+tile_rows), rows, cols, [&](const int i, const int j, const double dot_product) {
+        pair_function(task, i, j, RowStart(i)+(j-i-1), dot_product);
+      });
+    }
+  });
+  const std::function<void(const unsigned)> task([&](const unsigned t) {
+    std::vector<ComputeT> rows, cols;
+    calculate_tile_row(t, t, rows, cols);
+    if ((int)t != num_of_tiles-1-(int)t)
+      calculate_tile_row(t, num_of_tiles-1-t, rows, cols);
+  });
+  if (num_of_tasks > 1) {
+    ThreadPool thread_pool;
+    thread_pool.ParallelFor(num_of_tasks, task);
+  } else if (num_of_tasks == 1) {
+    task(0);
   }
-  std::cout << "CREATING A \"VecSimTable\"." << '\n' << "Input file (\"word vector file\"): " << file << '\n';
-  std::cout << "\tChecking the size of the word vectors..." << std::endl;
-  std::string line;
-  std::getline(file_stream, line);
-  std::cout << "\t---Done." << '\n';
-  return std::count(line.begin(), line.end(), ' ');
 }
 
-void VecSimTable::StoreWordVecs(const std::string& file, const bool case_sensitive, const double percentage) {
-// Reads the word vectors from "file" in order to store them in a vector on
-// memory.
-  std::cout << "\tLoading data..." << std::endl;
-  std::string line;
-  std::ifstream vector_file_stream(file);
-  unsigned remaining_vecs(vec_num_);
-  unsigned i(0);
-  word_vecs_.resize(remaining_vecs);
-  while (std::getline(vector_file_stream, line) && remaining_vecs-- != 0)
-    StoreVectors(line, i++);
-  std::sort(word_vecs_.begin(), word_vecs_.end(), SortIt);
-  std::cout << "\t---Completed." << std::endl;
+template <typename S, typename PairFunction>
+void VecSimTable::ForEachDiskPair(const bool cos_sim, const PairFunction& pair_function) {
+// Calls "pair_function(task, i, j, value)" for every word pair ("words_[i]",
+// "words_[j]") (i < j) with its value read from the plane of the disk table
+// ("S" is the type of its values). Every one of the "NumOfDiskTasks()" tasks
+// (one per core) reads a contiguous range of tiles in the order they are
+// stored in, so the file is read sequentially.
+  const std::size_t num_of_tiles(NumOfDiskTiles()), tile_size((std::size_t)kDiskTileRows*kDiskTileRows);
+  const unsigned num_of_tasks(NumOfDiskTasks());
+  const S* plane(reinterpret_cast<const S*>(DiskPlane(cos_sim)));
+  const std::function<void(const unsigned)> task([&](const unsigned t) {
+    const std::size_t first_tile(num_of_tiles*t/num_of_tasks), last_tile(num_of_tiles*(t+1)/num_of_tasks);
+    int a(0), b(0); // tile of the row a and the column b
+    while (DiskTileIndex(a+1, a+1) <= first_tile)
+      ++a;
+    b = a+(int)(first_tile-DiskTileIndex(a, a));
+    for (std::size_t tile = first_tile; tile < last_tile; ++tile) {
+      const int first_row(a*kDiskTileRows), last_row(std::min(vec_num_, first_row+kDiskTileRows));
+      const int first_col(b*kDiskTileRows), last_col(std::min(vec_num_, first_col+kDiskTileRows));
+      for (int i = first_row; i < last_row; ++i) {
+        const S* values(plane+tile*tile_size+(std::size_t)(i-first_row)*kDiskTileRows-first_col);
+        for (int j = std::max(i+1, first_col); j < last_col; ++j)
+          pair_function(t, i, j, (double)static_cast<typename ComputeType<S>::type>(values[j]));
+      }
+      if (++b == disk_num_of_tile_rows_)
+        b = ++a;
+    }
+  });
+  if (num_of_tasks > 1) {
+    ThreadPool thread_pool(num_of_tasks);
+    thread_pool.ParallelFor(num_of_tasks, task);
+  } else {
+    task(0);
+  }
 }
 
-const int VecSimTable::CountVectors(const std::string& file) {
-// Returns the number of word vectors in "file" (assuming that each line
-// of the file contains exactly one vector).
-  if (vec_size_ < 1)
-    return -1;
-  std::ifstream file_stream(file);
-  unsigned vector_num(0);
-  std::string line;
-  std::cout << "\tCounting the word vectors..." << std::endl;
-  while (std::getline(file_stream, line))
-    vector_num++; // this might cause problems if your "file" is not a valid word vector file because actually lines and not vectors are counted
-  std::cout<<"\t---Done."<<std::endl;
-  return vector_num;
+template <typename PairFunction>
+void VecSimTable::ForEachPairValue(const bool cos_sim, const PairFunction& pair_function) {
+// Calls "pair_function(task, i, j, value)" for every word pair ("words_[i]",
+// "words_[j]") (i < j) whose measure isn't stored in memory: the values are
+// either read from the disk table (see "ForEachDiskPair()") or calculated tile
+// by tile (see "ForEachPair()"); "task" is less than "NumOfScanTasks()".
+  if (DiskPlane(cos_sim)) {
+    DispatchPrecision(disk_precision_, [&](auto zero) {
+      typedef decltype(zero) S;
+      ForEachDiskPair<S>(cos_sim, pair_function);
+    });
+  } else {
+    DispatchPrecision(precision_, [&](auto zero) {
+      typedef decltype(zero) T;
+      ForEachPair<T>([&](const unsigned task, const int i, const int j, const std::size_t, const double dot_product) {
+        pair_function(task, i, j, (cos_sim)? CosSim(i, j, dot_product) : EuclDist(i, j, dot_product));
+      });
+    });
+  }
 }
 
-void VecSimTable::StoreVectors(const std::string& line, const unsigned i) {
-// Stores the word vectors in a vector ("word_vecs_") on memory.
-  const std::vector<std::string> tokens(SplitLine(line));
-  std::vector<double> vector(vec_size_);
-  for (int j = 0; j < vec_size_; ++j)
-    // Converts the (std::string) elements of "tokens" that represent the
-    // values of the word vector into the type "double".
-    vector[j] = atof(tokens[j+1].c_str());
-  word_vecs_[i] = new WordVec(tokens[0], vector);
+std::pair<int, int> VecSimTable::GetPair(const std::size_t index) const {
+// Returns the indices (i < j) of the words of the pair stored at "index" of the
+// planes (the inverse of "PairIndex()"): i is the largest row with
+// "RowStart(i)" <= "index", which follows from solving the quadratic equation
+// of "RowStart()" (if rounding missed it by one, it gets corrected).
+  const double n(2.*vec_num_-1);
+  int i(std::max(0, std::min(vec_num_-2, (int)((n-std::sqrt(n*n-8.*index))/2))));
+  while (i > 0 && RowStart(i) > index)
+    --i;
+  while (i < vec_num_-2 && RowStart(i+1) <= index)
+    ++i;
+  return std::make_pair(i, i+1+(int)(index-RowStart(i)));
 }
 
-int VecSimTable::StoreVecsWithPattern(const std::string& file, const std::regex& pattern) {
-// Returns the number of word vectors in "file" that match the regex "pattern"
-// (assuming that each line of the file contains exactly one vector) and stores
-// the word vectors in a vector ("word_vecs_") on memory.
-  if (vec_size_ < 1)
-    return -1;
-  std::cout << "\tLoading data..." << std::endl;
-  std::string line;
-  std::ifstream vector_file_stream(file);
-  int vec_count(0);
-  std::vector<std::string> tokens;
-  tokens.reserve(vec_size_+1);
-  std::vector<double> vector(vec_size_);
-  while (std::getline(vector_file_stream, line)) {
-    tokens = SplitLine(line);
-    if (!std::regex_match(tokens[0], pattern))
-      continue;
-    for (int i = 0; i < vec_size_; ++i)
-      // Converts the (std::string) elements of "tokens" that represent the
-      // values of the word vector into the type "double".
-      vector[i] = atof(tokens[i+1].c_str());
-    word_vecs_.push_back(new WordVec(tokens[0], vector));
-    vec_count++;
+double VecSimTable::PairValue(const int i, const int j, const bool cos_sim) {
+// Returns the cosine similarity (or Euclidean distance) of the pair
+// ("words_[i]", "words_[j]") from its plane (in memory or in the disk table)
+// or, if this measure isn't stored, derives it from the dot product of their
+// vectors, which gets calculated on the first access and kept in
+// "pair_cache_".
+  const double* plane(Plane(cos_sim));
+  const std::size_t index(PairIndex(i, j));
+  if (plane)
+    return plane[index];
+  if (DiskPlane(cos_sim))
+    return DiskValue(i, j, cos_sim);
+  double dot_product;
+  if (!pair_cache_.Find(index, dot_product)) {
+    dot_product = DispatchPrecision(precision_, [&](auto zero) {
+      typedef decltype(zero) T;
+      return CalculateDotProduct<T>(std::min(i, j), std::max(i, j));
+    });
+    pair_cache_.Insert(index, dot_product);
   }
-  std::sort(word_vecs_.begin(), word_vecs_.end(), SortIt);
-  std::cout << "\t---Completed." << std::endl;
-  return vec_count;
+  return (cos_sim)? CosSim(i, j, dot_product) : EuclDist(i, j, dot_product);
 }
 
-std::vector<std::string> VecSimTable::SplitLine(const std::string& line) {
-// Splits the lines (strings) of the vector file into their tokens and returns
-// all of those tokens in a std::vector. (The tokens within a "line" should be
-// separated by whitespaces.)
-  std::stringstream stream(line);
-  std::string item;
-  std::vector<std::string> tokens(vec_size_+1);
-  for (auto& token : tokens) {
-    std::getline(stream, item, ' ');
-    token = item;
-  }
-  if (!case_sensitive_)
-    tokens[0] = VecStore::SetToLowerCase(tokens[0]);
-  return tokens;
+template <typename T>
+double VecSimTable::CalculateDotProduct(const int i, const int j) const {
+// Calculates the dot product of the vectors of "words_[i]" and "words_[j]"
+// (i < j) exactly like "ForEachPair()".
+  std::vector<typename ComputeType<T>::type> row_i, row_j;
+  return VecCalc::DotProduct(ComputeRows<T>(i, i+1, row_i), ComputeRows<T>(j, j+1, row_j), vec_size_);
 }
 
-void VecSimTable::CalculateSimilarities() {
-// Calulates and stores the cosine similarities and Euclidean distances of all
-// word pairs provided by "word_vecs_".
-  std::cout << "\tCalculating similarities..." << std::endl;
-  std::vector<double> cur_vec;
-  cur_vec.reserve(vec_size_);
-  for (int i = 0; i < vec_num_; ++i) {
-    cur_vec = word_vecs_[i]->vec;
-    sim_table_.push_back(std::vector<SimMeasures*>());
-    for (int j = i+1; j < vec_num_; ++j)
-      sim_table_[i].push_back(new SimMeasures(CosineSimilarity(cur_vec, word_vecs_[j]->vec), EuclideanDistance(cur_vec, word_vecs_[j]->vec)));
-  }
-  std::cout << "\t---Completed." << std::endl;
+void VecSimTable::SetPairCacheSize(const std::size_t num_of_pairs) {
+// Empties the cache of the pairs whose values are calculated on demand and
+// sets the number of pairs it can hold (0: no pairs are cached).
+  pair_cache_.SetCapacity(num_of_pairs);
 }
 
 void VecSimTable::PrintInfo() {
@@ -186,6 +316,11 @@ void VecSimTable::PrintInfo() {
   std::cout << "Basic information about the \"VecSimTable\":" << '\n';
   std::cout << "\tSize of vectors = " << vec_size_ << '\n';
   std::cout << "\tNumber of stored word vectors = " << vec_num_ << '\n';
+  std::cout << "\tStored similarity measures = " << ((measures_ == VecSimMeasures::kAll)? "cosine similarities and Euclidean distances" : (measures_ == VecSimMeasures::kCosine)? "cosine similarities" : (measures_ == VecSimMeasures::kEuclidean)? "Euclidean distances" : "none (calculated on demand)") << '\n';
+  std::cout << "\tSize of the similarity table = " << (double)(cos_sims_.Size()+eucl_dists_.Size())*sizeof(double)/(1 << 20) << " MiB" << '\n';
+  std::cout << "\tSize of the value index = " << (double)((sorted_cos_sims_.size()+sorted_eucl_dists_.size())*sizeof(uint32_t)+(wide_sorted_cos_sims_.size()+wide_sorted_eucl_dists_.size())*sizeof(uint64_t))/(1 << 20) << " MiB" << '\n';
+  std::cout << "\tDisk table = " << ((disk_table_)? disk_table_file_ : "none") << '\n';
+  std::cout << "\tCapacity of the pair cache = " << pair_cache_.Capacity() << " pairs" << '\n';
   std::cout << "\tThis \"VecSimTable\" works " << ((case_sensitive_)? "case sensitive." : "case insensitive.") << std::endl;
 }
 
@@ -198,12 +333,18 @@ std::vector<double> VecSimTable::GetVec(std::string word) {
     std::cout << "ERROR in GetVec(): \"" << word << "\" couldn't be found in your data; returned an empty vector." << std::endl;
     return std::vector<double>();
   }
-  return word_vecs_[index]->vec;
+  return DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    std::vector<double> vec(vec_size_);
+    for (int i = 0; i < vec_size_; ++i)
+      vec[i] = static_cast<typename ComputeType<T>::type>(Row<T>(index)[i]);
+    return vec;
+  });
 }
 
 double VecSimTable::GetCosSim(std::string word0, std::string word1) {
 // Searches for the cosine similarity of a word pair ("word0", "word1") in the
-// sim_table_ and returns it.
+// similarity table and returns it.
   if (!case_sensitive_) {
     word0 = VecStore::SetToLowerCase(word0);
     word1 = VecStore::SetToLowerCase(word1);
@@ -219,13 +360,12 @@ double VecSimTable::GetCosSim(std::string word0, std::string word1) {
     std::cout << "ERROR in GetCosSim(): \"" << word1 << "\" couldn't be found." << std::endl;
     return std::numeric_limits<double>::quiet_NaN();
   }
-  const std::pair<int, int> sim_table_indices(GetSimTableIndices(i, j));
-  return sim_table_[sim_table_indices.first][sim_table_indices.second]->cos_sim;
+  return PairValue(i, j, true);
 }
 
 double VecSimTable::GetEuclDist(std::string word0, std::string word1) {
 // Searches for the Euclidean distance between two word vectors (of "word0",
-// "word1") in the sim_table_ and returns it.
+// "word1") in the similarity table and returns it.
   if (!case_sensitive_) {
     word0 = VecStore::SetToLowerCase(word0);
     word1 = VecStore::SetToLowerCase(word1);
@@ -241,8 +381,7 @@ double VecSimTable::GetEuclDist(std::string word0, std::string word1) {
     std::cout << "ERROR in GetEuclDist(): \"" << word1 << "\" couldn't be found." << std::endl;
     return std::numeric_limits<double>::quiet_NaN();
   }
-  const std::pair<int, int> sim_table_indices(GetSimTableIndices(i, j));
-  return sim_table_[sim_table_indices.first][sim_table_indices.second]->eucl_dist;
+  return PairValue(i, j, false);
 }
 
 std::list<std::pair<std::pair<std::string, std::string>, double>> VecSimTable::SimilarPairs(std::string word0, std::string word1, std::string comparison_mode, const double range) {
@@ -271,30 +410,9 @@ std::list<std::pair<std::pair<std::string, std::string>, double>> VecSimTable::S
     std::cout << "ERROR in SimilarPairs(): \"" << word1 << "\" couldn't be found; returned an empty list." << std::endl;
     return std::list<std::pair<std::pair<std::string, std::string>, double>>();
   }
-  const std::pair<int, int> sim_table_indices(GetSimTableIndices(k, l));
-  std::pair<int, int> word_vecs_indices;
   const bool cos_sim((std::regex_match(VecStore::SetToLowerCase(comparison_mode), (std::regex) "eucl(idean)?([ _-])?dist(ance)?"))? false : true);
-  const double value_min(((cos_sim)? sim_table_[sim_table_indices.first][sim_table_indices.second]->cos_sim : sim_table_[sim_table_indices.first][sim_table_indices.second]->eucl_dist)-range);
-  const double value_max(((cos_sim)? sim_table_[sim_table_indices.first][sim_table_indices.second]->cos_sim : sim_table_[sim_table_indices.first][sim_table_indices.second]->eucl_dist)+range);
-  std::list<std::pair<std::pair<std::string, std::string>, double>> list_of_pairs;
-  for (int i = 0; i < vec_num_; ++i) {
-    for (int j = 0; j < vec_num_-(i+1); ++j) {
-      if (i == sim_table_indices.first && j == sim_table_indices.second)
-        continue; // skips the original word pair in question ("word0", "word1")
-      if (cos_sim && sim_table_[i][j]->cos_sim >= value_min && sim_table_[i][j]->cos_sim <= value_max) {
-        // Makes a pair of the word pair and its cosine similarity and pushs it
-        // back to "list_of_pairs".
-        word_vecs_indices = GetWordVecsIndices(i, j);
-        list_of_pairs.push_back(std::make_pair(std::make_pair(word_vecs_[word_vecs_indices.first]->word, word_vecs_[word_vecs_indices.second]->word), sim_table_[i][j]->cos_sim));
-      } else if (sim_table_[i][j]->eucl_dist >= value_min && sim_table_[i][j]->eucl_dist <= value_max) {
-        // Makes a pair of the word pair and its Euclidean distance and pushs
-        // it back to "list_of_pairs".
-        word_vecs_indices = GetWordVecsIndices(i, j);
-        list_of_pairs.push_back(std::make_pair(std::make_pair(word_vecs_[word_vecs_indices.first]->word, word_vecs_[word_vecs_indices.second]->word), sim_table_[i][j]->eucl_dist));
-      }
-    }
-  }
-  return list_of_pairs;
+  const double value(PairValue(k, l, cos_sim));
+  return FindSimilarPairs(value-range, value+range, cos_sim, PairIndex(k, l)); // skips the original word pair in question ("word0", "word1")
 }
 
 std::list<std::pair<std::pair<std::string, std::string>, double>> VecSimTable::SimilarPairs(const double similarity, std::string comparison_mode, const double range) {
@@ -304,16 +422,58 @@ std::list<std::pair<std::pair<std::string, std::string>, double>> VecSimTable::S
 // would be "0.5", all word pairs with a cosine similarity between 0.4 and 0.6
 // will be returned.
   const bool cos_sim((std::regex_match(VecStore::SetToLowerCase(comparison_mode), (std::regex) "eucl(idean)?([ _-])?dist(ance)?"))? false : true);
-  const double value_min(similarity-range);
-  const double value_max(similarity+range);
+  return FindSimilarPairs(similarity-range, similarity+range, cos_sim, NumOfPairs());
+}
+
+std::list<std::pair<std::pair<std::string, std::string>, double>> VecSimTable::FindSimilarPairs(const double value_min, const double value_max, const bool cos_sim, const std::size_t skipped_pair) {
+// Returns a list of all word pairs whose cosine similarities (or Euclidean
+// distances) are between "value_min" and "value_max" (in the order of the
+// similarity table). The pair at the index "skipped_pair" won't be returned.
+// If the value index has been built, the matching pairs are found by a binary
+// search; if the measure isn't stored in memory, the values are read from the
+// disk table or calculated tile by tile (see "ForEachPairValue()").
+  const double* plane(Plane(cos_sim));
   std::list<std::pair<std::pair<std::string, std::string>, double>> list_of_pairs;
-  for (int i = 0; i < vec_num_; ++i) {
-    for (int j = 0; j < vec_num_-(i+1); ++j) {
-      if (cos_sim && sim_table_[i][j]->cos_sim >= value_min && sim_table_[i][j]->cos_sim <= value_max)
-        list_of_pairs.push_back(std::make_pair(std::make_pair(word_vecs_[i]->word, word_vecs_[j]->word), sim_table_[i][j]->cos_sim));
-      else if (sim_table_[i][j]->eucl_dist >= value_min && sim_table_[i][j]->eucl_dist <= value_max)
-        list_of_pairs.push_back(std::make_pair(std::make_pair(word_vecs_[i]->word, word_vecs_[j]->word), sim_table_[i][j]->eucl_dist));
+  if (plane && HasValueIndex(cos_sim)) {
+    // The matching pairs are contiguous in the value index (starting at the
+    // first pair whose value isn't smaller than "value_min").
+    std::vector<std::size_t> matches(DispatchValueIndex(cos_sim, [&](const auto& sorted_pairs) {
+      std::vector<std::size_t> matches;
+      for (auto it = std::lower_bound(sorted_pairs.begin(), sorted_pairs.end(), value_min, [&](const std::size_t index, const double value) {return (plane[index] < value);}); it != sorted_pairs.end() && plane[*it] <= value_max; ++it) {
+        if (*it != skipped_pair)
+          matches.push_back(*it);
+      }
+      return matches;
+    }));
+    std::sort(matches.begin(), matches.end());
+    for (const std::size_t index : matches) {
+      const std::pair<int, int> pair(GetPair(index));
+      list_of_pairs.push_back(std::make_pair(std::make_pair(words_[pair.first], words_[pair.second]), plane[index]));
+    }
+    return list_of_pairs;
+  }
+  if (plane) {
+    std::size_t index(0);
+    for (int i = 0; i < vec_num_; ++i) {
+      for (int j = i+1; j < vec_num_; ++j, ++index) {
+        if (index != skipped_pair && plane[index] >= value_min && plane[index] <= value_max)
+          list_of_pairs.push_back(std::make_pair(std::make_pair(words_[i], words_[j]), plane[index]));
+      }
     }
+    return list_of_pairs;
+  }
+  std::vector<std::vector<std::pair<std::size_t, double>>> matches_of_tasks(NumOfScanTasks(cos_sim)); // index and value of the matching pairs
+  ForEachPairValue(cos_sim, [&](const unsigned task, const int i, const int j, const double value) {
+    if (value >= value_min && value <= value_max && RowStart(i)+(j-i-1) != skipped_pair)
+      matches_of_tasks[task].push_back(std::make_pair(RowStart(i)+(j-i-1), value));
+  });
+  std::vector<std::pair<std::size_t, double>> matches;
+  for (auto& matches_of_task : matches_of_tasks)
+    matches.insert(matches.end(), matches_of_task.begin(), matches_of_task.end());
+  std::sort(matches.begin(), matches.end());
+  for (auto& match : matches) {
+    const std::pair<int, int> pair(GetPair(match.first));
+    list_of_pairs.push_back(std::make_pair(std::make_pair(words_[pair.first], words_[pair.second]), match.second));
   }
   return list_of_pairs;
 }
@@ -341,81 +501,219 @@ std::list<std::pair<std::pair<std::string, std::string>, double>> VecSimTable::M
     std::cout << "ERROR in MostSimilarPairs(): \"" << word1 << "\" couldn't be found; returned an empty list." << std::endl;
     return std::list<std::pair<std::pair<std::string, std::string>, double>>();
   }
-  const std::pair<int, int> sim_table_indices(GetSimTableIndices(l, m));
-  std::pair<int, int> word_vecs_indices;
   const bool cos_sim((std::regex_match(VecStore::SetToLowerCase(comparison_mode), (std::regex) "eucl(idean)?([ _-])?dist(ance)?"))? false : true);
-  const double central_value(((cos_sim)? sim_table_[sim_table_indices.first][sim_table_indices.second]->cos_sim : sim_table_[sim_table_indices.first][sim_table_indices.second]->eucl_dist));
-  std::list<std::pair<std::pair<std::string, std::string>, double>> list_of_pairs;
-  for (int i = 0; i < vec_num_; ++i) {
-    for (int j = 0; j < vec_num_-(i+1); ++j) {
-      if (i == sim_table_indices.first && j == sim_table_indices.second)
-        continue; // skips the original word pair in question ("word0", "word1")
-      if (list_of_pairs.size() < k) {
-        // Makes a pair of the word pair and its cosine similarity or
-        // Euclidean distance (depending on whether "cos_sim" is "true" or
-        // not) and pushs it back to "list_of_pairs".
-        word_vecs_indices = GetWordVecsIndices(i, j);
-        list_of_pairs.push_back(std::make_pair(std::make_pair(word_vecs_[word_vecs_indices.first]->word, word_vecs_[word_vecs_indices.second]->word), ((cos_sim)? sim_table_[i][j]->cos_sim : sim_table_[i][j]->eucl_dist)));
-      } else if (std::abs(central_value-((cos_sim)? sim_table_[i][j]->cos_sim : sim_table_[i][j]->eucl_dist)) < std::abs(central_value-list_of_pairs.front().second)) {
-      // If the current value (in "sim_table_[i][j]") is closer to the
-      // "central_value" than the value of "list_of_pairs.front()", this first
-      // element of the list will be replaced with the current word pair and
-      // its value.
-        list_of_pairs.pop_front();
-        word_vecs_indices = GetWordVecsIndices(i, j);
-        list_of_pairs.push_front(std::make_pair(std::make_pair(word_vecs_[word_vecs_indices.first]->word, word_vecs_[word_vecs_indices.second]->word), ((cos_sim)? sim_table_[i][j]->cos_sim : sim_table_[i][j]->eucl_dist)));
-        SortListOfWordPairs(list_of_pairs, central_value);
-      }
-      if (list_of_pairs.size() == k)
-        SortListOfWordPairs(list_of_pairs, central_value);
-    }
-  }
-  if (list_of_pairs.size() < k)
-    SortListOfWordPairs(list_of_pairs, central_value);
-  std::reverse(list_of_pairs.begin(), list_of_pairs.end()); // makes sure that the word pair with the most similar value to the word pair in question ("word0", "word1") is the first in the list
-  return list_of_pairs;
+  return FindMostSimilarPairs(PairValue(l, m, cos_sim), cos_sim, k, PairIndex(l, m)); // skips the original word pair in question ("word0", "word1")
 }
 
 std::list<std::pair<std::pair<std::string, std::string>, double>> VecSimTable::MostSimilarPairs(const double similarity, std::string comparison_mode, const unsigned k) {
 // Returns a list of the k word pairs with the most similar similarity value to
 // a given one (either the cosine similarity or the Euclidean distance).
   const bool cos_sim((std::regex_match(VecStore::SetToLowerCase(comparison_mode), (std::regex) "eucl(idean)?([ _-])?dist(ance)?"))? false : true);
-  std::list<std::pair<std::pair<std::string, std::string>, double>> list_of_pairs;
-  for (int i = 0; i < vec_num_; ++i) {
-    for (int j = 0; j < vec_num_-(i+1); ++j) {
-      if (list_of_pairs.size() < k)
-        list_of_pairs.push_back(std::make_pair(std::make_pair(word_vecs_[i]->word, word_vecs_[j]->word), ((cos_sim)? sim_table_[i][j]->cos_sim : sim_table_[i][j]->eucl_dist)));
-      else if (std::abs(similarity-((cos_sim)? sim_table_[i][j]->cos_sim : sim_table_[i][j]->eucl_dist)) < std::abs(similarity-list_of_pairs.front().second)) {
-        list_of_pairs.pop_front();
-        list_of_pairs.push_front(std::make_pair(std::make_pair(word_vecs_[i]->word, word_vecs_[j]->word), ((cos_sim)? sim_table_[i][j]->cos_sim : sim_table_[i][j]->eucl_dist)));
-        SortListOfWordPairs(list_of_pairs, similarity);
-      }
-      if (list_of_pairs.size() == k)
-        SortListOfWordPairs(list_of_pairs, similarity);
+  return FindMostSimilarPairs(similarity, cos_sim, k, NumOfPairs());
+}
+
+std::list<std::pair<std::pair<std::string, std::string>, double>> VecSimTable::FindMostSimilarPairs(const double central_value, const bool cos_sim, const unsigned k, const std::size_t skipped_pair) {
+// Returns a list of the k word pairs whose cosine similarities (or Euclidean
+// distances) are the closest to "central_value", starting with the closest one
+// (pairs with the same difference are ordered by their index in the similarity
+// table). The pair at the index "skipped_pair" won't be returned. Only the
+// indices and values of the best pairs found so far are kept during the scan;
+// their words are copied when the scan is done (the values are carried along,
+// so a scan of values calculated on demand doesn't calculate them again or
+// fill the pair cache). If the value index has been built, the
+// pairs are found in it instead of scanning the plane (see
+// "FindMostSimilarPairsInIndex()"). If the measure isn't stored in memory,
+// the values are read from the disk table or calculated tile by tile (see
+// "ForEachPairValue()"); every task keeps its own best pairs, which get merged
+// at the end.
+  const double* plane(Plane(cos_sim));
+  TopK<SimilarPair> most_similar(k, NumOfPairs());
+  if (plane && HasValueIndex(cos_sim)) {
+    for (auto& similar_pair : FindMostSimilarPairsInIndex(central_value, cos_sim, k, skipped_pair))
+      most_similar.Push(similar_pair);
+  } else if (plane) {
+    for (std::size_t index = 0; index < NumOfPairs(); ++index) {
+      if (index != skipped_pair)
+        most_similar.Push(SimilarPair{std::abs(central_value-plane[index]), index, plane[index]});
+    }
+  } else {
+    std::vector<TopK<SimilarPair>> most_similar_of_tasks(NumOfScanTasks(cos_sim), most_similar);
+    ForEachPairValue(cos_sim, [&](const unsigned task, const int i, const int j, const double value) {
+      const std::size_t index(RowStart(i)+(j-i-1));
+      if (index != skipped_pair)
+        most_similar_of_tasks[task].Push(SimilarPair{std::abs(central_value-value), index, value});
+    });
+    for (auto& most_similar_of_task : most_similar_of_tasks) {
+      for (auto& similar_pair : most_similar_of_task.Take())
+        most_similar.Push(similar_pair);
     }
   }
-  if (list_of_pairs.size() < k)
-    SortListOfWordPairs(list_of_pairs, similarity);
-  std::reverse(list_of_pairs.begin(), list_of_pairs.end());
+  std::list<std::pair<std::pair<std::string, std::string>, double>> list_of_pairs;
+  for (auto& similar_pair : most_similar.Take()) {
+    const std::pair<int, int> pair(GetPair(similar_pair.index));
+    list_of_pairs.push_back(std::make_pair(std::make_pair(words_[pair.first], words_[pair.second]), similar_pair.value));
+  }
   return list_of_pairs;
 }
 
-void VecSimTable::SortListOfWordPairs(std::list<std::pair<std::pair<std::string, std::string>, double>>& list_of_pairs, const double central_value) {
-// Sorts a list of word pairs and their corresponding values so that the pair
-// whose value is the closest to "central_value" becomes the last element of
-// the list.
-  list_of_pairs.sort([&central_value](std::pair<std::pair<std::string, std::string>, double> x, std::pair<std::pair<std::string, std::string>, double> y) {return std::abs(central_value-x.second) > std::abs(central_value-y.second);});
+std::vector<VecSimTable::SimilarPair> VecSimTable::FindMostSimilarPairsInIndex(const double central_value, const bool cos_sim, const unsigned k, const std::size_t skipped_pair) const {
+// Returns (at most) the k pairs of the value index whose values are the
+// closest to "central_value" (ordered like the ones of
+// "FindMostSimilarPairs()").
+// Starting at the position of "central_value" in the value index (found by a
+// binary search) the closer one of the next smaller and the next greater value
+// is taken until k pairs have been found; pairs with the same difference as
+// the k-th one are taken too, so the pairs with the smallest indices can be
+// chosen among them.
+  const double* plane(Plane(cos_sim));
+  std::vector<SimilarPair> most_similar;
+  if (k == 0 || std::isnan(central_value))
+    return most_similar;
+  DispatchValueIndex(cos_sim, [&](const auto& sorted_pairs) {
+    std::size_t lower(std::lower_bound(sorted_pairs.begin(), sorted_pairs.end(), central_value, [&](const std::size_t index, const double value) {return (plane[index] < value);})-sorted_pairs.begin());
+    std::size_t upper(lower); // the next smaller value is at "lower"-1, the next greater one at "upper"
+    while (lower > 0 || upper < sorted_pairs.size()) {
+      const double lower_difference((lower > 0)? std::abs(central_value-plane[sorted_pairs[lower-1]]) : 0);
+      const double upper_difference((upper < sorted_pairs.size())? std::abs(central_value-plane[sorted_pairs[upper]]) : 0);
+      const bool take_lower(lower > 0 && (upper == sorted_pairs.size() || lower_difference <= upper_difference));
+      const double difference((take_lower)? lower_difference : upper_difference);
+      if (most_similar.size() >= k && difference > most_similar.back().difference)
+        break;
+      const std::size_t index((take_lower)? sorted_pairs[--lower] : sorted_pairs[upper++]);
+      if (index != skipped_pair)
+        most_similar.push_back(SimilarPair{difference, index, plane[index]});
+    }
+  });
+  std::sort(most_similar.begin(), most_similar.end());
+  if (most_similar.size() > k)
+    most_similar.resize(k);
+  return most_similar;
+}
+
+bool VecSimTable::BuildValueIndex() {
+// Sorts the indices of all pairs of every stored plane by their values, so
+// "SimilarPairs()" and "MostSimilarPairs()" can find their pairs by a binary
+// search and read them contiguously instead of scanning a plane (pairs without
+// a defined value, e.g. of zero vectors, are left out). Returns "false" (and
+// prints an error message) if no plane is stored.
+  if (!Plane(true) && !Plane(false)) {
+    std::cout << "ERROR in BuildValueIndex(): no similarity measure is stored in the memory of this \"VecSimTable\"." << std::endl;
+    return false;
+  }
+  std::cout << "\tBuilding the value index..." << std::endl;
+  ClearValueIndex();
+  if (Plane(true) && HasWideValueIndex())
+    SortPairsByValue(Plane(true), wide_sorted_cos_sims_);
+  else if (Plane(true))
+    SortPairsByValue(Plane(true), sorted_cos_sims_);
+  if (Plane(false) && HasWideValueIndex())
+    SortPairsByValue(Plane(false), wide_sorted_eucl_dists_);
+  else if (Plane(false))
+    SortPairsByValue(Plane(false), sorted_eucl_dists_);
+  std::cout << "\t---Completed." << std::endl;
+  return true;
+}
+
+void VecSimTable::ClearValueIndex() {
+// Deletes the value index.
+  sorted_cos_sims_ = std::vector<uint32_t>();
+  sorted_eucl_dists_ = std::vector<uint32_t>();
+  wide_sorted_cos_sims_ = std::vector<uint64_t>();
+  wide_sorted_eucl_dists_ = std::vector<uint64_t>();
+}
+
+template <typename Index>
+void VecSimTable::SortPairsByValue(const double* plane, std::vector<Index>& sorted_pairs) const {
+// Writes the indices of all pairs of "plane" with a defined value into
+// "sorted_pairs" sorted by their values (and pairs with the same value by
+// their indices). The range of the values is split into buckets of the same
+// width (about "kPairsPerBucket" pairs per bucket on average): the pairs are
+// counted per bucket, written to the positions of their buckets and every
+// bucket gets sorted on its own (as value-index pairs copied into a small
+// buffer, unless it is too large), so no copy of the whole plane is needed.
+// Every step runs on one thread per core.
+  const std::size_t num_of_pairs(NumOfPairs());
+  ThreadPool thread_pool((num_of_pairs >= 2*kMinPairsPerSortRange)? 0 : 1);
+  const unsigned num_of_tasks((unsigned)std::max<std::size_t>(1, std::min<std::size_t>(thread_pool.NumOfThreads(), num_of_pairs/kMinPairsPerSortRange)));
+  const auto task_start([&](const unsigned task) {return num_of_pairs*task/num_of_tasks;});
+  std::vector<double> min_values(num_of_tasks, std::numeric_limits<double>::infinity()), max_values(num_of_tasks, -std::numeric_limits<double>::infinity());
+  std::vector<std::size_t> num_of_values(num_of_tasks, 0);
+  thread_pool.ParallelFor(num_of_tasks, [&](const unsigned task) {
+    for (std::size_t index = task_start(task); index < task_start(task+1); ++index) {
+      if (std::isnan(plane[index]))
+        continue;
+      min_values[task] = std::min(min_values[task], plane[index]);
+      max_values[task] = std::max(max_values[task], plane[index]);
+      num_of_values[task]++;
+    }
+  });
+  const double min_value(*std::min_element(min_values.begin(), min_values.end())), max_value(*std::max_element(max_values.begin(), max_values.end()));
+  const std::size_t num_of_buckets(std::max<std::size_t>(1, std::accumulate(num_of_values.begin(), num_of_values.end(), (std::size_t)0)/kPairsPerBucket));
+  const double scale((max_value > min_value)? num_of_buckets/(max_value-min_value) : 0);
+  const auto bucket_of([&](const double value) {return std::min(num_of_buckets-1, (std::size_t)((value-min_value)*scale));});
+  // "bucket_starts[task*num_of_buckets+bucket]" is first the number of pairs
+  // of "task" in "bucket" and then the position of its first one.
+  std::vector<std::size_t> bucket_starts((std::size_t)num_of_tasks*num_of_buckets+1, 0);
+  thread_pool.ParallelFor(num_of_tasks, [&](const unsigned task) {
+    std::size_t* counts(bucket_starts.data()+(std::size_t)task*num_of_buckets);
+    for (std::size_t index = task_start(task); index < task_start(task+1); ++index) {
+      if (!std::isnan(plane[index]))
+        counts[bucket_of(plane[index])]++;
+    }
+  });
+  std::size_t position(0);
+  for (std::size_t bucket = 0; bucket < num_of_buckets; ++bucket) {
+    for (unsigned task = 0; task < num_of_tasks; ++task) {
+      const std::size_t count(bucket_starts[(std::size_t)task*num_of_buckets+bucket]);
+      bucket_starts[(std::size_t)task*num_of_buckets+bucket] = position;
+      position += count;
+    }
+  }
+  bucket_starts.back() = position;
+  sorted_pairs.assign(position, 0);
+  thread_pool.ParallelFor(num_of_tasks, [&](const unsigned task) {
+    std::vector<std::size_t> next(bucket_starts.begin()+(std::size_t)task*num_of_buckets, bucket_starts.begin()+(std::size_t)(task+1)*num_of_buckets);
+    for (std::size_t index = task_start(task); index < task_start(task+1); ++index) {
+      if (!std::isnan(plane[index]))
+        sorted_pairs[next[bucket_of(plane[index])]++] = (Index)index;
+    }
+  });
+  // The pairs of "bucket" are at "bucket_starts[bucket]" to
+  // "bucket_starts[bucket+1]" now (the ones of task 0 come first).
+  bucket_starts.resize(num_of_buckets);
+  bucket_starts.push_back(position);
+  const auto is_less([plane](const Index index0, const Index index1) {
+    return (plane[index0] < plane[index1] || (plane[index0] == plane[index1] && index0 < index1));
+  });
+  thread_pool.ParallelFor(num_of_tasks, [&](const unsigned task) {
+    std::vector<std::pair<double, Index>> values;
+    const std::size_t first_bucket(std::upper_bound(bucket_starts.begin(), bucket_starts.end(), position*task/num_of_tasks)-bucket_starts.begin()-1);
+    const std::size_t last_bucket(std::upper_bound(bucket_starts.begin(), bucket_starts.end(), position*(task+1)/num_of_tasks)-bucket_starts.begin()-1);
+    for (std::size_t bucket = (task == 0)? 0 : first_bucket; bucket < ((task+1 == num_of_tasks)? num_of_buckets : last_bucket); ++bucket) {
+      const auto first(sorted_pairs.begin()+bucket_starts[bucket]), last(sorted_pairs.begin()+bucket_starts[bucket+1]);
+      if (last-first > (std::ptrdiff_t)kMaxPairsPerBucketBuffer) {
+        std::sort(first, last, is_less);
+        continue;
+      }
+      values.clear();
+      for (auto it = first; it != last; ++it)
+        values.push_back(std::make_pair(plane[*it], *it));
+      std::sort(values.begin(), values.end());
+      for (std::size_t i = 0; i < values.size(); ++i)
+        first[i] = values[i].second;
+    }
+  });
 }
 
 int VecSimTable::GetIndex(const std::string& word) {
-// Checks whether "word" is stored (using binary search for "word_vecs_" is
+// Checks whether "word" is stored (using binary search for "words_" is
 // sorted) and returns -1 if not and otherwise its index.
   int index, start(0), end(vec_num_-1);
   while (start <= end) {
     index = start+(end-start)/2;
-    if (word_vecs_[index]->word == word)
+    if (words_[index] == word)
       return index;
-    else if (word.compare(word_vecs_[index]->word) < 0)
+    else if (word.compare(words_[index]) < 0)
       end = --index;
     else
       start = ++index;
@@ -0,0 +1,248 @@
+// vec_sim_table_disk.cc
+
+// Copyright 2019 E. Decker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A disk table of a "VecSimTable" is laid out like this (all numbers in the
+// byte order of the machine that wrote it; every section starts at a multiple
+// of 4096 bytes, so the tiles are page aligned once the file is mapped into
+// memory):
+//   header      "DiskTableHeader"
+//   tile flags  one byte per tile (1 if the tile has been written completely)
+//   planes      the cosine similarities and/or the Euclidean distances (in
+//               this order), each plane consisting of "num_of_tiles" tiles
+//               (a, b) with a <= b stored row by row, i.e. (0, 0), (0, 1),
+//               ..., (1, 1), (1, 2), ...; a tile holds "tile_rows"*"tile_rows"
+//               values of the type given by "scalar_type": the value of the
+//               pair of the rows a*"tile_rows"+x and b*"tile_rows"+y is found
+//               at x*"tile_rows"+y (values of pairs with x >= y in the tiles
+//               (a, a) and of rows >= "vec_num" are 0)
+// The tiles of a table with n words need about n*n/2 values per plane, so a
+// table of 200,000 words stored as half precision values needs 40 GB per
+// plane.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+
+#include "word_vec_lib.h"
+
+namespace {
+
+const char kDiskTableMagic[8] = {'W', 'V', 'L', 'S', 'I', 'M', 'T', '\0'};
+const uint32_t kDiskTableVersion = 1;
+const uint32_t kByteOrderMark = 0x01020304;
+
+struct DiskTableHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order_mark;
+  uint32_t scalar_type; // "VecPrecision" of the values
+  uint32_t measures; // "VecSimMeasures" stored in the planes
+  int64_t vec_size, vec_num, tile_rows, num_of_tiles;
+  uint64_t vecs_hash; // hash of the words and vectors the table was calculated from
+  uint64_t tile_flags_offset, planes_offset, plane_size, file_size;
+};
+
+uint64_t AlignToPage(const uint64_t offset) {
+  return (offset+4095) & ~(uint64_t)4095;
+}
+
+} // namespace
+
+bool VecSimTable::BuildDiskTable(const std::string& file, const VecPrecision precision, const VecSimMeasures measures) {
+// Calculates the cosine similarities and/or Euclidean distances (see
+// "measures") of all word pairs tile by tile and writes them (as values of
+// the type given by "precision") to the disk table "file", which then gets
+// mapped into memory and serves all methods of the "VecSimTable" instead of
+// the planes in memory (see the layout above). Every finished tile is written
+// to the file right away, so only one tile per thread is kept in memory. If
+// "file" already contains a disk table of the same vectors built with the
+// same settings, only the tiles that are still missing get calculated (so an
+// interrupted build can be resumed, and a complete table is just mapped).
+// Returns "false" (and prints an error message) if the table couldn't be
+// built; a disk table mapped before is kept then.
+  if (vec_num_ < 2 || measures == VecSimMeasures::kNone) {
+    std::cout << "ERROR in BuildDiskTable(): there have to be at least two word vectors and one similarity measure." << std::endl;
+    return false;
+  }
+  const int num_of_tile_rows((vec_num_+kDiskTileRows-1)/kDiskTileRows);
+  const int num_of_planes((measures == VecSimMeasures::kAll)? 2 : 1);
+  const std::size_t tile_size((std::size_t)kDiskTileRows*kDiskTileRows);
+  DiskTableHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kDiskTableMagic, sizeof(kDiskTableMagic));
+  header.version = kDiskTableVersion;
+  header.byte_order_mark = kByteOrderMark;
+  header.scalar_type = (uint32_t)precision;
+  header.measures = (uint32_t)measures;
+  header.vec_size = vec_size_;
+  header.vec_num = vec_num_;
+  header.tile_rows = kDiskTileRows;
+  header.num_of_tiles = (int64_t)num_of_tile_rows*(num_of_tile_rows+1)/2;
+  header.vecs_hash = HashOfVecs();
+  header.tile_flags_offset = AlignToPage(sizeof(DiskTableHeader));
+  header.planes_offset = AlignToPage(header.tile_flags_offset+header.num_of_tiles);
+  header.plane_size = header.num_of_tiles*tile_size*SizeOfPrecision(precision);
+  header.file_size = header.planes_offset+num_of_planes*header.plane_size;
+  std::vector<char> tile_flags(header.num_of_tiles, 0);
+  std::fstream file_stream(file, std::ios::in | std::ios::out | std::ios::binary);
+  if (file_stream.is_open()) {
+    DiskTableHeader existing_header;
+    file_stream.read(reinterpret_cast<char*>(&existing_header), sizeof(existing_header));
+    if (!file_stream.good() || std::memcmp(&existing_header, &header, sizeof(header)) != 0) {
+      std::cout << "ERROR in BuildDiskTable(): \"" << file << "\" is no disk table of this \"VecSimTable\" with the same settings; the file wasn't changed." << std::endl;
+      return false;
+    }
+    file_stream.seekg(header.tile_flags_offset);
+    file_stream.read(tile_flags.data(), header.num_of_tiles);
+  } else {
+    file_stream.open(file, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    if (file_stream.is_open()) {
+      file_stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      file_stream.seekp(header.tile_flags_offset);
+      file_stream.write(tile_flags.data(), header.num_of_tiles);
+      file_stream.seekp(header.file_size-1); // the planes stay sparse until their tiles are written
+      file_stream.put(0);
+    }
+  }
+  if (!file_stream.good()) {
+    std::cout << "ERROR in BuildDiskTable(): OPENING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  struct Tile {
+    std::size_t index;
+    int a, b; // tile of the rows a*"kDiskTileRows"... and the columns b*"kDiskTileRows"...
+  };
+  std::vector<Tile> missing_tiles;
+  std::size_t num_of_pairs(0), index(0);
+  for (int a = 0; a < num_of_tile_rows; ++a) {
+    for (int b = a; b < num_of_tile_rows; ++b, ++index) {
+      if (tile_flags[index])
+        continue;
+      missing_tiles.push_back(Tile{index, a, b});
+      const std::size_t rows(std::min(vec_num_, (a+1)*kDiskTileRows)-a*kDiskTileRows), cols(std::min(vec_num_, (b+1)*kDiskTileRows)-b*kDiskTileRows);
+      num_of_pairs += (a == b)? rows*(rows-1)/2 : rows*cols;
+    }
+  }
+  std::cout << "\tCalculating the disk table \"" << file << "\" (" << missing_tiles.size() << " of " << header.num_of_tiles << " tiles missing)..." << std::endl;
+  const std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+  std::mutex file_mutex;
+  DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    DispatchPrecision(precision, [&](auto value_zero) {
+      typedef decltype(value_zero) S;
+      typedef typename ComputeType<S>::type ComputeS;
+      const unsigned num_of_tasks((unsigned)std::min<std::size_t>(missing_tiles.size(), 1u << 30));
+      const std::function<void(const unsigned)> task([&](const unsigned t) {
+        std::vector<typename ComputeType<T>::type> rows, cols;
+        std::vector<S> cos_sims, eucl_dists;
+        for (std::size_t k = missing_tiles.size()*t/num_of_tasks; k < missing_tiles.size()*(t+1)/num_of_tasks; ++k) {
+          const Tile& tile(missing_tiles[k]);
+          const int first_row(tile.a*kDiskTileRows), first_col(tile.b*kDiskTileRows);
+          if (measures != VecSimMeasures::kEuclidean)
+            cos_sims.assign(tile_size, static_cast<S>(ComputeS(0)));
+          if (measures != VecSimMeasures::kCosine)
+            eucl_dists.assign(tile_size, static_cast<S>(ComputeS(0)));
+          ForEachPairOfTile<T>(first_row, std::min(vec_num_, first_row+kDiskTileRows), first_col, std::min(vec_num_, first_col+kDiskTileRows), rows, cols, [&](const int i, const int j, const double dot_product) {
+            const std::size_t position((std::size_t)(i-first_row)*kDiskTileRows+(j-first_col));
+            if (!cos_sims.empty())
+              cos_sims[position] = static_cast<S>((ComputeS)CosSim(i, j, dot_product));
+            if (!eucl_dists.empty())
+              eucl_dists[position] = static_cast<S>((ComputeS)EuclDist(i, j, dot_product));
+          });
+          std::lock_guard<std::mutex> lock(file_mutex);
+          uint64_t offset(header.planes_offset+tile.index*tile_size*sizeof(S));
+          for (const std::vector<S>* values : {&cos_sims, &eucl_dists}) {
+            if (values->empty())
+              continue;
+            file_stream.seekp(offset);
+            file_stream.write(reinterpret_cast<const char*>(values->data()), tile_size*sizeof(S));
+            offset += header.plane_size;
+          }
+          file_stream.flush(); // the flag of a tile mustn't reach the file before its values
+          file_stream.seekp(header.tile_flags_offset+tile.index);
+          file_stream.put(1);
+        }
+      });
+      if (num_of_tasks > 1) {
+        ThreadPool thread_pool;
+        thread_pool.ParallelFor(num_of_tasks, task);
+      } else if (num_of_tasks == 1) {
+        task(0);
+      }
+    });
+  });
+  file_stream.flush();
+  if (!file_stream.good()) {
+    std::cout << "ERROR in BuildDiskTable(): WRITING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  file_stream.close();
+  const double seconds(std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count());
+  std::cout << "\t---Completed (" << num_of_pairs << " pairs in " << seconds << " s, i.e. " << ((seconds > 0)? num_of_pairs/seconds : 0) << " pairs/s)." << std::endl;
+  std::unique_ptr<MappedFile> disk_table(new MappedFile(file, MappedFileAccess::kRandom)); // "DiskValue()" reads single values at random positions
+  if (!disk_table->IsOpen() || disk_table->Size() != header.file_size) {
+    std::cout << "ERROR in BuildDiskTable(): MAPPING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  disk_table_ = std::move(disk_table);
+  disk_table_file_ = file;
+  disk_precision_ = precision;
+  disk_num_of_tile_rows_ = num_of_tile_rows;
+  const char* plane(disk_table_->Data()+header.planes_offset);
+  disk_cos_sims_ = (measures != VecSimMeasures::kEuclidean)? plane : NULL;
+  disk_eucl_dists_ = (measures != VecSimMeasures::kCosine)? plane+((disk_cos_sims_)? header.plane_size : 0) : NULL;
+  return true;
+}
+
+void VecSimTable::CloseDiskTable() {
+// Unmaps the disk table (the file is kept).
+  disk_cos_sims_ = disk_eucl_dists_ = NULL;
+  disk_num_of_tile_rows_ = 0;
+  disk_table_file_.clear();
+  disk_table_.reset();
+}
+
+double VecSimTable::DiskValue(int i, int j, const bool cos_sim) const {
+// Reads the cosine similarity (or Euclidean distance) of the pair
+// ("words_[i]", "words_[j]") from the plane of the disk table.
+  if (i > j)
+    std::swap(i, j);
+  const int a(i/kDiskTileRows), b(j/kDiskTileRows);
+  const std::size_t position(DiskTileIndex(a, b)*kDiskTileRows*kDiskTileRows+(std::size_t)(i-a*kDiskTileRows)*kDiskTileRows+(j-b*kDiskTileRows));
+  return DispatchPrecision(disk_precision_, [&](auto zero) {
+    typedef decltype(zero) S;
+    return (double)static_cast<typename ComputeType<S>::type>(reinterpret_cast<const S*>(DiskPlane(cos_sim))[position]);
+  });
+}
+
+uint64_t VecSimTable::HashOfVecs() const {
+// Returns the FNV-1a hash of the words and the matrix of the "VecSimTable"
+// (so a disk table can be matched with the vectors it was calculated from).
+  uint64_t hash(0xcbf29ce484222325ull);
+  const auto add([&hash](const unsigned char* data, const std::size_t size) {
+    for (std::size_t i = 0; i < size; ++i)
+      hash = (hash^data[i])*0x100000001b3ull;
+  });
+  for (auto& word : words_)
+    add(reinterpret_cast<const unsigned char*>(word.c_str()), word.size()+1);
+  add(matrix_.Data(), matrix_.Size());
+  return hash;
+}
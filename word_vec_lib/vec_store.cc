@@ -14,193 +14,341 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#include <fstream>
 #include <iostream>
-#include <sstream>
+#include <limits>
 
 #include "word_vec_lib.h"
 
-VecStore::VecStore(const std::string& input_file, const bool case_sensitive, const double percentage)
-    : input_file_(input_file),
-      vec_size_(GetSizeOfVectors()),
-      vec_num_(CountVectors()*((percentage > 1)? 1 : percentage)+0.5),
-      hash_table_size_((vec_num_ > 19)? vec_num_/20 : 1), // in some cases you may have to adjust the denominator in order to reduce the number of collisions
-      case_sensitive_(case_sensitive) {
-  std::vector<WordVec*> HT(hash_table_size_);
-  hash_table_ = HT;
-  ReadVectorFile();
-}
-
-VecStore::~VecStore() {
-  WordVec* current_word_vector;
-  for (auto& bucket : hash_table_) {
-    while (bucket) {
-      current_word_vector = bucket;
-      bucket = bucket->next;
-      delete current_word_vector;
-    }
-  }
+namespace {
+
+const double kAnalogyEpsilon = 0.001; // keeps "VecAnalogy::k3CosMul" from dividing by 0
+
+} // namespace
+
+VecStore::VecStore(const std::string& input_file, const bool case_sensitive, const double percentage, const VecPrecision precision)
+// Reads the word vectors from "input_file", which can either be a text file
+// or a snapshot file written by "VecStore::Save()" (in that case the case
+// sensitivity and the precision stored in the snapshot will be used and
+// "percentage" will be ignored). The vectors will be stored as elements of the
+// type corresponding to "precision".
+    : matrix_(NULL),
+      word_pool_(NULL),
+      word_offsets_(NULL),
+      index_slots_(NULL),
+      row_bytes_(0),
+      norms_(NULL),
+      normalized_(false),
+      code_bytes_(0),
+      quantization_(VecQuantization::kNone),
+      rescoring_factor_(0),
+      quantization_error_(0),
+      pq_num_of_centroids_(0),
+      hnsw_m_(0),
+      hnsw_ef_construction_(0),
+      hnsw_entry_point_(-1),
+      hnsw_max_level_(-1),
+      hnsw_metric_(VecMetric::kEuclidean),
+      ivf_num_of_lists_(0),
+      ivf_num_of_probes_(0),
+      ivf_metric_(VecMetric::kEuclidean),
+      lsh_num_of_tables_(0),
+      lsh_num_of_bits_(0),
+      pruned_search_(false),
+      input_file_(input_file),
+      case_sensitive_(case_sensitive),
+      precision_(precision),
+      num_of_threads_(0) {
+  if (LoadSnapshot())
+    return;
+  VecFileContents contents(VecFile::Read(input_file_, "VecStore", case_sensitive, percentage, precision_));
+  SetSizes(contents.vec_size, contents.vec_num, GetHashTableSize(contents.vec_num));
+  StoreVectors(contents);
 }
 
-const int VecStore::GetSizeOfVectors() {
-// Returns the number of dimensions of the word vectors found in "input_file_"
-// (assuming that each line of the file contains exactly one vector and that
-// all the word vectors got the same number of dimensions).
-  std::ifstream file_stream(input_file_);
-  if (!file_stream.is_open()) {
-    std::cout << "ERROR: OPENING \"" << input_file_ << "\" FAILED!\nMake sure that the file exists and that the path is correct." << std::endl;
-    return -1;
-  } else if (file_stream.bad()) {
-    std::cout << "ERROR: OPENING \"" << input_file_ << "\" FAILED!" << std::endl;
-    return -1;
-  }
-  std::cout << "CREATING A \"VecStore\"." << '\n' << "Input file (\"word vector file\"): " << input_file_ << '\n';
-  std::cout << "\tChecking the size of the word vectors..." << std::endl;
-  std::string line;
-  std::getline(file_stream, line);
-  std::cout << "\t---Done." << '\n';
-  return std::count(line.begin(), line.end(), ' ');
-}
-
-const int VecStore::CountVectors() {
-// Returns the number of word vectors in "input_file_" (assuming that each line
-// of the file contains exactly one vector).
-  if (vec_size_ < 1)
-    return -1;
-  unsigned vector_num(0);
-  std::ifstream file_stream(input_file_);
-  std::cout << "\tCounting the word vectors..." << std::endl;
-  std::string line;
-  while (std::getline(file_stream, line))
-    vector_num++; // this might cause problems if your "input_file_" is not a valid word vector file because actually lines and not vectors are counted
-  std::cout << "\t---Done." << std::endl;
-  return vector_num;
-}
-
-void VecStore::ReadVectorFile() {
-// Reads "input_file_" and passes the lines to "VecStore::StoreVectors()".
+VecStore::~VecStore() {}
+
+void VecStore::SetSizes(const int vec_size, const int vec_num, const int hash_table_size) {
+  vec_size_ = vec_size;
+  vec_num_ = vec_num;
+  hash_table_size_ = hash_table_size;
+  row_bytes_ = (vec_size_ > 0)? RowBytes(vec_size_, precision_) : 0;
+  word_vecs_.clear();
+  word_vecs_.resize((vec_num_ > 0)? vec_num_ : 0);
+}
+
+void VecStore::StoreVectors(VecFileContents& contents) {
+// Takes over the matrix read by "VecFile::Read()", copies the words into the
+// word pool and builds the hash table over their rows.
   if (!HashTableIsValid())
     return;
-  std::cout << "\tLoading data..." << std::endl;
-  std::string line;
-  std::ifstream vector_file_stream(input_file_);
-  unsigned remaining_vecs(vec_num_);
-  while (std::getline(vector_file_stream, line) && remaining_vecs-- != 0)
-    StoreVectors(line);
-  std::cout << "\t---Completed." << std::endl;
-}
-
-void VecStore::StoreVectors(const std::string& line) {
-// Stores the word vectors in the hash table on memory.
-  const std::vector<std::string> tokens(SplitLine(line));
-  std::vector<double> vector(vec_size_);
-  const unsigned index(GetIndex(tokens[0]));
-  for (int i = 0; i < vec_size_; ++i)
-    // Converts the (std::string) elements of "tokens" that represent the
-    // values of the word vector into the type "double".
-    vector[i] = atof(tokens[i+1].c_str());
-  if (hash_table_[index]) { // collisions are handled by chaining using a linked list
-    WordVec* current_word_vector = hash_table_[index];
-    while (current_word_vector->next)
-      current_word_vector = current_word_vector->next;
-    current_word_vector->next = new WordVec(tokens[0], vector);
-  } else
-    hash_table_[index] = new WordVec(tokens[0], vector);
-}
-
-std::vector<std::string> VecStore::SplitLine(const std::string& line) {
-// Splits the lines (strings) of the vector file into their tokens and returns
-// all of those tokens in a std::vector. (The tokens within a "line" should be
-// separated by whitespaces.)
-  std::stringstream stream(line);
-  std::string item;
-  std::vector<std::string> tokens(vec_size_+1);
-  for (auto& token : tokens) {
-    std::getline(stream, item, ' ');
-    token = item;
+  owned_matrix_ = std::move(contents.matrix);
+  owned_word_offsets_.resize(vec_num_+1);
+  owned_word_offsets_[0] = 0;
+  for (int i = 0; i < vec_num_; ++i)
+    owned_word_offsets_[i+1] = owned_word_offsets_[i]+contents.words[i].size();
+  owned_word_pool_.reserve(owned_word_offsets_.back());
+  for (auto& word : contents.words)
+    owned_word_pool_.insert(owned_word_pool_.end(), word.begin(), word.end());
+  matrix_ = owned_matrix_.Data();
+  word_pool_ = owned_word_pool_.data();
+  word_offsets_ = owned_word_offsets_.data();
+  // Inserts the rows in their order (linear probing), so if a word is stored
+  // more than once the first row holding it will be found.
+  owned_index_slots_.assign(hash_table_size_, IndexSlot{0, kEmptySlot});
+  const uint64_t mask(hash_table_size_-1);
+  for (int i = 0; i < vec_num_; ++i) {
+    const uint64_t hash(HashWord(Word(i)));
+    uint64_t slot(hash & mask);
+    while (owned_index_slots_[slot].row != kEmptySlot)
+      slot = (slot+1) & mask;
+    owned_index_slots_[slot] = IndexSlot{(uint32_t)(hash >> 32), (uint32_t)i};
   }
-  if (!case_sensitive_)
-    tokens[0] = SetToLowerCase(tokens[0]);
-  return tokens;
-}
-
-unsigned VecStore::GetIndex(const std::string& key) { // hash function
-// Returns the "index" of the bucket of the hash table the "key" corresponds to.
-  unsigned hash(0), j(1), k(0);
-  const std::vector<int> primes({179, 181, 191, 193, 197, 199, 211, 223, 227, 229});
-  for (unsigned i = 0; i < key.length(); ++i) {
-    if (i == (primes.size()*j)) {
-      k = 0;
-      j++;
+  index_slots_ = owned_index_slots_.data();
+  ComputeNorms();
+}
+
+void VecStore::ComputeNorms() {
+// Calculates the Euclidean norms of all rows once, so the cosine similarity of
+// a query and a row only needs their dot product.
+  owned_norms_.resize(vec_num_);
+  DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    for (int row = 0; row < vec_num_; ++row)
+      owned_norms_[row] = std::sqrt(VecCalc::DotProduct(Row<T>(row), Row<T>(row), vec_size_));
+  });
+  norms_ = owned_norms_.data();
+}
+
+bool VecStore::Normalize(const bool in_place) {
+// Divides all rows by their Euclidean norms (rows with a norm of 0 are kept as
+// they are), so searching with "VecMetric::kCosine" becomes a plain dot
+// product scan. If "in_place" is "false" the normalized rows are stored in a
+// copy of the matrix and all vectors handed out by the "VecStore" stay as they
+// are. Otherwise the matrix itself gets overwritten (which saves the memory of
+// the copy): from then on all vectors handed out have got a norm of 1 and the
+// Euclidean distances are measured between the normalized vectors; a
+// quantization will be deleted and has to be made again. Returns "false" (and
+// prints an error message) if the "VecStore" is empty.
+  if (!HashTableIsValid()) {
+    std::cout << "ERROR in Normalize(): the \"VecStore\" is empty." << std::endl;
+    return false;
+  }
+  if (MatrixIsDropped("Normalize"))
+    return false;
+  if (normalized_)
+    return true;
+  AlignedArray<unsigned char> normalized_matrix((std::size_t)vec_num_*row_bytes_);
+  std::copy(matrix_, matrix_+normalized_matrix.Size(), normalized_matrix.Data());
+  DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    for (int row = 0; row < vec_num_; ++row) {
+      if (norms_[row] > 0) {
+        T* normalized_row(reinterpret_cast<T*>(normalized_matrix.Data()+row*row_bytes_));
+        for (int i = 0; i < vec_size_; ++i)
+          normalized_row[i] = static_cast<T>(static_cast<typename ComputeType<T>::type>(normalized_row[i])/norms_[row]);
+      }
     }
-    hash += (int) key[i]*primes[k]; // multiplies each ASCII-value of "key" with an element of "primes" (i.e. a prime number)
-    k++;
+  });
+  if (!in_place) {
+    normalized_matrix_ = std::move(normalized_matrix);
+    return true;
+  }
+  // The matrix of a snapshot is mapped read-only, so it gets replaced by the
+  // normalized copy in any case.
+  owned_matrix_ = std::move(normalized_matrix);
+  matrix_ = owned_matrix_.Data();
+  normalized_matrix_ = AlignedArray<unsigned char>();
+  normalized_ = true;
+  ComputeNorms();
+  if (pruned_search_)
+    SortRowsByNorm(); // the norms have changed
+  ClearQuantization();
+  if (hnsw_metric_ != VecMetric::kCosine)
+    ClearHnswIndex(); // the Euclidean distances have changed
+  if (ivf_metric_ != VecMetric::kCosine)
+    ClearIvfIndex();
+  std::lock_guard<std::mutex> lock(word_vecs_mutex_);
+  for (int row = 0; row < vec_num_; ++row) {
+    if (word_vecs_[row])
+      word_vecs_[row]->vec = GetRowVec(row);
   }
-  const unsigned index(hash%hash_table_size_);
-  if (index < 0)
-    return 0;
-  if (index > (unsigned)(hash_table_size_-1))
-    return hash_table_size_-1;
-  return index;
+  return true;
+}
+
+int VecStore::GetHashTableSize(const int vec_num) {
+// Returns the number of slots of the hash table: the smallest power of two
+// that keeps the load factor at most 0.5.
+  int64_t size(1);
+  while (size < 2*(int64_t)vec_num && size < (1ll << 30))
+    size *= 2;
+  return size;
+}
+
+uint64_t VecStore::HashWord(const std::string_view word) { // hash function
+// Returns a 64 bit hash of "word" (in the style of wyhash: 8 bytes at a time
+// get mixed into the hash by a 64x64->128 bit multiplication).
+  const uint64_t kSecret[4] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull};
+  auto mix = [](const uint64_t a, const uint64_t b) {
+    const __uint128_t product((__uint128_t)a*b);
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+  };
+  uint64_t hash(kSecret[0] ^ word.size()), block;
+  std::size_t i(0);
+  for (; i+8 <= word.size(); i += 8) {
+    std::memcpy(&block, word.data()+i, 8);
+    hash = mix(block ^ kSecret[1], hash ^ kSecret[2]);
+  }
+  block = 0;
+  std::memcpy(&block, word.data()+i, word.size()-i);
+  hash = mix(block ^ kSecret[1], hash ^ kSecret[3]);
+  return mix(hash ^ kSecret[0], word.size() ^ kSecret[1]);
+}
+
+unsigned VecStore::GetProbeLength(const int row) {
+// Returns the number of slots of the hash table that have to be checked to
+// find the word of "row".
+  const uint64_t mask(hash_table_size_-1);
+  uint64_t slot(HashWord(Word(row)) & mask);
+  unsigned probe_length(1);
+  while (index_slots_[slot].row != (uint32_t)row) {
+    slot = (slot+1) & mask;
+    probe_length++;
+  }
+  return probe_length;
 }
 
 void VecStore::PrintInfo() {
-// Calculates some of the numeric information of the created hash and prints
-// them.
-  int num_of_empty_buckets = 0, highest_num_of_nodes_in_a_bucket = 0, word_vector_num;
-  for (int i = 0; i < hash_table_size_; ++i) {
-    word_vector_num = GetNumOfWordVecs(i);
-    if (word_vector_num == 0)
-      num_of_empty_buckets++;
-    if (highest_num_of_nodes_in_a_bucket < word_vector_num)
-      highest_num_of_nodes_in_a_bucket = word_vector_num;
+// Calculates some of the numeric information of the created hash table and
+// prints them.
+  uint64_t probe_length_sum = 0;
+  unsigned longest_probe_length = 0, probe_length;
+  for (int row = 0; row < vec_num_; ++row) {
+    probe_length = GetProbeLength(row);
+    probe_length_sum += probe_length;
+    if (longest_probe_length < probe_length)
+      longest_probe_length = probe_length;
   }
   std::cout << "Basic information about the \"VecStore\":" << '\n';
   // Prints the most important information regarding the created hash table.
   std::cout << "\tSize of vectors = " << vec_size_ << '\n';
   std::cout << "\tNumber of stored word vectors = " << vec_num_ << '\n';
-  std::cout << "\tNumber of buckets = " << hash_table_size_ << '\n';
+  std::cout << "\tNumber of slots of the hash table = " << hash_table_size_ << '\n';
   std::cout << "\tLoad factor = " << (double) vec_num_/hash_table_size_ << '\n';
-  std::cout << "\tNumber of empty buckets = " << num_of_empty_buckets << '\n';
-  std::cout << "\tPercentage of empty buckets = " << 100*((double) num_of_empty_buckets/hash_table_size_) << " %\n";
-  std::cout << "\tHighest number of word vectors in a bucket = " << highest_num_of_nodes_in_a_bucket << '\n';
-  std::cout << "\tPercentage of vectors in mostly filled bucket = " << 100*((double) highest_num_of_nodes_in_a_bucket/vec_num_) << '\n';
+  std::cout << "\tAverage number of probed slots per stored word = " << ((vec_num_ > 0)? (double) probe_length_sum/vec_num_ : 0) << '\n';
+  std::cout << "\tHighest number of probed slots for a stored word = " << longest_probe_length << '\n';
+  if (quantization_ == VecQuantization::kProduct)
+    std::cout << "\tThe vectors are product quantized to " << pq_subspace_offsets_.size()-1 << " bytes (relative quantization error = " << quantization_error_ << ")\n";
+  if (matrix_ == NULL && HashTableIsValid())
+    std::cout << "\tThe matrix has been dropped; only the product quantization codes are kept" << '\n';
+  else if (quantization_ != VecQuantization::kNone)
+    std::cout << "\tThe vectors are quantized to int8 " << ((quantization_ == VecQuantization::kPerDimension)? "per dimension" : "per vector") << " (relative quantization error = " << quantization_error_ << ")\n";
+  if (normalized_)
+    std::cout << "\tThe vectors are normalized to a Euclidean norm of 1" << '\n';
+  else if (normalized_matrix_.Size() > 0)
+    std::cout << "\tA normalized copy of the vectors is kept for cosine searches" << '\n';
+  if (pruned_search_)
+    std::cout << "\tExact Euclidean searches skip rows by their norms and abandon distances early" << '\n';
+  if (ivf_num_of_lists_ > 0)
+    std::cout << "\tAn inverted file (" << ivf_num_of_lists_ << " lists) is built for the " << ((ivf_metric_ == VecMetric::kCosine)? "cosine similarity" : "Euclidean distance") << '\n';
+  if (lsh_num_of_tables_ > 0)
+    std::cout << "\tAn LSH index (" << lsh_num_of_tables_ << " tables of " << lsh_num_of_bits_ << " bit signatures) is built for the cosine similarity" << '\n';
+  if (hnsw_entry_point_ >= 0)
+    std::cout << "\tAn HNSW graph (m = " << hnsw_m_ << ", " << hnsw_max_level_+1 << " layers) is built for the " << ((hnsw_metric_ == VecMetric::kCosine)? "cosine similarity" : "Euclidean distance") << '\n';
   std::cout << "\tThis \"VecStore\" works " << ((case_sensitive_)? "case sensitive." : "case insensitive.") << std::endl;
 }
 
-unsigned VecStore::GetNumOfWordVecs(const unsigned index) {
-// Counts the number of word vectors (nodes) in a bucket of the
-// "HashTableOnMemory" and returns this number.
-  unsigned count(0);
-  if (!hash_table_[index])
-    return 0;
-  else {
-    for (WordVec* it = hash_table_[index]; it; it = it->next)
-      count++;
+int VecStore::FindRow(const std::string& word) {
+// Returns the row of the matrix holding the vector of "word" (which must
+// already be set to lower case if the "VecStore" works case insensitive) or
+// -1 if "word" isn't stored.
+  if (!HashTableIsValid())
+    return -1;
+  const uint64_t hash(HashWord(word)), mask(hash_table_size_-1);
+  const uint32_t fingerprint(hash >> 32);
+  for (uint64_t slot = hash & mask; index_slots_[slot].row != kEmptySlot; slot = (slot+1) & mask) {
+    if (index_slots_[slot].fingerprint == fingerprint && Word(index_slots_[slot].row) == word)
+      return index_slots_[slot].row;
   }
-  return count;
+  return -1;
+}
+
+std::vector<double> VecStore::GetRowVec(const int row) const {
+// Returns a copy of a row of the matrix (converted to "double"s); if the
+// matrix has been dropped (see "DropMatrix()") the row is put together from
+// the centroids of its product quantization codes.
+  if (matrix_ == NULL) {
+    const int num_of_subspaces(pq_subspace_offsets_.size()-1);
+    std::vector<double> row_vec(vec_size_);
+    for (int m = 0; m < num_of_subspaces; ++m) {
+      const int offset(pq_subspace_offsets_[m]), size(pq_subspace_offsets_[m+1]-offset);
+      const float* centroid(pq_centroids_.data()+(std::size_t)pq_num_of_centroids_*offset+pq_codes_[(std::size_t)row*num_of_subspaces+m]*size);
+      std::copy(centroid, centroid+size, row_vec.begin()+offset);
+    }
+    return row_vec;
+  }
+  return DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    const T* vec(Row<T>(row));
+    std::vector<double> row_vec(vec_size_);
+    for (int i = 0; i < vec_size_; ++i)
+      row_vec[i] = static_cast<typename ComputeType<T>::type>(vec[i]);
+    return row_vec;
+  });
+}
+
+WordVec* VecStore::GetWordVec(const int row) {
+// Returns a "WordVec" holding a copy of a row of the matrix; it gets created
+// the first time it is needed and lives as long as the "VecStore".
+  std::lock_guard<std::mutex> lock(word_vecs_mutex_); // several threads may search at the same time
+  if (!word_vecs_[row])
+    word_vecs_[row].reset(new WordVec(std::string(Word(row)), GetRowVec(row)));
+  return word_vecs_[row].get();
+}
+
+std::list<WordVec*> VecStore::GetWordVecs(const std::vector<CloseWordVec>& closest) {
+// Returns the "WordVec"s of the rows found by a search (in the same order).
+  std::list<WordVec*> word_vecs;
+  for (auto& close_word_vec : closest)
+    word_vecs.push_back(GetWordVec(close_word_vec.row));
+  return word_vecs;
 }
 
 double VecStore::GetSimilarity(const std::vector<std::string>& words, std::string comparison_mode) {
-// Starts searching for the word vectors corresponding to the "words" by
-// passing the "words" to "GetVector()". If a word cannot be found in the
-// "hash_table_", "GetVector()" returns an empty vector. If so, the
-// method stops by returning NaN and printing an error message. If both word
-// vectors are found, their cosine similarity or Euclidean distance will be
-// returned (depending on the "comparison_mode"; by default it is the cosine
-// similarity).
-  std::vector<std::vector<double>> vectors(2, std::vector<double>(vec_size_));
-  for (unsigned i = 0; i < words.size(); ++i) {
-    vectors[i] = GetVec(words[i]);
-    if (vectors[i].empty()) {
+// Starts searching for the rows corresponding to the "words". If a word
+// cannot be found in the "VecStore", the method stops by returning NaN and
+// printing an error message. If both word vectors are found, their cosine
+// similarity or Euclidean distance will be returned (depending on the
+// "comparison_mode"; by default it is the cosine similarity). The cosine
+// similarity is calculated using the norms cached by the "VecStore" (if the
+// matrix has been dropped both are calculated from the approximated vectors).
+  if (words.size() != 2) {
+    std::cout << "ERROR in GetSimilarity(): two words are needed." << std::endl;
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  int rows[2];
+  for (unsigned i = 0; i < 2; ++i) {
+    std::string word(words[i]);
+    if (!case_sensitive_)
+      word = SetToLowerCase(word);
+    rows[i] = FindRow(word);
+    if (rows[i] < 0) {
+      GetVec(word); // prints the error message of "GetVec()"
       std::cout << "ERROR in GetSimilarity(): \"" << words[i] << "\" couldn't be found." << std::endl;
       return std::numeric_limits<double>::quiet_NaN();
     }
   }
-  if (std::regex_match(SetToLowerCase(comparison_mode), (std::regex) "eucl(idean)?([ _-])?dist(ance)?"))
-    return VecCalc::EuclideanDistance(vectors[0], vectors[1]);
-  else
-    return VecCalc::CosineSimilarity(vectors[0], vectors[1]);
+  static const std::regex kEuclideanDistance("eucl(idean)?([ _-])?dist(ance)?");
+  const bool euclidean_distance(std::regex_match(SetToLowerCase(comparison_mode), kEuclideanDistance));
+  if (matrix_ == NULL) { // the matrix has been dropped (see "DropMatrix()")
+    const std::vector<double> vec0(GetRowVec(rows[0])), vec1(GetRowVec(rows[1]));
+    return (euclidean_distance)? VecCalc::EuclideanDistance(vec0, vec1) : VecCalc::CosineSimilarity(vec0, vec1);
+  }
+  return DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    if (euclidean_distance)
+      return std::sqrt(VecCalc::SquaredEuclideanDistance(Row<T>(rows[0]), Row<T>(rows[1]), vec_size_));
+    return VecCalc::DotProduct(Row<T>(rows[0]), Row<T>(rows[1]), vec_size_)/(norms_[rows[0]]*norms_[rows[1]]);
+  });
 }
 
 std::vector<double> VecStore::GetVec(std::string word) {
@@ -209,152 +357,601 @@ std::vector<double> VecStore::GetVec(std::string word) {
 // empty vector will be returned, and an error message will be printed.
   if (!case_sensitive_)
     word = SetToLowerCase(word);
-  const int index(GetIndex(word));
-  if (hash_table_[index]) {
-    for (WordVec* it = hash_table_[index]; it; it = it->next)
-      if (it->word == word) return it->vec;
-  }
+  const int row(FindRow(word));
+  if (row >= 0)
+    return GetRowVec(row);
   std::cout << "ERROR in GetVec(): \"" << word << "\" couldn't be found in your data; returned an empty vector." << std::endl;
   return std::vector<double>();
 }
 
-WordVec* VecStore::ClosestWordVec(const std::vector<double>& vec, const std::string& word) {
-// Finds the closest vector to a given word vector (with regard to the
-// Euclidean distance). If a vector ("vec") is given, the closest vector in the
-// hash table ("VecStore") to this given vector will be returned. If only a
+WordVec* VecStore::ClosestWordVec(const std::vector<double>& vec, const std::string& word, const VecMetric metric) {
+// Finds the closest vector to a given word vector (with regard to "metric"; by
+// default the Euclidean distance). If a vector ("vec") is given, the closest
+// vector in the "VecStore" to this given vector will be returned. If only a
 // "word" is given it will be checked whether a corresponding word vector is
 // stored - if so the closest vector to this word vector will be returned
 // (otherwise "NULL" will be returned).
-  if (vec.empty())
-    return NULL; // if no vector corresponding to the "word" is stored in the hash table NULL will be returned
-  WordVec* cur, *closest_vec; // current bucket and closest word vector
-  double min_distance(9999999), cur_distance;
-  for (auto& bucket : hash_table_) {
-    cur = bucket;
-    while (cur) {
-      if (cur->word != word && min_distance > (cur_distance = VecCalc::EuclideanDistance(vec, cur->vec))) {
-        min_distance = cur_distance;
-        closest_vec = cur;
+  const std::list<WordVec*> closest(SearchWordVecs(vec, 1, FindRow(word), false, metric)); // excludes the row of "word" itself
+  return (closest.empty())? NULL : closest.front();
+}
+
+std::list<WordVec*> VecStore::KClosestWordVecs(const std::vector<double>& vec, const unsigned k, const std::string& word, const VecMetric metric) {
+// Finds the k closest vectors to a given word vector (with regard to
+// "metric"; by default the Euclidean distance). If a vector ("vec") is given,
+// the k closest vectors in the "VecStore" to this given vector will be
+// returned in a std::list<WordVec*>. If only a "word" is given it will be
+// checked whether a corresponding word vector is stored - if so the k closest
+// vectors to this word vector will be returned (otherwise an empty list will
+// be returned).
+  return SearchWordVecs(vec, k, FindRow(word), false, metric);
+}
+
+std::vector<std::list<WordVec*>> VecStore::KClosestWordVecsBatch(const std::vector<std::vector<double>>& queries, const unsigned k, const VecMetric metric) {
+// Finds the k closest vectors to each of the "queries" (with regard to
+// "metric") and returns one std::list<WordVec*> per query (an empty one for
+// queries that haven't got the size of the stored vectors). The results are
+// exactly the same as calling "KClosestWordVecs()" for every query, but the
+// matrix is read from memory only once per "kBatchQueries" queries. If the
+// "VecStore" is quantized (or has got an inverted file for "metric") the
+// queries are searched one after another.
+  std::vector<std::list<WordVec*>> k_closest(queries.size());
+  std::vector<std::vector<double>> batch; // the valid queries
+  std::vector<std::size_t> batch_indices;
+  for (std::size_t i = 0; i < queries.size(); ++i) {
+    if (!queries[i].empty() && (int)queries[i].size() == vec_size_) {
+      batch.push_back(queries[i]);
+      batch_indices.push_back(i);
+    }
+  }
+  if (quantization_ != VecQuantization::kNone || (ivf_num_of_lists_ > 0 && metric == ivf_metric_)) {
+    for (std::size_t i = 0; i < batch.size(); ++i)
+      k_closest[batch_indices[i]] = SearchWordVecs(batch[i], k, -1, false, metric);
+    return k_closest;
+  }
+  const std::vector<std::vector<CloseWordVec>> closest(DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    return ScanRowsBatch<T>(batch, k, metric);
+  }));
+  for (std::size_t i = 0; i < batch.size(); ++i)
+    k_closest[batch_indices[i]] = GetWordVecs(closest[i]);
+  return k_closest;
+}
+
+std::vector<std::list<WordVec*>> VecStore::AnalogyBatch(const std::vector<std::array<std::string, 3>>& questions, const unsigned k, const VecAnalogy method) {
+// Answers analogy questions "a is to b as c is to ?" (given as {a, b, c}):
+// returns the k WordVecs with the highest scores (with regard to "method")
+// for every question, starting with the best one; "a", "b" and "c" themselves
+// are skipped. The scores are calculated from the cosine similarities of every
+// row with the normalized vectors of "a", "b" and "c" in a single scan of the
+// matrix, and like in "KClosestWordVecsBatch()" the matrix is read from memory
+// only once per "kBatchQueries" questions. If a word of a question isn't
+// stored an error message will be printed and its list will be empty.
+  if (MatrixIsDropped("Analogy"))
+    return std::vector<std::list<WordVec*>>(questions.size());
+  std::vector<std::list<WordVec*>> answers(questions.size());
+  std::vector<std::array<int, 3>> batch; // the rows of the words of the valid questions
+  std::vector<std::size_t> batch_indices;
+  for (std::size_t i = 0; i < questions.size(); ++i) {
+    std::array<int, 3> rows;
+    bool found(true);
+    for (int j = 0; j < 3 && found; ++j) {
+      std::string word(questions[i][j]);
+      if (!case_sensitive_)
+        word = SetToLowerCase(word);
+      rows[j] = FindRow(word);
+      if (rows[j] < 0) {
+        std::cout << "ERROR in Analogy(): \"" << word << "\" couldn't be found in your data; returned an empty list." << std::endl;
+        found = false;
       }
-      cur = cur->next;
+    }
+    if (found) {
+      batch.push_back(rows);
+      batch_indices.push_back(i);
     }
   }
-  if (closest_vec->word.empty() || closest_vec->vec.empty())
-    return NULL;
-  else
-    return closest_vec;
-}
-
-std::list<WordVec*> VecStore::KClosestWordVecs(const std::vector<double>& vec, const unsigned k, const std::string& word) {
-// Finds the k closest vectors to a given word vector (with regard to the
-// Euclidean distance). If a vector ("vec") is given, the k closest vectors in
-// the hash table ("VecStore") to this given vector will be returned in a
-// std::list<WordVec*>. If only a "word" is given it will be checked whether a
-// corresponding word vector is stored - if so the k closest vectors to this
-// word vector will be returned (otherwise an empty list will be returned).
-  if (vec.empty())
-    return std::list<WordVec*>(); // if no vector corresponding to the "word" is stored in the hash table an empty list will be returned
-  std::list<CloseWordVec*> closest;
-  std::list<WordVec*> kClosest;
-  double distance;
-  WordVec* cur;
-  for (auto& bucket : hash_table_) {
-    cur = bucket;
-    while (cur) {
-      if (cur->word != word) {
-        distance = VecCalc::EuclideanDistance(vec, cur->vec);
-        if (closest.size() < k)
-          closest.push_back(new CloseWordVec(cur, distance));
-        else if (distance < closest.front()->distance) {
-          closest.front()->word_vec = cur;
-          closest.front()->distance = distance;
-          closest.sort([](CloseWordVec* x, CloseWordVec* y) {return (x->distance > y->distance);}); // makes sure that "closest.front()" contains the WordVec with the largest distance to "vec" (within "closest")
-        }
-        if (closest.size() == k)
-          closest.sort([](CloseWordVec* x, CloseWordVec* y) {return (x->distance > y->distance);});
+  const std::vector<std::vector<CloseWordVec>> best(DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    return ScanAnalogies<T>(batch, k, method);
+  }));
+  for (std::size_t i = 0; i < batch.size(); ++i)
+    answers[batch_indices[i]] = GetWordVecs(best[i]);
+  return answers;
+}
+
+WordVec* VecStore::MostDistantWordVec(const std::vector<double>& vec, const std::string& word, const VecMetric metric) {
+// Finds the most distant vector to a given word vector (with regard to
+// "metric"; by default the Euclidean distance). If a vector ("vec") is given,
+// the most distant vector in the "VecStore" to this given vector will be
+// returned. If only a "word" is given it will be checked whether a
+// corresponding word vector is stored - if so the most distant vector to this
+// word vector will be returned (otherwise "NULL" will be returned).
+  const std::list<WordVec*> most_distant(SearchWordVecs(vec, 1, FindRow(word), true, metric));
+  return (most_distant.empty())? NULL : most_distant.front();
+}
+
+std::list<WordVec*> VecStore::SearchForMostDistantWordVecs(const std::string& word, std::vector<double> vec, const unsigned k, const VecMetric metric) {
+// Finds the k most distant vectors to a given word vector (with regard to
+// "metric"). If a vector ("vec") is given, the k most distant vectors in the
+// "VecStore" to this given vector will be returned in a std::list<WordVec*>.
+// If only a "word" is given it will be checked whether a corresponding word
+// vector is stored - if so the k most distant vectors to this word vector
+// will be returned (otherwise an empty list will be returned).
+  if (vec.empty()) {
+    vec = GetVec(word);
+    if (vec.empty()) return std::list<WordVec*>(); // if no vector corresponding to the "word" is stored an empty list will be returned
+  }
+  return SearchWordVecs(vec, k, FindRow(word), true, metric);
+}
+
+std::list<WordVec*> VecStore::SearchWordVecs(const std::vector<double>& vec, const unsigned k, const int excluded_row, const bool most_distant, const VecMetric metric) {
+// Returns the k closest (or most distant) word vectors to "vec" (with regard
+// to "metric") in a std::list<WordVec*>, starting with the closest (or most
+// distant) one. The row "excluded_row" will be skipped. If "vec" is empty or
+// hasn't got the size of the stored vectors an empty list will be returned.
+  if (vec.empty() || (int)vec.size() != vec_size_)
+    return std::list<WordVec*>(); // if no vector corresponding to the "word" is stored an empty list will be returned
+  return GetWordVecs(SearchRows(vec, k, excluded_row, most_distant, metric));
+}
+
+std::vector<VecStore::CloseWordVec> VecStore::SearchRows(const std::vector<double>& vec, const unsigned k, const int excluded_row, const bool most_distant, const VecMetric metric, const bool exact) {
+// Returns the k closest (or most distant) rows to "vec" sorted by their
+// distance (the closest one first). If there is an inverted file for "metric"
+// only the rows of its nearest lists will be searched for the closest rows;
+// otherwise if the "VecStore" is quantized the rows will be searched on the
+// codes. Both are skipped if "exact" is "true". An exact Euclidean search
+// skips rows by their norms if "SetPrunedSearch()" enabled it.
+  return DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    if (ivf_num_of_lists_ > 0 && metric == ivf_metric_ && !most_distant && !exact)
+      return ScanIvfLists<T>(vec, k, excluded_row);
+    if (quantization_ == VecQuantization::kProduct && !exact)
+      return ScanProductCodes<T>(vec, k, excluded_row, most_distant, metric);
+    if (quantization_ != VecQuantization::kNone && !exact)
+      return ScanQuantizedRows<T>(vec, k, excluded_row, most_distant, metric);
+    if (pruned_search_ && metric == VecMetric::kEuclidean)
+      return ScanRowsPruned<T>(vec, k, excluded_row, most_distant);
+    return ScanRows<T>(vec, k, excluded_row, most_distant, metric);
+  });
+}
+
+std::vector<double> VecStore::PrepareQuery(const std::vector<double>& vec, const VecMetric metric) const {
+// Returns "vec" divided by its Euclidean norm if "metric" is
+// "VecMetric::kCosine" (so the norm of the query needn't be taken into
+// account for any row); otherwise "vec" is returned as it is.
+  std::vector<double> query(vec);
+  if (metric == VecMetric::kCosine) {
+    const double norm(VecCalc::EuclideanNorm(vec));
+    if (norm > 0) {
+      for (auto& x : query)
+        x /= norm;
+    }
+  }
+  return query;
+}
+
+void VecStore::SetPrunedSearch(const bool pruned_search) {
+// Lets the exact searches with regard to the Euclidean distance (for the
+// closest as well as for the most distant rows) skip rows: the rows get sorted
+// by their norms once, so a search can stop as soon as the norms of the
+// remaining rows alone show that none of them can be among the k best ones,
+// and the distance to a row is abandoned as soon as its partial sum exceeds
+// the k-th smallest distance found so far. The results are exactly the same
+// as the ones of a full scan.
+  if (pruned_search && MatrixIsDropped("SetPrunedSearch"))
+    return;
+  pruned_search_ = pruned_search;
+  if (pruned_search_) {
+    SortRowsByNorm();
+  } else {
+    rows_by_norm_.clear();
+    sorted_norms_.clear();
+    sorted_matrix_ = AlignedArray<unsigned char>();
+  }
+}
+
+void VecStore::SortRowsByNorm() {
+// Sorts the rows by their Euclidean norms (rows with the same norm by their
+// index) and copies them into "sorted_matrix_" in this order for
+// "ScanRowsPruned()".
+  rows_by_norm_.resize(vec_num_);
+  std::iota(rows_by_norm_.begin(), rows_by_norm_.end(), 0);
+  std::sort(rows_by_norm_.begin(), rows_by_norm_.end(), [&](const uint32_t row0, const uint32_t row1) {
+    return (norms_[row0] < norms_[row1] || (norms_[row0] == norms_[row1] && row0 < row1));
+  });
+  sorted_norms_.resize(vec_num_);
+  sorted_matrix_ = AlignedArray<unsigned char>((std::size_t)vec_num_*row_bytes_);
+  for (int i = 0; i < vec_num_; ++i) {
+    sorted_norms_[i] = norms_[rows_by_norm_[i]];
+    std::copy(matrix_+rows_by_norm_[i]*row_bytes_, matrix_+(rows_by_norm_[i]+1)*row_bytes_, sorted_matrix_.Data()+(std::size_t)i*row_bytes_);
+  }
+}
+
+void VecStore::SetNumThreads(const unsigned num_of_threads) {
+// Sets the number of threads the scans of the "VecStore" are split over (0:
+// one per core, 1: no other threads are used). The threads are started the
+// first time a scan is big enough to be split (at least 1 MiB per thread).
+  std::lock_guard<std::mutex> lock(thread_pool_mutex_);
+  num_of_threads_ = num_of_threads;
+  thread_pool_.reset();
+}
+
+void VecStore::SetThreadPool(const std::shared_ptr<ThreadPool>& thread_pool) {
+// Lets the "VecStore" use the threads of "thread_pool" (which can be shared
+// with other "VecStore"s) instead of starting its own ones.
+  std::lock_guard<std::mutex> lock(thread_pool_mutex_);
+  thread_pool_ = thread_pool;
+  num_of_threads_ = (thread_pool_)? thread_pool_->NumOfThreads() : 0;
+}
+
+unsigned VecStore::NumOfTasks(const std::size_t bytes_per_row, const int num_of_rows) {
+// Returns the number of ranges a scan reading "bytes_per_row" bytes per row
+// of "num_of_rows" rows gets split into (one per thread, but every range has
+// to cover at least "kMinBytesPerTask" bytes) and starts the thread pool if
+// needed.
+  std::lock_guard<std::mutex> lock(thread_pool_mutex_);
+  const unsigned num_of_threads((thread_pool_)? thread_pool_->NumOfThreads() : (num_of_threads_ > 0)? num_of_threads_ : std::max(1u, std::thread::hardware_concurrency()));
+  const unsigned num_of_tasks(std::max<std::size_t>(1, std::min<std::size_t>(num_of_threads, (std::size_t)num_of_rows*bytes_per_row/kMinBytesPerTask)));
+  if (num_of_tasks > 1 && !thread_pool_)
+    thread_pool_ = std::make_shared<ThreadPool>(num_of_threads);
+  return num_of_tasks;
+}
+
+void VecStore::ForEachRange(const unsigned num_of_tasks, const int num_of_rows, const std::function<void(const unsigned, const int, const int)>& scan_range) {
+// Splits the rows 0 to "num_of_rows"-1 (of the matrix or of anything else)
+// into "num_of_tasks" ranges of (nearly) the same size and calls
+// "scan_range(task, first_row, last_row)" for every range on the threads of
+// the thread pool.
+  if (num_of_tasks <= 1) {
+    scan_range(0, 0, num_of_rows);
+    return;
+  }
+  std::shared_ptr<ThreadPool> thread_pool;
+  {
+    std::lock_guard<std::mutex> lock(thread_pool_mutex_);
+    thread_pool = thread_pool_; // keeps the pool alive even if "SetNumThreads()" is called during the scan
+  }
+  const std::function<void(const unsigned)> task([&](const unsigned i) {
+    scan_range(i, (int)((int64_t)num_of_rows*i/num_of_tasks), (int)((int64_t)num_of_rows*(i+1)/num_of_tasks));
+  });
+  if (thread_pool) {
+    thread_pool->ParallelFor(num_of_tasks, task);
+  } else {
+    for (unsigned i = 0; i < num_of_tasks; ++i)
+      task(i);
+  }
+}
+
+template <typename ScanRange>
+std::vector<VecStore::CloseWordVec> VecStore::ScanInParallel(const unsigned k, const std::size_t bytes_per_row, const ScanRange& scan_range) {
+// Calls "scan_range(first_row, last_row, closest)" for ranges of rows on the
+// threads of the thread pool; every range gets its own "TopK" and the k best
+// rows of all ranges get merged at the end. Since "CloseWordVec"s with the
+// same distance are ordered by their rows the result is the same for any
+// number of threads.
+  const unsigned num_of_tasks(NumOfTasks(bytes_per_row));
+  std::vector<std::vector<CloseWordVec>> range_closest(num_of_tasks);
+  ForEachRowRange(num_of_tasks, [&](const unsigned task, const int first_row, const int last_row) {
+    TopK<CloseWordVec> closest(k, last_row-first_row);
+    scan_range(first_row, last_row, closest);
+    range_closest[task] = closest.Take();
+  });
+  if (num_of_tasks == 1)
+    return std::move(range_closest[0]);
+  TopK<CloseWordVec> closest(k, vec_num_);
+  for (auto& range : range_closest) {
+    for (auto& close_word_vec : range)
+      closest.Push(close_word_vec);
+  }
+  return closest.Take();
+}
+
+template <typename T>
+std::vector<VecStore::CloseWordVec> VecStore::ScanRows(const std::vector<double>& vec, const unsigned k, const int excluded_row, const bool most_distant, const VecMetric metric) {
+// Scans all rows of the matrix and returns the k closest ones to "vec" sorted
+// by their distance (the closest one first). If "most_distant" is "true" the
+// negated distances will be used, so the k most distant rows will be
+// returned.
+  const std::vector<double> prepared_query(PrepareQuery(vec, metric));
+  const std::vector<typename ComputeType<T>::type> query(prepared_query.begin(), prepared_query.end()); // converts "vec" once instead of once per row
+  const double sign((most_distant)? -1 : 1);
+  return ScanInParallel(k, row_bytes_, [&](const int first_row, const int last_row, TopK<CloseWordVec>& closest) {
+    for (int row = first_row; row < last_row; ++row) {
+      if (row != excluded_row)
+        closest.Push(CloseWordVec{sign*RowDistance<T>(query.data(), row, metric), row});
+    }
+  });
+}
+
+template <typename T>
+bool VecStore::DistanceExceeds(const typename ComputeType<T>::type* query, const T* row_vec, const double threshold) const {
+// Adds up the squared Euclidean distance between "query" and "row_vec" block
+// by block and returns "true" as soon as the partial sum exceeds "threshold"
+// (the remaining elements can only increase it).
+  double distance(0);
+  for (int first = 0; first < vec_size_; first += kAbandonBlockSize) {
+    distance += VecCalc::SquaredEuclideanDistance(query+first, row_vec+first, std::min<int>(kAbandonBlockSize, vec_size_-first));
+    if (distance > threshold)
+      return true;
+  }
+  return false;
+}
+
+template <typename T>
+std::vector<VecStore::CloseWordVec> VecStore::ScanRowsPruned(const std::vector<double>& vec, const unsigned k, const int excluded_row, const bool most_distant) {
+// Like "ScanRows()" for the Euclidean distance, but the rows are visited in
+// the order of their norms (see "SetPrunedSearch()"). By the triangle
+// inequality the distance between the query q and a row x is at least
+// |"||q||-||x||"| and at most "||q||+||x||": the search for the closest rows
+// starts at the norm of the query and moves outwards until the lower bound
+// exceeds the k-th smallest distance; the search for the most distant rows
+// starts at the largest norm and stops when the upper bound falls below the
+// k-th largest distance. Every row that can get into the result is compared
+// by the same kernel as in "ScanRows()", so the distances are the same.
+  if (k == 0)
+    return std::vector<CloseWordVec>(); // the bounds need the k-th distance
+  typedef typename ComputeType<T>::type ComputeT;
+  const std::vector<ComputeT> query(vec.begin(), vec.end());
+  const double query_norm(std::sqrt(VecCalc::DotProduct(query.data(), query.data(), vec_size_)));
+  // The norms and the distances are rounded, so all bounds are widened by the
+  // largest relative rounding error of a sum of "vec_size_" products.
+  const double slack(2.*vec_size_*std::numeric_limits<ComputeT>::epsilon());
+  const auto sorted_row([&](const int i) {return reinterpret_cast<const T*>(sorted_matrix_.Data()+(std::size_t)i*row_bytes_);});
+  return ScanInParallel(k, row_bytes_, [&](const int first, const int last, TopK<CloseWordVec>& closest) {
+    if (most_distant) {
+      for (int i = last-1; i >= first; --i) {
+        const double upper_bound((query_norm+sorted_norms_[i])*(1+slack));
+        if (closest.IsFull() && upper_bound*upper_bound*(1+slack) < -closest.Largest().distance)
+          break; // all remaining rows have got smaller norms
+        const int row(rows_by_norm_[i]);
+        if (row != excluded_row)
+          closest.Push(CloseWordVec{-VecCalc::SquaredEuclideanDistance(query.data(), sorted_row(i), vec_size_), row});
       }
-      cur = cur->next;
+      return;
     }
+    // The lower bound grows in both directions from the norm of the query, so
+    // the side with the smaller bound is visited next.
+    const auto lower_bound([&](const int i) {
+      if (i < first || i >= last)
+        return std::numeric_limits<double>::infinity();
+      return std::max(0., std::abs(query_norm-sorted_norms_[i])-slack*(query_norm+sorted_norms_[i]));
+    });
+    int above(std::lower_bound(sorted_norms_.begin()+first, sorted_norms_.begin()+last, query_norm)-sorted_norms_.begin()), below(above-1);
+    double above_bound(lower_bound(above)), below_bound(lower_bound(below));
+    while (below >= first || above < last) {
+      int i;
+      double bound;
+      if (above_bound < below_bound) {
+        i = above;
+        bound = above_bound;
+        above_bound = lower_bound(++above);
+      } else {
+        i = below;
+        bound = below_bound;
+        below_bound = lower_bound(--below);
+      }
+      const int row(rows_by_norm_[i]);
+      if (row == excluded_row)
+        continue;
+      if (closest.IsFull()) {
+        const double threshold(closest.Largest().distance*(1+slack));
+        if (bound*bound > threshold)
+          break; // the remaining rows have got even larger lower bounds
+        if (DistanceExceeds<T>(query.data(), sorted_row(i), threshold))
+          continue;
+      }
+      closest.Push(CloseWordVec{VecCalc::SquaredEuclideanDistance(query.data(), sorted_row(i), vec_size_), row});
+    }
+  });
+}
+
+template <typename T>
+std::vector<std::vector<VecStore::CloseWordVec>> VecStore::ScanRowsBatch(const std::vector<std::vector<double>>& queries, const unsigned k, const VecMetric metric) {
+// Like "ScanRows()" for several queries at once: a block of rows small enough
+// to stay in the cache gets compared with a block of "kBatchQueries" queries
+// before the next block of rows is loaded. Every query is compared with the
+// rows by the same kernels as in "ScanRows()", so the results are exactly
+// the same. The rows get split into ranges like in "ScanInParallel()".
+  typedef typename ComputeType<T>::type ComputeT;
+  std::vector<std::vector<ComputeT>> prepared_queries(queries.size());
+  for (std::size_t i = 0; i < queries.size(); ++i) {
+    const std::vector<double> prepared_query(PrepareQuery(queries[i], metric));
+    prepared_queries[i].assign(prepared_query.begin(), prepared_query.end());
   }
-  if (closest.size() < k)
-    closest.sort([](CloseWordVec* x, CloseWordVec* y) {return (x->distance > y->distance);});
-  // Reverses the sorted "closest" into "kClosest" so that the first
-  // vector will be the most distant one and deletes "closest".
-  for (auto it : closest)
-    kClosest.push_front(it->word_vec);
-  DeleteList(closest);
-  return kClosest;
-}
-
-WordVec* VecStore::MostDistantWordVec(const std::vector<double>& vec, const std::string& word) {
-// Finds the most distant vector to a given word vector (with regard to the
-// Euclidean distance). If a vector ("vec") is given, the most distant vector
-// in the hash table ("VecStore") to this given vector will be returned. If
-// only a "word" is given it will be checked whether a corresponding word
-// vector is stored - if so the most distant vector to this word vector will be
-// returned (otherwise "NULL" will be returned).
-  if (vec.empty())
-    return NULL; // if no vector corresponding to the "word" is stored in the hash table NULL will be returned
-  WordVec* cur, *most_distant_vec; // current bucket and most distant word vector
-  double max_distance(0), cur_distance;
-  for (auto& bucket : hash_table_) {
-    cur = bucket;
-    while (cur) {
-      if (cur->word != word && max_distance < (cur_distance = VecCalc::EuclideanDistance(vec, cur->vec))) {
-        max_distance = cur_distance;
-        most_distant_vec = cur;
+  const unsigned num_of_tasks(NumOfTasks(row_bytes_*queries.size()));
+  std::vector<std::vector<std::vector<CloseWordVec>>> range_closest(num_of_tasks, std::vector<std::vector<CloseWordVec>>(queries.size())); // k closest rows of every range for every query
+  const int block_rows(std::max<std::size_t>(1, kBatchBlockBytes/row_bytes_));
+  ForEachRowRange(num_of_tasks, [&](const unsigned task, const int range_first_row, const int range_last_row) {
+    std::vector<TopK<CloseWordVec>> closest;
+    closest.reserve(queries.size());
+    for (std::size_t i = 0; i < queries.size(); ++i)
+      closest.emplace_back(k, range_last_row-range_first_row);
+    for (std::size_t first_query = 0; first_query < queries.size(); first_query += kBatchQueries) {
+      const std::size_t last_query(std::min(queries.size(), first_query+kBatchQueries));
+      for (int first_row = range_first_row; first_row < range_last_row; first_row += block_rows) {
+        const int last_row(std::min(range_last_row, first_row+block_rows));
+        for (std::size_t i = first_query; i < last_query; ++i) {
+          for (int row = first_row; row < last_row; ++row)
+            closest[i].Push(CloseWordVec{RowDistance<T>(prepared_queries[i].data(), row, metric), row});
+        }
       }
-      cur = cur->next;
     }
+    for (std::size_t i = 0; i < queries.size(); ++i)
+      range_closest[task][i] = closest[i].Take();
+  });
+  std::vector<std::vector<CloseWordVec>> k_closest(queries.size());
+  for (std::size_t i = 0; i < queries.size(); ++i) {
+    TopK<CloseWordVec> closest(k, vec_num_);
+    for (auto& ranges : range_closest) {
+      for (auto& close_word_vec : ranges[i])
+        closest.Push(close_word_vec);
+    }
+    k_closest[i] = closest.Take();
   }
-  if (most_distant_vec->word.empty() || most_distant_vec->vec.empty())
-    return NULL;
-  else
-    return most_distant_vec;
-}
-
-std::list<WordVec*> VecStore::SearchForMostDistantWordVecs(const std::string& word, std::vector<double> vec, const unsigned k) {
-// Finds the k most distant vectors to a given word vector (with regard to the
-// Euclidean distance). If a vector ("vec") is given, the k most distant
-// vectors in the hash table ("VecStore") to this given vector will be returned
-// in a std::list<WordVec*>. If only a "word" is given it will be checked
-// whether a corresponding word vector is stored - if so the k most distant
-// vectors to this word vector will be returned (otherwise an empty list will
-// be returned).
-  if (vec.empty()) {
-    vec = GetVec(word);
-    if (vec.empty()) return std::list<WordVec*>(); // if no vector corresponding to the "word" is stored in the hash table an empty list will be returned
+  return k_closest;
+}
+
+template <typename T>
+std::vector<std::vector<VecStore::CloseWordVec>> VecStore::ScanAnalogies(const std::vector<std::array<int, 3>>& questions, const unsigned k, const VecAnalogy method) {
+// Scans the matrix for the answers of the analogy "questions" (the rows of a,
+// b and c each) blockwise like "ScanRowsBatch()" and returns the k best rows
+// for every question. For "VecAnalogy::k3CosAdd" the normalized vectors are
+// combined into the single query b-a+c (its dot product with a normalized row
+// is the sum of the three cosine similarities); for "VecAnalogy::k3CosMul" the
+// three normalized vectors are kept and compared with every row one after
+// another while the row is in the cache.
+  typedef typename ComputeType<T>::type ComputeT;
+  std::vector<std::vector<ComputeT>> queries(questions.size());
+  for (std::size_t i = 0; i < questions.size(); ++i) {
+    const std::vector<double> a(PrepareQuery(GetRowVec(questions[i][0]), VecMetric::kCosine)), b(PrepareQuery(GetRowVec(questions[i][1]), VecMetric::kCosine)), c(PrepareQuery(GetRowVec(questions[i][2]), VecMetric::kCosine));
+    if (method == VecAnalogy::k3CosAdd) {
+      for (int d = 0; d < vec_size_; ++d)
+        queries[i].push_back(static_cast<ComputeT>(b[d]-a[d]+c[d]));
+    } else {
+      for (const std::vector<double>* vec : {&a, &b, &c})
+        queries[i].insert(queries[i].end(), vec->begin(), vec->end());
+    }
   }
-  std::list<CloseWordVec*> most_distant;
-  std::list<WordVec*> kMostDistant;
-  double distance;
-  WordVec* cur;
-  for (auto& bucket : hash_table_) {
-    cur = bucket;
-    while (cur) {
-      if (cur->word != word) {
-        distance = VecCalc::EuclideanDistance(vec, cur->vec);
-        if (most_distant.size() < k)
-          most_distant.push_back(new CloseWordVec(cur, distance));
-        else if (distance > most_distant.front()->distance) {
-          most_distant.front()->word_vec = cur;
-          most_distant.front()->distance = distance;
-          most_distant.sort([](CloseWordVec* x, CloseWordVec* y) {return (x->distance < y->distance);}); // makes sure that "most_distant.front()" contains the WordVec with the smallest distance to "vec" (within "most_distant")
+  const auto distance([&](const ComputeT* query, const int row) {
+  // Returns the negated score of "row" (so the best row has got the smallest
+  // distance); "RowDistance()" returns negated cosine similarities.
+    if (method == VecAnalogy::k3CosAdd)
+      return RowDistance<T>(query, row, VecMetric::kCosine);
+    const double similarity_a((1-RowDistance<T>(query, row, VecMetric::kCosine))/2), similarity_b((1-RowDistance<T>(query+vec_size_, row, VecMetric::kCosine))/2), similarity_c((1-RowDistance<T>(query+2*vec_size_, row, VecMetric::kCosine))/2);
+    return -similarity_b*similarity_c/(similarity_a+kAnalogyEpsilon);
+  });
+  const unsigned num_of_tasks(NumOfTasks(row_bytes_*questions.size()));
+  std::vector<std::vector<std::vector<CloseWordVec>>> range_best(num_of_tasks, std::vector<std::vector<CloseWordVec>>(questions.size())); // k best rows of every range for every question
+  const int block_rows(std::max<std::size_t>(1, kBatchBlockBytes/row_bytes_));
+  ForEachRowRange(num_of_tasks, [&](const unsigned task, const int range_first_row, const int range_last_row) {
+    std::vector<TopK<CloseWordVec>> best;
+    best.reserve(questions.size());
+    for (std::size_t i = 0; i < questions.size(); ++i)
+      best.emplace_back(k, range_last_row-range_first_row);
+    for (std::size_t first_question = 0; first_question < questions.size(); first_question += kBatchQueries) {
+      const std::size_t last_question(std::min(questions.size(), first_question+kBatchQueries));
+      for (int first_row = range_first_row; first_row < range_last_row; first_row += block_rows) {
+        const int last_row(std::min(range_last_row, first_row+block_rows));
+        for (std::size_t i = first_question; i < last_question; ++i) {
+          for (int row = first_row; row < last_row; ++row) {
+            if (row != questions[i][0] && row != questions[i][1] && row != questions[i][2])
+              best[i].Push(CloseWordVec{distance(queries[i].data(), row), row});
+          }
         }
-        if (most_distant.size() == k)
-          most_distant.sort([](CloseWordVec* x, CloseWordVec* y) {return (x->distance < y->distance);});
       }
-      cur = cur->next;
     }
+    for (std::size_t i = 0; i < questions.size(); ++i)
+      range_best[task][i] = best[i].Take();
+  });
+  std::vector<std::vector<CloseWordVec>> k_best(questions.size());
+  for (std::size_t i = 0; i < questions.size(); ++i) {
+    TopK<CloseWordVec> best(k, vec_num_);
+    for (auto& ranges : range_best) {
+      for (auto& close_word_vec : ranges[i])
+        best.Push(close_word_vec);
+    }
+    k_best[i] = best.Take();
   }
-  if (most_distant.size() < k)
-    most_distant.sort([](CloseWordVec* x, CloseWordVec* y) {return (x->distance < y->distance);});
-  // Reverses the sorted "most_distant" into "kMostDistant" so that the first
-  // vector will be the most distant one and deletes "most_distant".
-  for (auto it : most_distant)
-    kMostDistant.push_front(it->word_vec);
-  DeleteList(most_distant);
-  return kMostDistant;
+  return k_best;
+}
+
+template <typename T>
+std::vector<VecStore::CloseWordVec> VecStore::ScanQuantizedRows(const std::vector<double>& vec, const unsigned k, const int excluded_row, const bool most_distant, const VecMetric metric) {
+// Like "ScanRows()", but scans the int8 codes: "vec" gets quantized once, so
+// the dot product with every row can be calculated with integer arithmetic
+// (the squared distance is derived from it and the norm of the row). The
+// "rescoring_factor_*k" best rows found this way get rescored on the matrix.
+  const double sign((most_distant)? -1 : 1);
+  const bool per_dimension(quantization_ == VecQuantization::kPerDimension);
+  // The dot product of "vec" and an approximated row "r" is
+  //   per dimension: sum(vec[d]*code_offsets_[d])+sum(vec[d]*code_scales_[d]*c[d])
+  //   per vector:    code_offsets_[r]*sum(vec[d])+code_scales_[r]*sum(vec[d]*c[d])
+  // and the weights "vec[d]*code_scales_[d]" or "vec[d]" get quantized to
+  // "query_scale*query_code[d]".
+  const std::vector<double> query(PrepareQuery(vec, metric));
+  std::vector<double> weights(query);
+  double offset_sum(0), weight_max(0);
+  for (int i = 0; i < vec_size_; ++i) {
+    if (per_dimension) {
+      offset_sum += query[i]*code_offsets_[i];
+      weights[i] *= code_scales_[i];
+    } else {
+      offset_sum += query[i];
+    }
+    weight_max = std::max(weight_max, std::fabs(weights[i]));
+  }
+  const double query_scale((weight_max > 0)? weight_max/127 : 1);
+  AlignedArray<int8_t> query_code(code_bytes_);
+  std::fill(query_code.Data(), query_code.Data()+code_bytes_, 0);
+  for (int i = 0; i < vec_size_; ++i)
+    query_code[i] = (int8_t)std::lround(weights[i]/query_scale);
+  std::vector<CloseWordVec> best_candidates(ScanInParallel(NumOfCandidates(k), code_bytes_, [&](const int first_row, const int last_row, TopK<CloseWordVec>& candidates) {
+    double dot_product, distance;
+    for (int row = first_row; row < last_row; ++row) {
+      if (row != excluded_row) {
+        dot_product = query_scale*VecCalc::DotProduct(query_code.Data(), Code(row), vec_size_);
+        dot_product = (per_dimension)? offset_sum+dot_product : code_offsets_[row]*offset_sum+code_scales_[row]*dot_product;
+        if (metric == VecMetric::kEuclidean)
+          distance = code_norms_[row]-2*dot_product; // the squared norm of "vec" is the same for every row
+        else if (metric == VecMetric::kCosine)
+          distance = CosineDistance(dot_product, row);
+        else
+          distance = -dot_product;
+        candidates.Push(CloseWordVec{sign*distance, row});
+      }
+    }
+  }));
+  return RescoreRows<T>(vec, best_candidates, k, most_distant, metric);
+}
+
+template <typename T>
+std::vector<VecStore::CloseWordVec> VecStore::ScanProductCodes(const std::vector<double>& vec, const unsigned k, const int excluded_row, const bool most_distant, const VecMetric metric) {
+// Like "ScanRows()", but scans the product quantization codes: the squared
+// distances (or the negated dot products if "metric" isn't
+// "VecMetric::kEuclidean") between every subspace of "vec" and all centroids
+// of this subspace get calculated once, so the distance to a row is the sum of
+// one looked up value per subspace. The "rescoring_factor_*k" best rows found
+// this way get rescored on the matrix.
+  const double sign((most_distant)? -1 : 1);
+  const int num_of_subspaces(pq_subspace_offsets_.size()-1);
+  const std::vector<double> prepared_query(PrepareQuery(vec, metric));
+  std::vector<float> query(prepared_query.begin(), prepared_query.end()), table((std::size_t)num_of_subspaces*pq_num_of_centroids_);
+  for (int m = 0; m < num_of_subspaces; ++m) {
+    const int offset(pq_subspace_offsets_[m]), size(pq_subspace_offsets_[m+1]-offset);
+    for (unsigned c = 0; c < pq_num_of_centroids_; ++c) {
+      const float* centroid(pq_centroids_.data()+pq_num_of_centroids_*offset+c*size);
+      table[m*pq_num_of_centroids_+c] = (metric == VecMetric::kEuclidean)? VecCalc::SquaredEuclideanDistance(query.data()+offset, centroid, size) : -VecCalc::DotProduct(query.data()+offset, centroid, size);
+    }
+  }
+  std::vector<CloseWordVec> best_candidates(ScanInParallel(NumOfCandidates(k), num_of_subspaces, [&](const int first_row, const int last_row, TopK<CloseWordVec>& candidates) {
+    for (int row = first_row; row < last_row; ++row) {
+      if (row != excluded_row) {
+        const uint8_t* code(pq_codes_.data()+(std::size_t)row*num_of_subspaces);
+        float distance(0);
+        for (int m = 0; m < num_of_subspaces; ++m)
+          distance += table[m*pq_num_of_centroids_+code[m]];
+        if (metric == VecMetric::kCosine)
+          distance = CosineDistance(-distance, row);
+        candidates.Push(CloseWordVec{sign*distance, row});
+      }
+    }
+  }));
+  return RescoreRows<T>(vec, best_candidates, k, most_distant, metric);
+}
+
+template <typename T>
+std::vector<VecStore::CloseWordVec> VecStore::RescoreRows(const std::vector<double>& vec, std::vector<CloseWordVec>& candidates, const unsigned k, const bool most_distant, const VecMetric metric) {
+// Returns the k closest (or most distant) rows of the "candidates" found on the
+// codes using the exact distances (if "rescoring_factor_" isn't 0; otherwise
+// the "candidates" will be returned as they are).
+  if (rescoring_factor_ == 0)
+    return std::move(candidates);
+  const std::vector<double> prepared_query(PrepareQuery(vec, metric));
+  const std::vector<typename ComputeType<T>::type> query(prepared_query.begin(), prepared_query.end());
+  const double sign((most_distant)? -1 : 1);
+  TopK<CloseWordVec> closest(k, candidates.size());
+  for (auto& candidate : candidates)
+    closest.Push(CloseWordVec{sign*RowDistance<T>(query.data(), candidate.row, metric), candidate.row});
+  return closest.Take();
 }
 
 std::string VecStore::SetToLowerCase(std::string& string) {
@@ -364,11 +961,3 @@ std::string VecStore::SetToLowerCase(std::string& string) {
     character = std::tolower(character);
   return string;
 }
-
-void VecStore::DeleteList(std::list<CloseWordVec*>& list) {
-// Destructs "std::list"s containing pointers.
-  while (!list.empty()) {
-    delete list.front();
-    list.pop_front();
-  }
-}
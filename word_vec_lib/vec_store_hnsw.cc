@@ -0,0 +1,501 @@
+// vec_store_hnsw.cc
+
+// Copyright 2019 E. Decker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The HNSW ("hierarchical navigable small world") graph follows Malkov and
+// Yashunin: every row is a node on layer 0 and, with an exponentially
+// decreasing probability, on some layers above. A search walks greedily from
+// the entry point (the node on the highest layer) down to layer 1 and then
+// explores layer 0 keeping the "ef" closest nodes found so far.
+//
+// A file written by "VecStore::SaveHnswIndex()" is laid out like this (all
+// numbers in the byte order of the machine that wrote it):
+//   header         "HnswHeader"
+//   levels         "vec_num" bytes: the highest layer of every row
+//   layer 0        "vec_num" lists of 2*"m"+1 uint32 (the number of links
+//                  followed by the links)
+//   upper layers   "m"+1 uint32 per row and layer above 0 (in the order of the
+//                  rows, then of the layers)
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <random>
+
+#include "word_vec_lib.h"
+
+namespace {
+
+const char kHnswMagic[8] = {'W', 'V', 'L', 'H', 'N', 'S', 'W', '\0'};
+const uint32_t kHnswVersion = 1;
+const uint32_t kByteOrderMark = 0x01020304;
+const unsigned kDefaultHnswEf = 64; // "ef" used by a search if none is given (at least k)
+const int kMaxHnswLevel = 16;
+
+struct HnswHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order_mark;
+  uint32_t metric; // "VecMetric" the graph was built for
+  uint32_t m, ef_construction;
+  int32_t entry_point, max_level;
+  int64_t vec_size, vec_num, num_of_upper_links;
+  uint64_t words_hash; // makes sure the file belongs to the "VecStore"
+};
+
+} // namespace
+
+bool VecStore::BuildHnswIndex(const VecMetric metric, const unsigned m, const unsigned ef_construction) {
+// Builds an HNSW graph over all rows for "metric" (the Euclidean distance or
+// the cosine similarity): every node gets linked to (up to) "m" close nodes on
+// its upper layers and 2*"m" on layer 0; "ef_construction" is the number of
+// candidates considered for the links of a node (the larger "m" and
+// "ef_construction" are, the slower the graph gets built but the better its
+// recall). The rows get inserted on the threads of the "VecStore" (see
+// "SetNumThreads()"). Returns "false" (and prints an error message) if the
+// "VecStore" is empty or the arguments aren't valid.
+  if (!HashTableIsValid()) {
+    std::cout << "ERROR in BuildHnswIndex(): the \"VecStore\" is empty." << std::endl;
+    return false;
+  }
+  if (MatrixIsDropped("BuildHnswIndex"))
+    return false;
+  if (metric == VecMetric::kInnerProduct || m < 2 || m > 0xffff) {
+    std::cout << "ERROR in BuildHnswIndex(): the graph can only be built for \"VecMetric::kEuclidean\" and \"VecMetric::kCosine\" with 2 <= m <= 65535." << std::endl;
+    return false;
+  }
+  ClearHnswIndex();
+  hnsw_metric_ = metric;
+  hnsw_m_ = m;
+  hnsw_ef_construction_ = std::max(ef_construction, m);
+  std::mt19937_64 generator(vec_num_);
+  std::uniform_real_distribution<double> distribution(std::numeric_limits<double>::min(), 1);
+  const double level_factor(1/std::log((double)m));
+  hnsw_levels_.resize(vec_num_);
+  hnsw_upper_links_.resize(vec_num_);
+  for (int row = 0; row < vec_num_; ++row) {
+    hnsw_levels_[row] = (uint8_t)std::min(kMaxHnswLevel, (int)(-std::log(distribution(generator))*level_factor));
+    hnsw_upper_links_[row].assign((std::size_t)hnsw_levels_[row]*(hnsw_m_+1), 0);
+  }
+  hnsw_links_.assign((std::size_t)vec_num_*(2*hnsw_m_+1), 0);
+  std::cout << "\tBuilding the HNSW graph (m = " << hnsw_m_ << ", ef_construction = " << hnsw_ef_construction_ << ")..." << std::endl;
+  std::vector<std::mutex> node_locks(vec_num_); // guard the links of every node while the graph is built
+  std::mutex entry_point_lock;
+  DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    VisitedRows visited_rows(vec_num_);
+    HnswBuffers<T> buffers(vec_size_);
+    InsertHnswNode<T>(0, node_locks, entry_point_lock, visited_rows, buffers); // the first node becomes the entry point
+    ForEachRowRange(NumOfTasks(kMinBytesPerTask), [&](const unsigned, const int first_row, const int last_row) {
+      VisitedRows range_visited_rows(vec_num_);
+      HnswBuffers<T> range_buffers(vec_size_);
+      for (int row = std::max(first_row, 1); row < last_row; ++row)
+        InsertHnswNode<T>(row, node_locks, entry_point_lock, range_visited_rows, range_buffers);
+    });
+  });
+  return true;
+}
+
+void VecStore::ClearHnswIndex() {
+// Deletes the HNSW graph.
+  hnsw_links_.clear();
+  hnsw_upper_links_.clear();
+  hnsw_levels_.clear();
+  hnsw_m_ = 0;
+  hnsw_ef_construction_ = 0;
+  hnsw_entry_point_ = -1;
+  hnsw_max_level_ = -1;
+  hnsw_metric_ = VecMetric::kEuclidean;
+}
+
+template <typename T>
+std::vector<typename ComputeType<T>::type> VecStore::HnswQuery(const std::vector<double>& vec) const {
+// Returns "vec" prepared for "hnsw_metric_" in the type the rows are compared
+// with.
+  const std::vector<double> prepared_query(PrepareQuery(vec, hnsw_metric_));
+  return std::vector<typename ComputeType<T>::type>(prepared_query.begin(), prepared_query.end());
+}
+
+template <typename T>
+const typename ComputeType<T>::type* VecStore::HnswRowQuery(const int row, typename ComputeType<T>::type* query) const {
+// Stores "row" prepared for "hnsw_metric_" (like "HnswQuery()" does) in
+// "query" ("vec_size_" elements) and returns it, so the graph can be built
+// without allocating a vector for every row compared.
+  const T* vec(Row<T>(row));
+  for (int i = 0; i < vec_size_; ++i)
+    query[i] = static_cast<typename ComputeType<T>::type>(vec[i]);
+  if (hnsw_metric_ == VecMetric::kCosine) {
+    const double norm(std::sqrt(VecCalc::DotProduct(query, query, vec_size_)));
+    if (norm > 0) {
+      for (int i = 0; i < vec_size_; ++i)
+        query[i] = static_cast<typename ComputeType<T>::type>(query[i]/norm);
+    }
+  }
+  return query;
+}
+
+void VecStore::CopyHnswLinks(const int row, const int level, std::vector<std::mutex>* node_locks, std::vector<uint32_t>& links) {
+// Copies the links of "row" on "level" into "links" (holding the lock of the
+// node while the graph is built, i.e. if "node_locks" isn't "NULL").
+  std::unique_lock<std::mutex> lock;
+  if (node_locks)
+    lock = std::unique_lock<std::mutex>((*node_locks)[row]);
+  const uint32_t* row_links(HnswLinks(row, level));
+  links.assign(row_links+1, row_links+1+row_links[0]);
+}
+
+template <typename T>
+void VecStore::InsertHnswNode(const int row, std::vector<std::mutex>& node_locks, std::mutex& entry_point_lock, VisitedRows& visited_rows, HnswBuffers<T>& buffers) {
+// Links "row" to the graph: the closest nodes on every layer of the node are
+// searched (starting from the entry point) and the best ones selected by
+// "SelectHnswNeighbors()" get linked to it in both directions. A node reaching
+// a layer above the current top layer keeps the entry point locked until it
+// is linked and becomes the new entry point.
+  const int level(hnsw_levels_[row]);
+  std::unique_lock<std::mutex> entry_point_guard(entry_point_lock);
+  const int entry_point(hnsw_entry_point_), max_level(hnsw_max_level_);
+  if (entry_point < 0) {
+    hnsw_entry_point_ = row;
+    hnsw_max_level_ = level;
+    return;
+  }
+  if (level <= max_level)
+    entry_point_guard.unlock();
+  const typename ComputeType<T>::type* query(HnswRowQuery<T>(row, buffers.query.data()));
+  CloseWordVec closest{RowDistance<T>(query, entry_point, hnsw_metric_), entry_point};
+  for (int l = max_level; l > level; --l)
+    closest = SearchHnswLayerGreedily<T>(query, closest, l, &node_locks);
+  std::vector<CloseWordVec> entry_points(1, closest);
+  for (int l = std::min(level, max_level); l >= 0; --l) {
+    const std::vector<CloseWordVec> candidates(SearchHnswLayer<T>(query, entry_points, hnsw_ef_construction_, l, visited_rows, &node_locks));
+    const std::vector<uint32_t> neighbors(SelectHnswNeighbors<T>(candidates, hnsw_m_, buffers.selected_queries));
+    {
+      std::lock_guard<std::mutex> lock(node_locks[row]);
+      uint32_t* links(HnswLinks(row, l));
+      links[0] = neighbors.size();
+      std::copy(neighbors.begin(), neighbors.end(), links+1);
+    }
+    const unsigned max_links((l == 0)? 2*hnsw_m_ : hnsw_m_);
+    for (const uint32_t neighbor : neighbors) {
+      std::lock_guard<std::mutex> lock(node_locks[neighbor]);
+      uint32_t* links(HnswLinks(neighbor, l));
+      if (links[0] < max_links) {
+        links[++links[0]] = row;
+        continue;
+      }
+      // The list of the neighbor is full: its old links and "row" compete
+      // for its "max_links" places.
+      const typename ComputeType<T>::type* neighbor_query(HnswRowQuery<T>(neighbor, buffers.neighbor_query.data()));
+      std::vector<CloseWordVec> neighbor_candidates(1, CloseWordVec{RowDistance<T>(neighbor_query, row, hnsw_metric_), row});
+      for (uint32_t i = 1; i <= links[0]; ++i)
+        neighbor_candidates.push_back(CloseWordVec{RowDistance<T>(neighbor_query, links[i], hnsw_metric_), (int)links[i]});
+      std::sort(neighbor_candidates.begin(), neighbor_candidates.end());
+      const std::vector<uint32_t> neighbor_links(SelectHnswNeighbors<T>(neighbor_candidates, max_links, buffers.selected_queries));
+      links[0] = neighbor_links.size();
+      std::copy(neighbor_links.begin(), neighbor_links.end(), links+1);
+    }
+    entry_points = candidates;
+  }
+  if (level > max_level) {
+    hnsw_entry_point_ = row;
+    hnsw_max_level_ = level;
+  }
+}
+
+template <typename T>
+VecStore::CloseWordVec VecStore::SearchHnswLayerGreedily(const typename ComputeType<T>::type* query, CloseWordVec closest, const int level, std::vector<std::mutex>* node_locks) {
+// Moves from "closest" to the closest of its links on "level" as long as this
+// gets closer to "query" and returns the node it stops at.
+  std::vector<uint32_t> links;
+  bool moved(true);
+  while (moved) {
+    moved = false;
+    CopyHnswLinks(closest.row, level, node_locks, links);
+    for (const uint32_t link : links) {
+      const CloseWordVec candidate{RowDistance<T>(query, link, hnsw_metric_), (int)link};
+      if (candidate < closest) {
+        closest = candidate;
+        moved = true;
+      }
+    }
+  }
+  return closest;
+}
+
+template <typename T>
+std::vector<VecStore::CloseWordVec> VecStore::SearchHnswLayer(const typename ComputeType<T>::type* query, const std::vector<CloseWordVec>& entry_points, const unsigned ef, const int level, VisitedRows& visited_rows, std::vector<std::mutex>* node_locks) {
+// Searches the "ef" closest nodes to "query" on "level" starting from
+// "entry_points" and returns them sorted by their distance (the closest one
+// first). The closest node that hasn't been expanded yet is expanded next
+// until it is farther away than all of the "ef" closest nodes found.
+  const auto farther([](const CloseWordVec& a, const CloseWordVec& b) {return (b < a);});
+  std::priority_queue<CloseWordVec, std::vector<CloseWordVec>, decltype(farther)> candidates(farther); // the closest candidate is on top
+  TopK<CloseWordVec> closest(ef, vec_num_);
+  visited_rows.Clear();
+  for (const auto& entry_point : entry_points) {
+    if (visited_rows.Visit(entry_point.row)) {
+      candidates.push(entry_point);
+      closest.Push(entry_point);
+    }
+  }
+  std::vector<uint32_t> links;
+  while (!candidates.empty()) {
+    const CloseWordVec candidate(candidates.top());
+    if (closest.IsFull() && closest.Largest() < candidate)
+      break;
+    candidates.pop();
+    CopyHnswLinks(candidate.row, level, node_locks, links);
+    for (const uint32_t link : links) {
+      if (!visited_rows.Visit(link))
+        continue;
+      const CloseWordVec next{RowDistance<T>(query, link, hnsw_metric_), (int)link};
+      if (!closest.IsFull() || next < closest.Largest()) {
+        candidates.push(next);
+        closest.Push(next);
+      }
+    }
+  }
+  return closest.Take();
+}
+
+template <typename T>
+std::vector<uint32_t> VecStore::SelectHnswNeighbors(const std::vector<CloseWordVec>& candidates, const unsigned m, std::vector<typename ComputeType<T>::type>& selected_queries) const {
+// Selects up to "m" of the "candidates" (sorted by their distance to the new
+// node) as links: a candidate is only selected if it is closer to the new
+// node than to all candidates selected before, so the links point into
+// different directions (the heuristic of Malkov and Yashunin). The selected
+// candidates get prepared as queries in "selected_queries" (which keeps its
+// memory for the next call).
+  std::vector<uint32_t> neighbors;
+  if (selected_queries.size() < (std::size_t)m*vec_size_)
+    selected_queries.resize((std::size_t)m*vec_size_);
+  for (const auto& candidate : candidates) {
+    if (neighbors.size() >= m)
+      break;
+    bool is_diverse(true);
+    for (std::size_t i = 0; is_diverse && i < neighbors.size(); ++i)
+      is_diverse = (RowDistance<T>(selected_queries.data()+i*vec_size_, candidate.row, hnsw_metric_) >= candidate.distance);
+    if (is_diverse) {
+      HnswRowQuery<T>(candidate.row, selected_queries.data()+neighbors.size()*vec_size_);
+      neighbors.push_back(candidate.row);
+    }
+  }
+  return neighbors;
+}
+
+std::unique_ptr<VecStore::VisitedRows> VecStore::AcquireVisitedRows() {
+// Returns the marks of a previous search (or new ones), so concurrent
+// searches don't allocate "vec_num_" marks each time.
+  std::lock_guard<std::mutex> lock(hnsw_visited_rows_mutex_);
+  if (hnsw_visited_rows_.empty())
+    return std::unique_ptr<VisitedRows>(new VisitedRows(vec_num_));
+  std::unique_ptr<VisitedRows> visited_rows(std::move(hnsw_visited_rows_.back()));
+  hnsw_visited_rows_.pop_back();
+  return visited_rows;
+}
+
+void VecStore::ReleaseVisitedRows(std::unique_ptr<VisitedRows> visited_rows) {
+  std::lock_guard<std::mutex> lock(hnsw_visited_rows_mutex_);
+  hnsw_visited_rows_.push_back(std::move(visited_rows));
+}
+
+template <typename T>
+std::vector<VecStore::CloseWordVec> VecStore::SearchHnswGraph(const std::vector<double>& vec, const unsigned k, const unsigned ef, const int excluded_row) {
+// Returns the (approximated) k closest rows to "vec" sorted by their distance
+// (the closest one first) skipping "excluded_row".
+  const std::vector<typename ComputeType<T>::type> query(HnswQuery<T>(vec));
+  CloseWordVec closest{RowDistance<T>(query.data(), hnsw_entry_point_, hnsw_metric_), hnsw_entry_point_};
+  for (int l = hnsw_max_level_; l > 0; --l)
+    closest = SearchHnswLayerGreedily<T>(query.data(), closest, l, NULL);
+  std::unique_ptr<VisitedRows> visited_rows(AcquireVisitedRows());
+  std::vector<CloseWordVec> found(SearchHnswLayer<T>(query.data(), std::vector<CloseWordVec>(1, closest), std::max(ef, k+1), 0, *visited_rows, NULL));
+  ReleaseVisitedRows(std::move(visited_rows));
+  found.erase(std::remove_if(found.begin(), found.end(), [&](const CloseWordVec& x) {return (x.row == excluded_row);}), found.end());
+  if (found.size() > k)
+    found.resize(k);
+  return found;
+}
+
+std::list<WordVec*> VecStore::HnswKClosestWordVecs(const std::vector<double>& vec, const unsigned k, const unsigned ef, const std::string& word) {
+// Returns the (approximated) k closest word vectors to "vec" (with regard to
+// the metric the HNSW graph was built for) in a std::list<WordVec*>, starting
+// with the closest one. "ef" is the number of candidates kept by the search
+// (by default 64; the larger "ef" is, the slower but more exact the search
+// gets). The row of "word" (if given) will be skipped. If there is no graph
+// an error message will be printed and an empty list will be returned.
+  if (hnsw_entry_point_ < 0) {
+    std::cout << "ERROR in HnswKClosestWordVecs(): there is no HNSW graph (see \"BuildHnswIndex()\")." << std::endl;
+    return std::list<WordVec*>();
+  }
+  if (vec.empty() || (int)vec.size() != vec_size_ || k == 0)
+    return std::list<WordVec*>();
+  const int excluded_row(FindRow(word));
+  return GetWordVecs(DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    return SearchHnswGraph<T>(vec, k, (ef > 0)? ef : kDefaultHnswEf, excluded_row);
+  }));
+}
+
+double VecStore::HnswRecall(const unsigned k, const unsigned ef, const unsigned num_of_queries) {
+// Measures how many of the k closest word vectors found by the HNSW graph
+// (searched with "ef" candidates) are also found by an exact search. The
+// vectors of "num_of_queries" stored words (evenly spread over the
+// "VecStore") are used as queries. Returns the recall as value between 0 and 1
+// or NaN (and prints an error message) if there is no graph.
+  if (hnsw_entry_point_ < 0 || k == 0 || num_of_queries == 0) {
+    std::cout << "ERROR in HnswRecall(): there is no HNSW graph (or \"k\" or \"num_of_queries\" is 0)." << std::endl;
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  const unsigned queries(std::min(num_of_queries, (unsigned)vec_num_));
+  unsigned found(0), total(0);
+  for (unsigned i = 0; i < queries; ++i) {
+    const int row((int)((uint64_t)i*vec_num_/queries));
+    const std::vector<double> vec(GetRowVec(row));
+    const std::vector<CloseWordVec> exact(SearchRows(vec, k, row, false, hnsw_metric_, true));
+    const std::vector<CloseWordVec> approximated(DispatchPrecision(precision_, [&](auto zero) {
+      typedef decltype(zero) T;
+      return SearchHnswGraph<T>(vec, k, (ef > 0)? ef : kDefaultHnswEf, row);
+    }));
+    for (auto& x : exact) {
+      for (auto& y : approximated) {
+        if (x.row == y.row) {
+          found++;
+          break;
+        }
+      }
+    }
+    total += exact.size();
+  }
+  return (total > 0)? (double)found/total : 1;
+}
+
+bool VecStore::SaveHnswIndex(const std::string& file) {
+// Writes the HNSW graph to "file", so it doesn't have to be built again.
+// Returns "false" (and prints an error message) if there is no graph or the
+// file couldn't be written.
+  if (hnsw_entry_point_ < 0) {
+    std::cout << "ERROR in SaveHnswIndex(): there is no HNSW graph." << std::endl;
+    return false;
+  }
+  HnswHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kHnswMagic, sizeof(kHnswMagic));
+  header.version = kHnswVersion;
+  header.byte_order_mark = kByteOrderMark;
+  header.metric = (uint32_t)hnsw_metric_;
+  header.m = hnsw_m_;
+  header.ef_construction = hnsw_ef_construction_;
+  header.entry_point = hnsw_entry_point_;
+  header.max_level = hnsw_max_level_;
+  header.vec_size = vec_size_;
+  header.vec_num = vec_num_;
+  for (const auto& links : hnsw_upper_links_)
+    header.num_of_upper_links += links.size();
+  header.words_hash = HashWords(vec_num_);
+  std::ofstream file_stream(file, std::ios::binary | std::ios::trunc);
+  if (!file_stream.is_open()) {
+    std::cout << "ERROR in SaveHnswIndex(): OPENING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  file_stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file_stream.write(reinterpret_cast<const char*>(hnsw_levels_.data()), hnsw_levels_.size());
+  file_stream.write(reinterpret_cast<const char*>(hnsw_links_.data()), hnsw_links_.size()*sizeof(uint32_t));
+  for (const auto& links : hnsw_upper_links_)
+    file_stream.write(reinterpret_cast<const char*>(links.data()), links.size()*sizeof(uint32_t));
+  if (!file_stream.good()) {
+    std::cout << "ERROR in SaveHnswIndex(): WRITING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool VecStore::LoadHnswIndex(const std::string& file) {
+// Reads an HNSW graph written by "SaveHnswIndex()" for a "VecStore" holding
+// the same words and uses it from now on. Returns "false" (and prints an error
+// message) if "file" couldn't be read or doesn't belong to this "VecStore".
+  if (MatrixIsDropped("LoadHnswIndex"))
+    return false;
+  std::ifstream file_stream(file, std::ios::binary);
+  if (!file_stream.is_open()) {
+    std::cout << "ERROR in LoadHnswIndex(): OPENING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  HnswHeader header;
+  if (!file_stream.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, kHnswMagic, sizeof(kHnswMagic)) != 0
+      || header.version != kHnswVersion || header.byte_order_mark != kByteOrderMark) {
+    std::cout << "ERROR in LoadHnswIndex(): \"" << file << "\" is not an HNSW file of this version of \"word_vec_lib\" (or was written on a machine with another byte order)." << std::endl;
+    return false;
+  }
+  if (!HashTableIsValid() || header.vec_size != vec_size_ || header.vec_num != vec_num_ || header.words_hash != HashWords(vec_num_)
+      || header.metric >= (uint32_t)VecMetric::kInnerProduct) {
+    std::cout << "ERROR in LoadHnswIndex(): \"" << file << "\" doesn't belong to this \"VecStore\"." << std::endl;
+    return false;
+  }
+  std::vector<uint8_t> levels(vec_num_);
+  file_stream.read(reinterpret_cast<char*>(levels.data()), levels.size());
+  bool is_valid(file_stream.good() && header.m >= 2 && header.m <= 0xffff && header.entry_point >= 0 && header.entry_point < vec_num_
+                && header.max_level == levels[header.entry_point]);
+  int64_t num_of_upper_links(0);
+  for (int row = 0; is_valid && row < vec_num_; ++row) {
+    is_valid = (levels[row] <= header.max_level);
+    num_of_upper_links += (int64_t)levels[row]*(header.m+1);
+  }
+  if (!is_valid || num_of_upper_links != header.num_of_upper_links) {
+    std::cout << "ERROR in LoadHnswIndex(): \"" << file << "\" is not a valid HNSW file." << std::endl;
+    return false;
+  }
+  std::vector<uint32_t> links((std::size_t)vec_num_*(2*header.m+1));
+  std::vector<std::vector<uint32_t>> upper_links(vec_num_);
+  file_stream.read(reinterpret_cast<char*>(links.data()), links.size()*sizeof(uint32_t));
+  for (int row = 0; row < vec_num_; ++row) {
+    upper_links[row].resize((std::size_t)levels[row]*(header.m+1));
+    file_stream.read(reinterpret_cast<char*>(upper_links[row].data()), upper_links[row].size()*sizeof(uint32_t));
+  }
+  const auto links_are_valid([&](const uint32_t* list, const uint32_t max_links, const int level) {
+  // Every link has to point to a node reaching "level".
+    if (list[0] > max_links)
+      return false;
+    for (uint32_t i = 1; i <= list[0]; ++i) {
+      if (list[i] >= (uint32_t)vec_num_ || levels[list[i]] < level)
+        return false;
+    }
+    return true;
+  });
+  is_valid = file_stream.good();
+  for (int row = 0; is_valid && row < vec_num_; ++row) {
+    is_valid = links_are_valid(links.data()+(std::size_t)row*(2*header.m+1), 2*header.m, 0);
+    for (int l = 0; is_valid && l < levels[row]; ++l)
+      is_valid = links_are_valid(upper_links[row].data()+(std::size_t)l*(header.m+1), header.m, l+1);
+  }
+  if (!is_valid) {
+    std::cout << "ERROR in LoadHnswIndex(): \"" << file << "\" is not a valid HNSW file." << std::endl;
+    return false;
+  }
+  ClearHnswIndex();
+  hnsw_links_ = std::move(links);
+  hnsw_upper_links_ = std::move(upper_links);
+  hnsw_levels_ = std::move(levels);
+  hnsw_m_ = header.m;
+  hnsw_ef_construction_ = header.ef_construction;
+  hnsw_entry_point_ = header.entry_point;
+  hnsw_max_level_ = header.max_level;
+  hnsw_metric_ = (VecMetric)header.metric;
+  return true;
+}
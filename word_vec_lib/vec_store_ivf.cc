@@ -0,0 +1,308 @@
+// vec_store_ivf.cc
+
+// Copyright 2019 E. Decker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// An inverted file clusters the rows around centroids learned by k-means (one
+// list of rows per centroid); a search only scans the lists of the centroids
+// nearest to the query.
+//
+// A file written by "VecStore::SaveIvfIndex()" is laid out like this (all
+// numbers in the byte order of the machine that wrote it):
+//   header         "IvfHeader"
+//   centroids      "num_of_lists"*"vec_size" floats
+//   list offsets   "num_of_lists"+1 uint64 offsets into the rows
+//   rows           "vec_num" uint32 rows (the rows of every list in ascending
+//                  order)
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+#include "word_vec_lib.h"
+
+namespace {
+
+const char kIvfMagic[8] = {'W', 'V', 'L', 'I', 'V', 'F', '\0', '\0'};
+const uint32_t kIvfVersion = 1;
+const uint32_t kByteOrderMark = 0x01020304;
+const unsigned kDefaultIvfProbes = 8; // number of lists searched if "SetIvfProbes()" wasn't called
+const unsigned kTrainingRowsPerList = 64; // k-means gets trained on at most "kTrainingRowsPerList" rows per list
+
+struct IvfHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order_mark;
+  uint32_t metric; // "VecMetric" the inverted file was built for
+  uint32_t num_of_lists, num_of_probes;
+  int64_t vec_size, vec_num; // "vec_num" rows have been assigned to the lists
+  uint64_t words_hash; // makes sure the file belongs to the "VecStore"
+};
+
+} // namespace
+
+bool VecStore::BuildIvfIndex(const VecMetric metric, const unsigned num_of_lists, const unsigned num_of_iterations) {
+// Clusters the rows into "num_of_lists" lists (by default the square root of
+// the number of rows) using k-means (with "num_of_iterations" iterations on up
+// to 64 rows per list) for "metric" (the Euclidean distance or the cosine
+// similarity; for the latter the normalized vectors get clustered). From now
+// on the closest word vectors with regard to "metric" will be searched in the
+// nearest lists only (see "SetIvfProbes()"). Returns "false" (and prints an
+// error message) if the "VecStore" is empty or "metric" is
+// "VecMetric::kInnerProduct".
+  if (!HashTableIsValid()) {
+    std::cout << "ERROR in BuildIvfIndex(): the \"VecStore\" is empty." << std::endl;
+    return false;
+  }
+  if (MatrixIsDropped("BuildIvfIndex"))
+    return false;
+  if (metric == VecMetric::kInnerProduct) {
+    std::cout << "ERROR in BuildIvfIndex(): the inverted file can only be built for \"VecMetric::kEuclidean\" and \"VecMetric::kCosine\"." << std::endl;
+    return false;
+  }
+  ClearIvfIndex();
+  ivf_metric_ = metric;
+  const unsigned lists(std::min((num_of_lists == 0)? (unsigned)std::ceil(std::sqrt((double)vec_num_)) : num_of_lists, (unsigned)vec_num_));
+  const int num_of_training_rows((int)std::min<int64_t>(vec_num_, (int64_t)kTrainingRowsPerList*lists));
+  std::cout << "\tBuilding the inverted file (" << lists << " lists, " << num_of_training_rows << " training rows)..." << std::endl;
+  std::vector<float> points((std::size_t)num_of_training_rows*vec_size_);
+  for (int i = 0; i < num_of_training_rows; ++i) {
+    const std::vector<float> point(IvfPoint((int)((int64_t)i*vec_num_/num_of_training_rows))); // rows evenly spread over the "VecStore"
+    std::copy(point.begin(), point.end(), points.begin()+(std::size_t)i*vec_size_);
+  }
+  ivf_centroids_ = KMeans(points, vec_size_, lists, num_of_iterations);
+  ivf_num_of_lists_ = lists;
+  std::vector<uint32_t> row_lists(vec_num_);
+  AssignToIvfLists(0, row_lists);
+  StoreIvfLists(row_lists);
+  std::cout << "\t---Completed." << std::endl;
+  return true;
+}
+
+void VecStore::SetIvfProbes(const unsigned num_of_probes) {
+// Sets the number of lists of the inverted file searched for the closest
+// word vectors (0: the default of 8). The more lists are searched, the slower
+// but more exact the search gets.
+  ivf_num_of_probes_ = num_of_probes;
+}
+
+void VecStore::ClearIvfIndex() {
+// Deletes the inverted file.
+  ivf_centroids_.clear();
+  ivf_rows_.clear();
+  ivf_list_offsets_.clear();
+  ivf_matrix_ = AlignedArray<unsigned char>();
+  ivf_num_of_lists_ = 0;
+  ivf_metric_ = VecMetric::kEuclidean;
+}
+
+std::vector<float> VecStore::IvfPoint(const int row) const {
+// Returns the vector of "row" as it gets clustered (normalized for
+// "VecMetric::kCosine").
+  const std::vector<double> vec(PrepareQuery(GetRowVec(row), ivf_metric_));
+  return std::vector<float>(vec.begin(), vec.end());
+}
+
+void VecStore::AssignToIvfLists(const int first_row, std::vector<uint32_t>& lists) {
+// Sets "lists[row]" to the list of the nearest centroid for every row from
+// "first_row" on (on the threads of the "VecStore"; the centroids are kept as
+// they are).
+  ForEachRange(NumOfTasks((std::size_t)ivf_num_of_lists_*vec_size_*sizeof(float), vec_num_-first_row), vec_num_-first_row, [&](const unsigned, const int first, const int last) {
+    for (int row = first_row+first; row < first_row+last; ++row)
+      lists[row] = NearestCentroid(IvfPoint(row).data(), ivf_centroids_.data(), vec_size_, ivf_num_of_lists_);
+  });
+}
+
+void VecStore::StoreIvfLists(const std::vector<uint32_t>& lists) {
+// Sorts the rows into their lists ("lists[row]" being the list of "row").
+  ivf_list_offsets_.assign(ivf_num_of_lists_+1, 0);
+  for (const uint32_t list : lists)
+    ivf_list_offsets_[list+1]++;
+  for (unsigned l = 0; l < ivf_num_of_lists_; ++l)
+    ivf_list_offsets_[l+1] += ivf_list_offsets_[l];
+  std::vector<uint64_t> next(ivf_list_offsets_.begin(), ivf_list_offsets_.end()-1);
+  ivf_rows_.resize(lists.size());
+  for (std::size_t row = 0; row < lists.size(); ++row)
+    ivf_rows_[next[lists[row]]++] = row;
+  ivf_matrix_ = AlignedArray<unsigned char>((std::size_t)vec_num_*row_bytes_);
+  DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    for (int i = 0; i < vec_num_; ++i) {
+      const int row(ivf_rows_[i]);
+      const T* source(Row<T>(row));
+      T* destination(reinterpret_cast<T*>(ivf_matrix_.Data()+(std::size_t)i*row_bytes_));
+      std::fill(reinterpret_cast<unsigned char*>(destination), ivf_matrix_.Data()+(std::size_t)(i+1)*row_bytes_, 0);
+      for (int j = 0; j < vec_size_; ++j)
+        destination[j] = (ivf_metric_ == VecMetric::kCosine && norms_[row] > 0)? static_cast<T>(static_cast<typename ComputeType<T>::type>(source[j])/norms_[row]) : source[j];
+    }
+  });
+}
+
+std::vector<VecStore::CloseWordVec> VecStore::NearestIvfLists(const std::vector<double>& vec, const unsigned num_of_lists) const {
+// Returns the "num_of_lists" lists whose centroids are nearest to "vec" (the
+// "row" of a "CloseWordVec" being the list).
+  const std::vector<double> prepared_query(PrepareQuery(vec, ivf_metric_));
+  const std::vector<float> query(prepared_query.begin(), prepared_query.end());
+  TopK<CloseWordVec> nearest(num_of_lists, ivf_num_of_lists_);
+  for (unsigned l = 0; l < ivf_num_of_lists_; ++l)
+    nearest.Push(CloseWordVec{VecCalc::SquaredEuclideanDistance(query.data(), ivf_centroids_.data()+(std::size_t)l*vec_size_, vec_size_), (int)l});
+  return nearest.Take();
+}
+
+template <typename T>
+std::vector<VecStore::CloseWordVec> VecStore::ScanIvfLists(const std::vector<double>& vec, const unsigned k, const int excluded_row) {
+// Returns the k closest rows to "vec" found in the nearest lists of the
+// inverted file sorted by their distance (the closest one first).
+  const std::vector<double> prepared_query(PrepareQuery(vec, ivf_metric_));
+  const std::vector<typename ComputeType<T>::type> query(prepared_query.begin(), prepared_query.end());
+  TopK<CloseWordVec> closest(k, vec_num_);
+  for (const auto& list : NearestIvfLists(vec, (ivf_num_of_probes_ > 0)? ivf_num_of_probes_ : kDefaultIvfProbes)) {
+    for (uint64_t i = ivf_list_offsets_[list.row]; i < ivf_list_offsets_[list.row+1]; ++i) {
+      const int row(ivf_rows_[i]);
+      const T* ivf_row(reinterpret_cast<const T*>(ivf_matrix_.Data()+i*row_bytes_));
+      if (row != excluded_row)
+        closest.Push(CloseWordVec{(ivf_metric_ == VecMetric::kCosine)? -VecCalc::DotProduct(query.data(), ivf_row, vec_size_) : VecCalc::SquaredEuclideanDistance(query.data(), ivf_row, vec_size_), row});
+    }
+  }
+  return closest.Take();
+}
+
+double VecStore::IvfRecall(const unsigned k, const unsigned num_of_queries) {
+// Measures how many of the k closest word vectors found in the nearest lists
+// of the inverted file are also found by an exact search. The vectors of
+// "num_of_queries" stored words (evenly spread over the "VecStore") are used
+// as queries. Returns the recall as value between 0 and 1 or NaN (and prints
+// an error message) if there is no inverted file.
+  if (ivf_num_of_lists_ == 0 || k == 0 || num_of_queries == 0) {
+    std::cout << "ERROR in IvfRecall(): there is no inverted file (or \"k\" or \"num_of_queries\" is 0)." << std::endl;
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  const unsigned queries(std::min(num_of_queries, (unsigned)vec_num_));
+  unsigned found(0), total(0);
+  for (unsigned i = 0; i < queries; ++i) {
+    const int row((int)((uint64_t)i*vec_num_/queries));
+    const std::vector<double> vec(GetRowVec(row));
+    const std::vector<CloseWordVec> exact(SearchRows(vec, k, row, false, ivf_metric_, true));
+    const std::vector<CloseWordVec> approximated(DispatchPrecision(precision_, [&](auto zero) {
+      typedef decltype(zero) T;
+      return ScanIvfLists<T>(vec, k, row);
+    }));
+    for (auto& x : exact) {
+      for (auto& y : approximated) {
+        if (x.row == y.row) {
+          found++;
+          break;
+        }
+      }
+    }
+    total += exact.size();
+  }
+  return (total > 0)? (double)found/total : 1;
+}
+
+bool VecStore::SaveIvfIndex(const std::string& file) {
+// Writes the inverted file (the centroids and the lists) to "file", so it
+// doesn't have to be built again. Returns "false" (and prints an error
+// message) if there is no inverted file or the file couldn't be written.
+  if (ivf_num_of_lists_ == 0) {
+    std::cout << "ERROR in SaveIvfIndex(): there is no inverted file." << std::endl;
+    return false;
+  }
+  IvfHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kIvfMagic, sizeof(kIvfMagic));
+  header.version = kIvfVersion;
+  header.byte_order_mark = kByteOrderMark;
+  header.metric = (uint32_t)ivf_metric_;
+  header.num_of_lists = ivf_num_of_lists_;
+  header.num_of_probes = ivf_num_of_probes_;
+  header.vec_size = vec_size_;
+  header.vec_num = vec_num_;
+  header.words_hash = HashWords(vec_num_);
+  std::ofstream file_stream(file, std::ios::binary | std::ios::trunc);
+  if (!file_stream.is_open()) {
+    std::cout << "ERROR in SaveIvfIndex(): OPENING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  file_stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file_stream.write(reinterpret_cast<const char*>(ivf_centroids_.data()), ivf_centroids_.size()*sizeof(float));
+  file_stream.write(reinterpret_cast<const char*>(ivf_list_offsets_.data()), ivf_list_offsets_.size()*sizeof(uint64_t));
+  file_stream.write(reinterpret_cast<const char*>(ivf_rows_.data()), ivf_rows_.size()*sizeof(uint32_t));
+  if (!file_stream.good()) {
+    std::cout << "ERROR in SaveIvfIndex(): WRITING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool VecStore::LoadIvfIndex(const std::string& file) {
+// Reads an inverted file written by "SaveIvfIndex()" and uses it from now on.
+// The "VecStore" has to start with the same words in the same order as the
+// one that wrote the file; rows added after these (e.g. because the word
+// vector file has grown since) get assigned to the lists of their nearest
+// centroids without training the centroids again. Returns "false" (and prints
+// an error message) if "file" couldn't be read or doesn't belong to this
+// "VecStore".
+  if (MatrixIsDropped("LoadIvfIndex"))
+    return false;
+  std::ifstream file_stream(file, std::ios::binary);
+  if (!file_stream.is_open()) {
+    std::cout << "ERROR in LoadIvfIndex(): OPENING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  IvfHeader header;
+  if (!file_stream.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, kIvfMagic, sizeof(kIvfMagic)) != 0
+      || header.version != kIvfVersion || header.byte_order_mark != kByteOrderMark) {
+    std::cout << "ERROR in LoadIvfIndex(): \"" << file << "\" is not an inverted file of this version of \"word_vec_lib\" (or was written on a machine with another byte order)." << std::endl;
+    return false;
+  }
+  if (!HashTableIsValid() || header.vec_size != vec_size_ || header.vec_num < 1 || header.vec_num > vec_num_ || header.words_hash != HashWords(header.vec_num)
+      || header.metric >= (uint32_t)VecMetric::kInnerProduct || header.num_of_lists < 1 || header.num_of_lists > (uint64_t)header.vec_num) {
+    std::cout << "ERROR in LoadIvfIndex(): \"" << file << "\" doesn't belong to this \"VecStore\"." << std::endl;
+    return false;
+  }
+  std::vector<float> centroids((std::size_t)header.num_of_lists*vec_size_);
+  std::vector<uint64_t> list_offsets(header.num_of_lists+1);
+  std::vector<uint32_t> rows(header.vec_num);
+  file_stream.read(reinterpret_cast<char*>(centroids.data()), centroids.size()*sizeof(float));
+  file_stream.read(reinterpret_cast<char*>(list_offsets.data()), list_offsets.size()*sizeof(uint64_t));
+  file_stream.read(reinterpret_cast<char*>(rows.data()), rows.size()*sizeof(uint32_t));
+  bool is_valid(file_stream.good() && list_offsets.front() == 0 && list_offsets.back() == (uint64_t)header.vec_num);
+  for (uint32_t l = 0; is_valid && l < header.num_of_lists; ++l)
+    is_valid = (list_offsets[l] <= list_offsets[l+1]);
+  std::vector<uint32_t> row_lists(vec_num_, header.num_of_lists); // list of every row ("num_of_lists" if it hasn't got one yet)
+  for (uint32_t l = 0; is_valid && l < header.num_of_lists; ++l) {
+    for (uint64_t i = list_offsets[l]; is_valid && i < list_offsets[l+1]; ++i) {
+      is_valid = (rows[i] < (uint64_t)header.vec_num && row_lists[rows[i]] == header.num_of_lists);
+      if (is_valid)
+        row_lists[rows[i]] = l;
+    }
+  }
+  if (!is_valid) {
+    std::cout << "ERROR in LoadIvfIndex(): \"" << file << "\" is not a valid inverted file." << std::endl;
+    return false;
+  }
+  ClearIvfIndex();
+  ivf_centroids_ = std::move(centroids);
+  ivf_num_of_lists_ = header.num_of_lists;
+  ivf_num_of_probes_ = header.num_of_probes;
+  ivf_metric_ = (VecMetric)header.metric;
+  if (header.vec_num < vec_num_)
+    AssignToIvfLists(header.vec_num, row_lists);
+  StoreIvfLists(row_lists);
+  return true;
+}
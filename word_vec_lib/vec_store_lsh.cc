@@ -0,0 +1,227 @@
+// vec_store_lsh.cc
+
+// Copyright 2019 E. Decker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The LSH index uses signed random projections (Charikar): the probability
+// that two vectors fall on the same side of a random hyperplane is
+// 1-angle/pi, so vectors with a high cosine similarity get signatures within
+// a small Hamming distance. A search collects all rows whose signature is
+// within "max_hamming_distance" of the signature of the query in at least one
+// table (either by probing the buckets of all these signatures or, if these
+// are too many, by scanning the packed signatures of all rows) and calculates
+// the cosine similarities of these candidates only.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+
+#include "word_vec_lib.h"
+
+namespace {
+
+const unsigned kMaxLshBits = 64; // a signature has to fit into one uint64
+const unsigned kPopcountsPerLookup = 16; // a bucket lookup costs about as much as comparing 16 signatures (per step of the binary search)
+
+uint64_t NumOfLshProbes(const unsigned num_of_bits, const unsigned max_hamming_distance) {
+// Returns the number of signatures within "max_hamming_distance" of a
+// signature of "num_of_bits" bits (at most 2^32).
+  uint64_t num_of_probes(0), combinations(1);
+  for (unsigned i = 0; i <= std::min(max_hamming_distance, num_of_bits) && num_of_probes < (1ull << 32); ++i) {
+    num_of_probes += combinations;
+    combinations = combinations*(num_of_bits-i)/(i+1);
+  }
+  return std::min<uint64_t>(num_of_probes, 1ull << 32);
+}
+
+} // namespace
+
+bool VecStore::BuildLshIndex(const unsigned num_of_tables, const unsigned num_of_bits) {
+// Draws "num_of_tables"*"num_of_bits" random hyperplanes and computes the
+// signatures of all rows (on the threads of the "VecStore"); every table gets
+// its own "num_of_bits" hyperplanes. The more bits a signature has, the fewer
+// rows share a bucket (so the searches get faster but may miss more close
+// rows); more tables give a close row more chances to share a bucket with the
+// query. Returns "false" (and prints an error message) if the "VecStore" is
+// empty or the arguments aren't valid.
+  if (!HashTableIsValid()) {
+    std::cout << "ERROR in BuildLshIndex(): the \"VecStore\" is empty." << std::endl;
+    return false;
+  }
+  if (MatrixIsDropped("BuildLshIndex"))
+    return false;
+  if (num_of_tables == 0 || num_of_bits == 0 || num_of_bits > kMaxLshBits) {
+    std::cout << "ERROR in BuildLshIndex(): there has to be at least one table and a signature has to have got 1 to " << kMaxLshBits << " bits." << std::endl;
+    return false;
+  }
+  ClearLshIndex();
+  std::cout << "\tBuilding the LSH index (" << num_of_tables << " tables, " << num_of_bits << " bits)..." << std::endl;
+  lsh_num_of_tables_ = num_of_tables;
+  lsh_num_of_bits_ = num_of_bits;
+  std::mt19937_64 generator(vec_num_);
+  std::normal_distribution<float> distribution;
+  lsh_hyperplanes_.resize((std::size_t)num_of_tables*num_of_bits*vec_size_);
+  for (auto& x : lsh_hyperplanes_)
+    x = distribution(generator);
+  lsh_signatures_.resize((std::size_t)vec_num_*num_of_tables);
+  ForEachRowRange(NumOfTasks((std::size_t)num_of_tables*num_of_bits*vec_size_*sizeof(float)), [&](const unsigned, const int first_row, const int last_row) {
+    for (int row = first_row; row < last_row; ++row)
+      ComputeLshSignature(GetRowVec(row), lsh_signatures_.data()+(std::size_t)row*num_of_tables);
+  });
+  lsh_table_rows_.resize((std::size_t)vec_num_*num_of_tables);
+  ForEachRange(NumOfTasks(kMinBytesPerTask, num_of_tables), num_of_tables, [&](const unsigned, const int first_table, const int last_table) {
+    for (int t = first_table; t < last_table; ++t) {
+      uint32_t* table(lsh_table_rows_.data()+(std::size_t)t*vec_num_);
+      for (int row = 0; row < vec_num_; ++row)
+        table[row] = row;
+      std::sort(table, table+vec_num_, [&](const uint32_t row0, const uint32_t row1) {
+        const uint64_t signature0(lsh_signatures_[(std::size_t)row0*num_of_tables+t]), signature1(lsh_signatures_[(std::size_t)row1*num_of_tables+t]);
+        return (signature0 < signature1 || (signature0 == signature1 && row0 < row1));
+      });
+    }
+  });
+  std::cout << "\t---Completed." << std::endl;
+  return true;
+}
+
+void VecStore::ClearLshIndex() {
+// Deletes the LSH index.
+  lsh_hyperplanes_.clear();
+  lsh_signatures_.clear();
+  lsh_table_rows_.clear();
+  lsh_num_of_tables_ = 0;
+  lsh_num_of_bits_ = 0;
+}
+
+void VecStore::ComputeLshSignature(const std::vector<double>& vec, uint64_t* signature) const {
+// Writes the "lsh_num_of_tables_" signatures of "vec" into "signature" (the
+// dot products with the hyperplanes are calculated by the SIMD kernels).
+  const std::vector<float> point(vec.begin(), vec.end());
+  const float* hyperplane(lsh_hyperplanes_.data());
+  for (unsigned t = 0; t < lsh_num_of_tables_; ++t) {
+    signature[t] = 0;
+    for (unsigned i = 0; i < lsh_num_of_bits_; ++i, hyperplane += vec_size_) {
+      if (VecCalc::DotProduct(point.data(), hyperplane, vec_size_) > 0)
+        signature[t] |= 1ull << i;
+    }
+  }
+}
+
+std::vector<uint32_t> VecStore::LshCandidates(const std::vector<double>& vec, const unsigned max_hamming_distance) {
+// Returns all rows whose signature is within "max_hamming_distance" of the
+// signature of "vec" in at least one table (every row only once). If probing
+// the buckets of all these signatures would take longer, the packed
+// signatures of all rows get compared with the ones of "vec" instead.
+  std::vector<uint64_t> signature(lsh_num_of_tables_);
+  ComputeLshSignature(vec, signature.data());
+  std::vector<uint32_t> candidates;
+  const uint64_t num_of_probes(NumOfLshProbes(lsh_num_of_bits_, max_hamming_distance));
+  if (num_of_probes*(uint64_t)std::ceil(std::log2((double)vec_num_+1)) >= (uint64_t)vec_num_/kPopcountsPerLookup) {
+    candidates.resize(vec_num_);
+    candidates.resize(VecCalc::FilterByHammingDistance(lsh_signatures_.data(), signature.data(), lsh_num_of_tables_, vec_num_, max_hamming_distance, candidates.data()));
+    return candidates;
+  }
+  std::unique_ptr<VisitedRows> visited_rows(AcquireVisitedRows());
+  visited_rows->Clear();
+  for (unsigned t = 0; t < lsh_num_of_tables_; ++t) {
+    const uint32_t* table(lsh_table_rows_.data()+(std::size_t)t*vec_num_);
+    const auto signature_of([&](const uint32_t row) {return lsh_signatures_[(std::size_t)row*lsh_num_of_tables_+t];});
+    const std::function<void(const uint64_t, const unsigned, const unsigned)> probe([&](const uint64_t bucket, const unsigned first_bit, const unsigned flips_left) {
+    // Collects the rows of "bucket" and probes all buckets differing from it
+    // in up to "flips_left" bits from "first_bit" on.
+      const uint32_t* first(std::lower_bound(table, table+vec_num_, bucket, [&](const uint32_t row, const uint64_t value) {return (signature_of(row) < value);}));
+      for (const uint32_t* row = first; row != table+vec_num_ && signature_of(*row) == bucket; ++row) {
+        if (visited_rows->Visit(*row))
+          candidates.push_back(*row);
+      }
+      if (flips_left > 0) {
+        for (unsigned bit = first_bit; bit < lsh_num_of_bits_; ++bit)
+          probe(bucket^(1ull << bit), bit+1, flips_left-1);
+      }
+    });
+    probe(signature[t], 0, max_hamming_distance);
+  }
+  ReleaseVisitedRows(std::move(visited_rows));
+  return candidates;
+}
+
+template <typename T>
+std::vector<VecStore::CloseWordVec> VecStore::SearchLshCandidates(const std::vector<double>& vec, const unsigned k, const unsigned max_hamming_distance, const int excluded_row) {
+// Returns the k candidates (see "LshCandidates()") with the highest cosine
+// similarities to "vec" sorted by their distance (the closest one first).
+  const std::vector<double> prepared_query(PrepareQuery(vec, VecMetric::kCosine));
+  const std::vector<typename ComputeType<T>::type> query(prepared_query.begin(), prepared_query.end());
+  TopK<CloseWordVec> closest(k, vec_num_);
+  for (const uint32_t row : LshCandidates(vec, max_hamming_distance)) {
+    if ((int)row != excluded_row)
+      closest.Push(CloseWordVec{RowDistance<T>(query.data(), row, VecMetric::kCosine), (int)row});
+  }
+  return closest.Take();
+}
+
+std::list<WordVec*> VecStore::LshKClosestWordVecs(const std::vector<double>& vec, const unsigned k, const unsigned max_hamming_distance, const std::string& word) {
+// Returns the k word vectors with the highest cosine similarities to "vec"
+// among the candidates found by the LSH index (see "LshCandidates()") in a
+// std::list<WordVec*>, starting with the closest one. The row of "word" (if
+// given) will be skipped. If there is no LSH index an error message will be
+// printed and an empty list will be returned.
+  if (lsh_num_of_tables_ == 0) {
+    std::cout << "ERROR in LshKClosestWordVecs(): there is no LSH index (see \"BuildLshIndex()\")." << std::endl;
+    return std::list<WordVec*>();
+  }
+  if (vec.empty() || (int)vec.size() != vec_size_)
+    return std::list<WordVec*>();
+  const int excluded_row(FindRow(word));
+  return GetWordVecs(DispatchPrecision(precision_, [&](auto zero) {
+    typedef decltype(zero) T;
+    return SearchLshCandidates<T>(vec, k, max_hamming_distance, excluded_row);
+  }));
+}
+
+double VecStore::LshRecall(const unsigned k, const unsigned max_hamming_distance, const unsigned num_of_queries) {
+// Measures how many of the k closest word vectors (with regard to the cosine
+// similarity) found by the LSH index are also found by an exact search. The
+// vectors of "num_of_queries" stored words (evenly spread over the
+// "VecStore") are used as queries. Returns the recall as value between 0 and
+// 1 or NaN (and prints an error message) if there is no LSH index.
+  if (lsh_num_of_tables_ == 0 || k == 0 || num_of_queries == 0) {
+    std::cout << "ERROR in LshRecall(): there is no LSH index (or \"k\" or \"num_of_queries\" is 0)." << std::endl;
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  const unsigned queries(std::min(num_of_queries, (unsigned)vec_num_));
+  unsigned found(0), total(0);
+  for (unsigned i = 0; i < queries; ++i) {
+    const int row((int)((uint64_t)i*vec_num_/queries));
+    const std::vector<double> vec(GetRowVec(row));
+    const std::vector<CloseWordVec> exact(SearchRows(vec, k, row, false, VecMetric::kCosine, true));
+    const std::vector<CloseWordVec> approximated(DispatchPrecision(precision_, [&](auto zero) {
+      typedef decltype(zero) T;
+      return SearchLshCandidates<T>(vec, k, max_hamming_distance, row);
+    }));
+    for (auto& x : exact) {
+      for (auto& y : approximated) {
+        if (x.row == y.row) {
+          found++;
+          break;
+        }
+      }
+    }
+    total += exact.size();
+  }
+  return (total > 0)? (double)found/total : 1;
+}
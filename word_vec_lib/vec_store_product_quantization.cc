@@ -0,0 +1,309 @@
+// vec_store_product_quantization.cc
+
+// Copyright 2019 E. Decker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A product quantization file written by "VecStore::SaveProductQuantization()"
+// is laid out like this (all numbers in the byte order of the machine that
+// wrote it):
+//   header             "ProductQuantizationHeader"
+//   subspace offsets   "num_of_subspaces"+1 int32
+//   centroids          "num_of_centroids"*"vec_size" floats
+//   codes              "vec_num"*"num_of_subspaces" bytes
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+#include "word_vec_lib.h"
+
+namespace {
+
+const char kProductQuantizationMagic[8] = {'W', 'V', 'L', 'P', 'Q', '\0', '\0', '\0'};
+const uint32_t kProductQuantizationVersion = 1;
+const uint32_t kByteOrderMark = 0x01020304;
+const unsigned kMaxNumOfCentroids = 256; // every code has to fit into one byte
+const unsigned kTrainingRowsPerCentroid = 16; // k-means gets trained on at most "kTrainingRowsPerCentroid*kMaxNumOfCentroids" rows
+
+struct ProductQuantizationHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order_mark;
+  int64_t vec_size, vec_num, num_of_subspaces, num_of_centroids, rescoring_factor;
+  double quantization_error;
+  uint64_t words_hash; // makes sure the file belongs to the "VecStore"
+};
+
+} // namespace
+
+bool VecStore::TrainProductQuantization(const unsigned num_of_subspaces, const unsigned rescoring_factor, const unsigned num_of_iterations) {
+// Splits the vectors into "num_of_subspaces" subspaces (by default one per four
+// dimensions), learns 256 centroids per subspace using k-means and stores
+// every row as the indices of its closest centroids, i.e. as one byte per
+// subspace. From now on close or distant word vectors will be searched on
+// these codes; the best "rescoring_factor*k" candidates get rescored on the
+// matrix (if "rescoring_factor" is 0 the candidates won't be rescored and the
+// matrix can be deleted by "DropMatrix()"). k-means is trained on a sample of
+// rows and the rows are encoded one at a time, so no copy of the matrix is
+// made. Returns "false" (and prints an error message) if the "VecStore" is
+// empty.
+  if (!HashTableIsValid()) {
+    std::cout << "ERROR in TrainProductQuantization(): the \"VecStore\" is empty." << std::endl;
+    return false;
+  }
+  if (MatrixIsDropped("TrainProductQuantization"))
+    return false;
+  ClearQuantization();
+  const int subspaces(std::min((num_of_subspaces == 0)? (vec_size_+3)/4 : (int)num_of_subspaces, vec_size_));
+  pq_subspace_offsets_.resize(subspaces+1);
+  for (int m = 0; m <= subspaces; ++m)
+    pq_subspace_offsets_[m] = (int)((int64_t)m*vec_size_/subspaces);
+  pq_num_of_centroids_ = std::min(kMaxNumOfCentroids, (unsigned)vec_num_);
+  const int num_of_training_rows(std::min(vec_num_, (int)(kTrainingRowsPerCentroid*pq_num_of_centroids_)));
+  std::cout << "\tTraining the product quantization (" << subspaces << " subspaces, " << num_of_training_rows << " rows)..." << std::endl;
+  const auto copy_row([&](const int row, float* vec) {
+    DispatchPrecision(precision_, [&](auto zero) {
+      typedef decltype(zero) T;
+      const T* row_vec(Row<T>(row));
+      for (int i = 0; i < vec_size_; ++i)
+        vec[i] = static_cast<float>(static_cast<typename ComputeType<T>::type>(row_vec[i]));
+    });
+  });
+  std::vector<float> training_rows((std::size_t)num_of_training_rows*vec_size_);
+  for (int i = 0; i < num_of_training_rows; ++i)
+    copy_row((int)((int64_t)i*vec_num_/num_of_training_rows), training_rows.data()+(std::size_t)i*vec_size_); // rows evenly spread over the "VecStore"
+  pq_centroids_.resize((std::size_t)pq_num_of_centroids_*vec_size_);
+  for (int m = 0; m < subspaces; ++m) {
+    const int offset(pq_subspace_offsets_[m]), size(pq_subspace_offsets_[m+1]-offset);
+    std::vector<float> points((std::size_t)num_of_training_rows*size);
+    for (int i = 0; i < num_of_training_rows; ++i) {
+      const float* vec(training_rows.data()+(std::size_t)i*vec_size_+offset);
+      std::copy(vec, vec+size, points.begin()+(std::size_t)i*size);
+    }
+    const std::vector<float> centroids(KMeans(points, size, pq_num_of_centroids_, num_of_iterations));
+    std::copy(centroids.begin(), centroids.end(), pq_centroids_.begin()+(std::size_t)pq_num_of_centroids_*offset);
+  }
+  training_rows = std::vector<float>();
+  pq_codes_.resize((std::size_t)vec_num_*subspaces);
+  std::vector<float> vec(vec_size_);
+  double error(0), norm(0);
+  for (int row = 0; row < vec_num_; ++row) {
+    copy_row(row, vec.data());
+    for (int m = 0; m < subspaces; ++m) {
+      const int offset(pq_subspace_offsets_[m]), size(pq_subspace_offsets_[m+1]-offset);
+      const float* centroids(pq_centroids_.data()+(std::size_t)pq_num_of_centroids_*offset);
+      const unsigned code(NearestCentroid(vec.data()+offset, centroids, size, pq_num_of_centroids_));
+      pq_codes_[(std::size_t)row*subspaces+m] = (uint8_t)code;
+      error += VecCalc::SquaredEuclideanDistance(vec.data()+offset, centroids+code*size, size);
+      norm += VecCalc::DotProduct(vec.data()+offset, vec.data()+offset, size);
+    }
+  }
+  quantization_ = VecQuantization::kProduct;
+  rescoring_factor_ = rescoring_factor;
+  quantization_error_ = (norm > 0)? std::sqrt(error/norm) : 0;
+  std::cout << "\t---Completed." << std::endl;
+  return true;
+}
+
+std::vector<float> VecStore::KMeans(const std::vector<float>& points, const int dim, const unsigned k, const unsigned num_of_iterations) {
+// Clusters the "points" (of "dim" dimensions each) into k clusters using
+// Lloyd's algorithm and returns the centroids of the clusters. The centroids
+// are initialized with points evenly spread over "points", so the result is
+// deterministic; a centroid whose cluster got empty keeps its position. The
+// points get assigned to their nearest centroids on the threads of the
+// "VecStore" (the centroids are updated in the order of the points, so the
+// result doesn't depend on the number of threads).
+  const std::size_t num_of_points(points.size()/dim);
+  const unsigned num_of_tasks(NumOfTasks((std::size_t)k*dim*sizeof(float), num_of_points));
+  std::vector<unsigned> nearest_centroids(num_of_points);
+  std::vector<float> centroids((std::size_t)k*dim);
+  for (unsigned c = 0; c < k; ++c)
+    std::copy(points.begin()+(std::size_t)(c*num_of_points/k)*dim, points.begin()+(std::size_t)(c*num_of_points/k+1)*dim, centroids.begin()+(std::size_t)c*dim);
+  std::vector<double> sums((std::size_t)k*dim);
+  std::vector<std::size_t> sizes(k);
+  for (unsigned iteration = 0; iteration < num_of_iterations; ++iteration) {
+    std::fill(sums.begin(), sums.end(), 0);
+    std::fill(sizes.begin(), sizes.end(), 0);
+    ForEachRange(num_of_tasks, num_of_points, [&](const unsigned, const int first_point, const int last_point) {
+      for (int i = first_point; i < last_point; ++i)
+        nearest_centroids[i] = NearestCentroid(points.data()+(std::size_t)i*dim, centroids.data(), dim, k);
+    });
+    for (std::size_t i = 0; i < num_of_points; ++i) {
+      const float* point(points.data()+i*dim);
+      const unsigned c(nearest_centroids[i]);
+      sizes[c]++;
+      for (int j = 0; j < dim; ++j)
+        sums[(std::size_t)c*dim+j] += point[j];
+    }
+    for (unsigned c = 0; c < k; ++c) {
+      if (sizes[c] > 0) {
+        for (int j = 0; j < dim; ++j)
+          centroids[(std::size_t)c*dim+j] = sums[(std::size_t)c*dim+j]/sizes[c];
+      }
+    }
+  }
+  return centroids;
+}
+
+unsigned VecStore::NearestCentroid(const float* point, const float* centroids, const int dim, const unsigned k) {
+// Returns the index of the centroid closest to "point".
+  unsigned nearest(0);
+  double nearest_distance(std::numeric_limits<double>::max()), distance;
+  for (unsigned c = 0; c < k; ++c) {
+    distance = VecCalc::SquaredEuclideanDistance(point, centroids+(std::size_t)c*dim, dim);
+    if (distance < nearest_distance) {
+      nearest = c;
+      nearest_distance = distance;
+    }
+  }
+  return nearest;
+}
+
+uint64_t VecStore::HashWords(const int num_of_rows) const {
+// Returns a hash (FNV-1a) of the words of the first "num_of_rows" rows in the
+// order of their rows.
+  uint64_t hash(14695981039346656037ull);
+  for (uint64_t i = 0; i < word_offsets_[num_of_rows]; ++i) {
+    hash ^= (unsigned char)word_pool_[i];
+    hash *= 1099511628211ull;
+  }
+  for (int row = 0; row <= num_of_rows; ++row) {
+    hash ^= word_offsets_[row];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+bool VecStore::SaveProductQuantization(const std::string& file) {
+// Writes the trained product quantization (the centroids and the codes of all
+// rows) to "file", so it doesn't have to be trained again. Returns "false"
+// (and prints an error message) if there is no product quantization or the
+// file couldn't be written.
+  if (quantization_ != VecQuantization::kProduct) {
+    std::cout << "ERROR in SaveProductQuantization(): the \"VecStore\" isn't product quantized." << std::endl;
+    return false;
+  }
+  ProductQuantizationHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kProductQuantizationMagic, sizeof(kProductQuantizationMagic));
+  header.version = kProductQuantizationVersion;
+  header.byte_order_mark = kByteOrderMark;
+  header.vec_size = vec_size_;
+  header.vec_num = vec_num_;
+  header.num_of_subspaces = pq_subspace_offsets_.size()-1;
+  header.num_of_centroids = pq_num_of_centroids_;
+  header.rescoring_factor = rescoring_factor_;
+  header.quantization_error = quantization_error_;
+  header.words_hash = HashWords(vec_num_);
+  std::ofstream file_stream(file, std::ios::binary | std::ios::trunc);
+  if (!file_stream.is_open()) {
+    std::cout << "ERROR in SaveProductQuantization(): OPENING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  file_stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file_stream.write(reinterpret_cast<const char*>(pq_subspace_offsets_.data()), pq_subspace_offsets_.size()*sizeof(int));
+  file_stream.write(reinterpret_cast<const char*>(pq_centroids_.data()), pq_centroids_.size()*sizeof(float));
+  file_stream.write(reinterpret_cast<const char*>(pq_codes_.data()), pq_codes_.size());
+  if (!file_stream.good()) {
+    std::cout << "ERROR in SaveProductQuantization(): WRITING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool VecStore::LoadProductQuantization(const std::string& file) {
+// Reads a product quantization written by "SaveProductQuantization()" for a
+// "VecStore" holding the same words and uses it from now on. Returns "false"
+// (and prints an error message) if "file" couldn't be read, doesn't belong to
+// this "VecStore" or rescores on a matrix deleted by "DropMatrix()".
+  std::ifstream file_stream(file, std::ios::binary);
+  if (!file_stream.is_open()) {
+    std::cout << "ERROR in LoadProductQuantization(): OPENING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  ProductQuantizationHeader header;
+  if (!file_stream.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, kProductQuantizationMagic, sizeof(kProductQuantizationMagic)) != 0
+      || header.version != kProductQuantizationVersion || header.byte_order_mark != kByteOrderMark) {
+    std::cout << "ERROR in LoadProductQuantization(): \"" << file << "\" is not a product quantization file of this version of \"word_vec_lib\" (or was written on a machine with another byte order)." << std::endl;
+    return false;
+  }
+  if (!HashTableIsValid() || header.vec_size != vec_size_ || header.vec_num != vec_num_ || header.words_hash != HashWords(vec_num_)
+      || header.num_of_subspaces < 1 || header.num_of_subspaces > vec_size_ || header.num_of_centroids < 1 || header.num_of_centroids > kMaxNumOfCentroids) {
+    std::cout << "ERROR in LoadProductQuantization(): \"" << file << "\" doesn't belong to this \"VecStore\"." << std::endl;
+    return false;
+  }
+  std::vector<int> subspace_offsets(header.num_of_subspaces+1);
+  std::vector<float> centroids((std::size_t)header.num_of_centroids*vec_size_);
+  std::vector<uint8_t> codes((std::size_t)vec_num_*header.num_of_subspaces);
+  file_stream.read(reinterpret_cast<char*>(subspace_offsets.data()), subspace_offsets.size()*sizeof(int));
+  file_stream.read(reinterpret_cast<char*>(centroids.data()), centroids.size()*sizeof(float));
+  file_stream.read(reinterpret_cast<char*>(codes.data()), codes.size());
+  bool is_valid(file_stream.good() && subspace_offsets.front() == 0 && subspace_offsets.back() == vec_size_);
+  for (int m = 0; is_valid && m < header.num_of_subspaces; ++m)
+    is_valid = (subspace_offsets[m] < subspace_offsets[m+1]);
+  for (std::size_t i = 0; is_valid && i < codes.size(); ++i)
+    is_valid = (codes[i] < header.num_of_centroids);
+  if (!is_valid) {
+    std::cout << "ERROR in LoadProductQuantization(): \"" << file << "\" is not a valid product quantization file." << std::endl;
+    return false;
+  }
+  if (header.rescoring_factor > 0 && MatrixIsDropped("LoadProductQuantization"))
+    return false;
+  ClearQuantization();
+  pq_subspace_offsets_ = std::move(subspace_offsets);
+  pq_centroids_ = std::move(centroids);
+  pq_codes_ = std::move(codes);
+  pq_num_of_centroids_ = header.num_of_centroids;
+  rescoring_factor_ = header.rescoring_factor;
+  quantization_error_ = header.quantization_error;
+  quantization_ = VecQuantization::kProduct;
+  return true;
+}
+
+bool VecStore::DropMatrix() {
+// Deletes the matrix (and a normalized copy of it), so only the product
+// quantization codes are kept; this requires a product quantization without
+// rescoring (see "TrainProductQuantization()"). From now on the vectors handed
+// out are the ones approximated by the centroids. The HNSW graph, the inverted
+// file and the LSH index get deleted, and everything that needs the exact
+// vectors (e.g. "Save()", "Normalize()", "AnalogyBatch()" or building an index)
+// prints an error message. A snapshot is mapped without reading the matrix, so
+// a "VecStore" constructed from a snapshot followed by
+// "LoadProductQuantization()" and "DropMatrix()" never loads the matrix at all.
+// Returns "false" (and prints an error message) if there is no product
+// quantization without rescoring.
+  if (quantization_ != VecQuantization::kProduct || rescoring_factor_ > 0) {
+    std::cout << "ERROR in DropMatrix(): the matrix can only be dropped if the \"VecStore\" is product quantized without rescoring (\"rescoring_factor\" = 0)." << std::endl;
+    return false;
+  }
+  ClearHnswIndex();
+  ClearIvfIndex();
+  ClearLshIndex();
+  SetPrunedSearch(false);
+  owned_matrix_ = AlignedArray<unsigned char>();
+  normalized_matrix_ = AlignedArray<unsigned char>();
+  matrix_ = NULL;
+  return true;
+}
+
+bool VecStore::MatrixIsDropped(const std::string& function) {
+// Returns "true" (and prints an error message) if "DropMatrix()" has deleted
+// the matrix "function" needs.
+  if (!HashTableIsValid() || matrix_ != NULL)
+    return false;
+  std::cout << "ERROR in " << function << "(): the matrix has been dropped (see \"DropMatrix()\")." << std::endl;
+  return true;
+}
@@ -0,0 +1,141 @@
+// vec_store_quantization.cc
+
+// Copyright 2019 E. Decker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <iostream>
+#include <limits>
+
+#include "word_vec_lib.h"
+
+bool VecStore::Quantize(const VecQuantization quantization, const unsigned rescoring_factor) {
+// Quantizes all rows of the matrix to int8 codes (using one scale and offset
+// per dimension or per vector) that will be used to search for close or
+// distant word vectors from now on; the matrix itself is kept to rescore the
+// best "rescoring_factor*k" candidates found on the codes (if
+// "rescoring_factor" is 0 the candidates won't be rescored).
+// "VecQuantization::kNone" switches back to searching the matrix,
+// "VecQuantization::kProduct" calls "TrainProductQuantization()" using its
+// default parameters. Returns "false" (and prints an error message) if the
+// "VecStore" is empty.
+  if (!HashTableIsValid()) {
+    std::cout << "ERROR in Quantize(): the \"VecStore\" is empty." << std::endl;
+    return false;
+  }
+  if (MatrixIsDropped("Quantize"))
+    return false;
+  if (quantization == VecQuantization::kProduct)
+    return TrainProductQuantization(0, rescoring_factor);
+  ClearQuantization();
+  quantization_ = quantization;
+  rescoring_factor_ = rescoring_factor;
+  if (quantization_ == VecQuantization::kNone)
+    return true;
+  // The rows are converted one at a time (the matrix is read twice: once for
+  // the ranges and once for the codes), so no copy of the matrix is needed.
+  const auto copy_row([&](const int row, double* vec) {
+    DispatchPrecision(precision_, [&](auto zero) {
+      typedef decltype(zero) T;
+      const T* row_vec(Row<T>(row));
+      for (int i = 0; i < vec_size_; ++i)
+        vec[i] = static_cast<double>(static_cast<typename ComputeType<T>::type>(row_vec[i]));
+    });
+  });
+  std::vector<double> vec(vec_size_);
+  // Maps the range ["min", "max"] of every dimension (or vector) to the codes
+  // -127 to 127.
+  const bool per_dimension(quantization_ == VecQuantization::kPerDimension);
+  const int num_of_ranges((per_dimension)? vec_size_ : vec_num_);
+  std::vector<double> min(num_of_ranges, std::numeric_limits<double>::max()), max(num_of_ranges, std::numeric_limits<double>::lowest());
+  for (int row = 0; row < vec_num_; ++row) {
+    copy_row(row, vec.data());
+    for (int i = 0; i < vec_size_; ++i) {
+      const int range((per_dimension)? i : row);
+      min[range] = std::min(min[range], vec[i]);
+      max[range] = std::max(max[range], vec[i]);
+    }
+  }
+  code_scales_.resize(num_of_ranges);
+  code_offsets_.resize(num_of_ranges);
+  for (int i = 0; i < num_of_ranges; ++i) {
+    code_scales_[i] = (max[i]-min[i])/254;
+    code_offsets_[i] = (max[i]+min[i])/2;
+  }
+  code_bytes_ = (vec_size_+63)/64*64;
+  codes_ = AlignedArray<int8_t>((std::size_t)vec_num_*code_bytes_);
+  std::fill(codes_.Data(), codes_.Data()+codes_.Size(), 0);
+  code_norms_.assign(vec_num_, 0);
+  double error(0), norm(0);
+  for (int row = 0; row < vec_num_; ++row) {
+    copy_row(row, vec.data());
+    int8_t* code(codes_.Data()+(std::size_t)row*code_bytes_);
+    for (int i = 0; i < vec_size_; ++i) {
+      const int range((per_dimension)? i : row);
+      const double value(vec[i]);
+      if (code_scales_[range] > 0)
+        code[i] = (int8_t)std::max(-127l, std::min(127l, std::lround((value-code_offsets_[range])/code_scales_[range])));
+      const double approximation(code_offsets_[range]+(double)code_scales_[range]*code[i]);
+      code_norms_[row] += approximation*approximation;
+      error += (value-approximation)*(value-approximation);
+      norm += value*value;
+    }
+  }
+  quantization_error_ = (norm > 0)? std::sqrt(error/norm) : 0;
+  return true;
+}
+
+void VecStore::ClearQuantization() {
+// Deletes all codes, so the matrix will be searched again.
+  quantization_ = VecQuantization::kNone;
+  quantization_error_ = 0;
+  codes_ = AlignedArray<int8_t>();
+  code_scales_.clear();
+  code_offsets_.clear();
+  code_norms_.clear();
+  pq_codes_.clear();
+  pq_centroids_.clear();
+  pq_subspace_offsets_.clear();
+  pq_num_of_centroids_ = 0;
+}
+
+double VecStore::QuantizedRecall(const unsigned k, const unsigned num_of_queries) {
+// Measures how many of the k closest word vectors found on the quantized rows
+// (including the rescoring) are also found by an exact search. The vectors of
+// "num_of_queries" stored words (evenly spread over the "VecStore") are used
+// as queries. Returns the recall as value between 0 and 1 or NaN (and prints
+// an error message) if the "VecStore" isn't quantized.
+  if (quantization_ == VecQuantization::kNone || k == 0 || num_of_queries == 0) {
+    std::cout << "ERROR in QuantizedRecall(): the \"VecStore\" isn't quantized (or \"k\" or \"num_of_queries\" is 0)." << std::endl;
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  if (MatrixIsDropped("QuantizedRecall"))
+    return std::numeric_limits<double>::quiet_NaN();
+  const unsigned queries(std::min(num_of_queries, (unsigned)vec_num_));
+  unsigned found(0), total(0);
+  for (unsigned i = 0; i < queries; ++i) {
+    const int row((int)((uint64_t)i*vec_num_/queries));
+    const std::vector<double> vec(GetRowVec(row));
+    const std::vector<CloseWordVec> exact(SearchRows(vec, k, row, false, VecMetric::kEuclidean, true)), approximated(SearchRows(vec, k, row, false, VecMetric::kEuclidean));
+    for (auto& x : exact) {
+      for (auto& y : approximated) {
+        if (x.row == y.row) {
+          found++;
+          break;
+        }
+      }
+    }
+    total += exact.size();
+  }
+  return (total > 0)? (double)found/total : 1;
+}
@@ -0,0 +1,162 @@
+// vec_store_snapshot.cc
+
+// Copyright 2019 E. Decker
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A snapshot file of a "VecStore" is laid out like this (all numbers in the
+// byte order of the machine that wrote the snapshot; every section starts at a
+// multiple of 64 bytes, so the sections can be used in place once the file is
+// mapped into memory):
+//   header        "SnapshotHeader"
+//   matrix        "vec_num" rows of "row_bytes" bytes (row-major; only the
+//                 first "vec_size" values of a row are used, the type of the
+//                 values is given by "scalar_type")
+//   word offsets  "vec_num"+1 uint64 offsets into the word pool
+//   word pool     the words of all rows (not null-terminated)
+//   index slots   "index_size" (a power of two) slots of the open addressing
+//                 hash table, each holding the uint32 fingerprint of a word
+//                 and its uint32 row (0xffffffff if the slot is empty)
+//   norms         "vec_num" double Euclidean norms of the rows
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "word_vec_lib.h"
+
+namespace {
+
+const char kSnapshotMagic[8] = {'W', 'V', 'L', 'S', 'N', 'A', 'P', '\0'};
+const uint32_t kSnapshotVersion = 4;
+const uint32_t kByteOrderMark = 0x01020304;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order_mark;
+  uint32_t scalar_type; // "VecPrecision" of the matrix
+  uint32_t case_sensitive;
+  uint32_t normalized; // whether the rows of the matrix were normalized in place
+  int64_t vec_size, vec_num, row_bytes, index_size;
+  uint64_t matrix_offset, word_offsets_offset, word_pool_offset, index_slots_offset, norms_offset, file_size;
+};
+
+uint64_t AlignOffset(const uint64_t offset) {
+  return (offset+63) & ~(uint64_t)63;
+}
+
+void WritePadding(std::ofstream& file_stream, const uint64_t offset) {
+// Fills the file with zeros up to "offset".
+  static const char zeros[64] = {};
+  file_stream.write(zeros, offset-file_stream.tellp());
+}
+
+bool SectionIsValid(const SnapshotHeader& header, const uint64_t offset, const uint64_t size) {
+  return (offset%64 == 0 && offset <= header.file_size && size <= header.file_size-offset);
+}
+
+} // namespace
+
+bool VecStore::Save(const std::string& file) {
+// Writes a snapshot of the "VecStore" to "file". A "VecStore" constructed from
+// this snapshot maps the file into memory and works directly on its pages
+// (without parsing or hashing any word). Returns "false" (and prints an error
+// message) if the snapshot couldn't be written.
+  if (!HashTableIsValid()) {
+    std::cout << "ERROR in Save(): the \"VecStore\" is empty; no snapshot was written." << std::endl;
+    return false;
+  }
+  if (MatrixIsDropped("Save"))
+    return false;
+  SnapshotHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+  header.version = kSnapshotVersion;
+  header.byte_order_mark = kByteOrderMark;
+  header.scalar_type = (uint32_t)precision_;
+  header.case_sensitive = case_sensitive_;
+  header.normalized = normalized_;
+  header.vec_size = vec_size_;
+  header.vec_num = vec_num_;
+  header.row_bytes = row_bytes_;
+  header.index_size = hash_table_size_;
+  header.matrix_offset = AlignOffset(sizeof(SnapshotHeader));
+  header.word_offsets_offset = AlignOffset(header.matrix_offset+(uint64_t)vec_num_*row_bytes_);
+  header.word_pool_offset = AlignOffset(header.word_offsets_offset+(vec_num_+1)*sizeof(uint64_t));
+  header.index_slots_offset = AlignOffset(header.word_pool_offset+word_offsets_[vec_num_]);
+  header.norms_offset = AlignOffset(header.index_slots_offset+hash_table_size_*sizeof(IndexSlot));
+  header.file_size = header.norms_offset+vec_num_*sizeof(double);
+  std::ofstream file_stream(file, std::ios::binary | std::ios::trunc);
+  if (!file_stream.is_open()) {
+    std::cout << "ERROR in Save(): OPENING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  file_stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  WritePadding(file_stream, header.matrix_offset);
+  file_stream.write(reinterpret_cast<const char*>(matrix_), (uint64_t)vec_num_*row_bytes_);
+  WritePadding(file_stream, header.word_offsets_offset);
+  file_stream.write(reinterpret_cast<const char*>(word_offsets_), (vec_num_+1)*sizeof(uint64_t));
+  WritePadding(file_stream, header.word_pool_offset);
+  file_stream.write(word_pool_, word_offsets_[vec_num_]);
+  WritePadding(file_stream, header.index_slots_offset);
+  file_stream.write(reinterpret_cast<const char*>(index_slots_), hash_table_size_*sizeof(IndexSlot));
+  WritePadding(file_stream, header.norms_offset);
+  file_stream.write(reinterpret_cast<const char*>(norms_), vec_num_*sizeof(double));
+  if (!file_stream.good()) {
+    std::cout << "ERROR in Save(): WRITING \"" << file << "\" FAILED!" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool VecStore::LoadSnapshot() {
+// Checks whether "input_file_" is a snapshot written by "VecStore::Save()" and
+// maps it into memory if so (the matrix, the word pool, the hash table and the
+// norms are used in place, so this takes constant time). Returns "false" if
+// "input_file_" isn't a snapshot.
+  std::unique_ptr<MappedFile> snapshot(new MappedFile(input_file_, MappedFileAccess::kNormal));
+  if (!snapshot->IsOpen() || snapshot->Size() < sizeof(SnapshotHeader) || std::memcmp(snapshot->Data(), kSnapshotMagic, sizeof(kSnapshotMagic)) != 0)
+    return false;
+  std::cout << "CREATING A \"VecStore\"." << '\n' << "Input file (\"snapshot file\"): " << input_file_ << '\n';
+  SnapshotHeader header;
+  std::memcpy(&header, snapshot->Data(), sizeof(header));
+  SetSizes(-1, 0, 1);
+  if (header.version != kSnapshotVersion || header.byte_order_mark != kByteOrderMark || header.scalar_type > (uint32_t)VecPrecision::kBFloat16) {
+    std::cout << "ERROR: \"" << input_file_ << "\" was written by another version of \"word_vec_lib\" or on a machine with another byte order." << std::endl;
+    return true;
+  }
+  if (header.file_size != snapshot->Size() || header.vec_size < 1 || header.vec_num < 1 || header.index_size != GetHashTableSize(header.vec_num)
+      || header.row_bytes != (int64_t)RowBytes(header.vec_size, (VecPrecision)header.scalar_type)
+      || !SectionIsValid(header, header.matrix_offset, (uint64_t)header.vec_num*header.row_bytes)
+      || !SectionIsValid(header, header.word_offsets_offset, (header.vec_num+1)*sizeof(uint64_t))
+      || !SectionIsValid(header, header.index_slots_offset, header.index_size*sizeof(IndexSlot))
+      || !SectionIsValid(header, header.norms_offset, header.vec_num*sizeof(double))
+      || reinterpret_cast<const uint64_t*>(snapshot->Data()+header.word_offsets_offset)[header.vec_num] > header.index_slots_offset-header.word_pool_offset) {
+    std::cout << "ERROR: \"" << input_file_ << "\" is not a valid snapshot file." << std::endl;
+    return true;
+  }
+  case_sensitive_ = header.case_sensitive;
+  normalized_ = header.normalized;
+  precision_ = (VecPrecision)header.scalar_type;
+  SetSizes(header.vec_size, header.vec_num, header.index_size);
+  matrix_ = reinterpret_cast<const unsigned char*>(snapshot->Data()+header.matrix_offset);
+  word_offsets_ = reinterpret_cast<const uint64_t*>(snapshot->Data()+header.word_offsets_offset);
+  word_pool_ = snapshot->Data()+header.word_pool_offset;
+  index_slots_ = reinterpret_cast<const IndexSlot*>(snapshot->Data()+header.index_slots_offset);
+  norms_ = reinterpret_cast<const double*>(snapshot->Data()+header.norms_offset);
+  snapshot_ = std::move(snapshot);
+  std::cout << "\tMapped snapshot." << std::endl;
+  return true;
+}
@@ -18,19 +18,419 @@
 #define WORD_VEC_LIB_WORD_VEC_LIB_H_INCLUDED_
 
 #include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <list>
 #include <math.h>
+#include <memory>
+#include <mutex>
 #include <numeric>
 #include <regex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 struct WordVec { // word vector
   std::string word;
   std::vector<double> vec;
-  WordVec* next; // enables chaining of "WordVec"s in the hash table created in the class "VecStore"
-  WordVec(const std::string w, const std::vector<double> v) : word(w), vec(v), next(NULL) {}
+  WordVec(const std::string w, const std::vector<double> v) : word(w), vec(v) {}
+};
+
+enum class VecPrecision { // element type used to store the vectors of a "VecStore" or a "VecSimTable"
+  kDouble,  // 64 bit floating point
+  kFloat,   // 32 bit floating point (~7 significant digits)
+  kHalf,    // 16 bit IEEE 754 half precision (~3 significant digits, values up to 65504)
+  kBFloat16 // 16 bit "brain floating point" (~2 significant digits, same range as "float")
+};
+
+struct Half { // 16 bit IEEE 754 half precision floating point number
+  uint16_t bits;
+
+  Half() = default;
+
+  explicit Half(const float value) : bits(FromFloat(value)) {}
+
+  operator float() const {
+    return ToFloat(bits);
+  }
+
+  static uint16_t FromFloat(const float value) {
+  // Converts a "float" to half precision (rounding to nearest even).
+    uint32_t x;
+    std::memcpy(&x, &value, sizeof(x));
+    const uint32_t sign((x >> 16) & 0x8000);
+    x &= 0x7fffffff;
+    if (x >= 0x7f800000) // infinity or NaN
+      return sign | 0x7c00 | ((x > 0x7f800000)? 0x200 : 0);
+    if (x >= 0x477ff000) // too large for half precision
+      return sign | 0x7c00;
+    if (x < 0x38800000) { // subnormal half precision number or zero
+      if (x < 0x33000000)
+        return sign;
+      const uint32_t shift(126-(x >> 23)), mantissa((x & 0x7fffff) | 0x800000);
+      const uint32_t remainder(mantissa & ((1u << shift)-1)), halfway(1u << (shift-1));
+      uint32_t result(mantissa >> shift);
+      if (remainder > halfway || (remainder == halfway && (result & 1)))
+        result++;
+      return sign | result;
+    }
+    return sign | ((x-(112u << 23)+0xfff+((x >> 13) & 1)) >> 13);
+  }
+
+  static float ToFloat(const uint16_t half) {
+  // Converts a half precision number to "float" (this is exact).
+    const uint32_t sign((uint32_t)(half & 0x8000) << 16);
+    uint32_t exponent((half >> 10) & 0x1f), mantissa(half & 0x3ff), x;
+    if (exponent == 0x1f) {
+      x = sign | 0x7f800000 | (mantissa << 13);
+    } else if (exponent != 0) {
+      x = sign | ((exponent+112) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+      x = sign;
+    } else { // subnormal half precision number
+      exponent = 113;
+      while (!(mantissa & 0x400)) {
+        mantissa <<= 1;
+        exponent--;
+      }
+      x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    float value;
+    std::memcpy(&value, &x, sizeof(value));
+    return value;
+  }
+};
+
+struct BFloat16 { // 16 bit "brain floating point" number (the upper half of a "float")
+  uint16_t bits;
+
+  BFloat16() = default;
+
+  explicit BFloat16(const float value) : bits(FromFloat(value)) {}
+
+  operator float() const {
+    return ToFloat(bits);
+  }
+
+  static uint16_t FromFloat(const float value) {
+  // Converts a "float" to bfloat16 (rounding to nearest even).
+    uint32_t x;
+    std::memcpy(&x, &value, sizeof(x));
+    if ((x & 0x7fffffff) > 0x7f800000) // NaN
+      return (x >> 16) | 0x40;
+    return (x+0x7fff+((x >> 16) & 1)) >> 16;
+  }
+
+  static float ToFloat(const uint16_t bfloat16) {
+    const uint32_t x((uint32_t)bfloat16 << 16);
+    float value;
+    std::memcpy(&value, &x, sizeof(value));
+    return value;
+  }
+};
+
+enum class VecQuantization { // int8 codes a "VecStore" can search on (see "VecStore::Quantize()")
+  kNone,
+  kPerDimension, // one scale and offset per dimension
+  kPerVector,    // one scale and offset per vector
+  kProduct       // product quantization: one byte per subspace (see "VecStore::TrainProductQuantization()")
+};
+
+enum class VecMetric { // measure used to find close (or distant) word vectors
+  kEuclidean,   // Euclidean distance
+  kCosine,      // cosine similarity (the closest vector has the highest similarity)
+  kInnerProduct // dot product (the closest vector has the highest dot product)
+};
+
+enum class VecSimMeasures { // measures a "VecSimTable" calculates and stores for all word pairs (one plane each)
+  kAll,      // cosine similarities and Euclidean distances
+  kCosine,   // cosine similarities only
+  kEuclidean, // Euclidean distances only
+  kNone      // no planes: all values are calculated on demand (lazy table)
+};
+
+enum class VecAnalogy { // objective used to answer "a is to b as c is to ?" (see "VecStore::Analogy()")
+  k3CosAdd, // highest cos(x, b)-cos(x, a)+cos(x, c)
+  k3CosMul  // highest cos(x, b)*cos(x, c)/(cos(x, a)+0.001) with all cosine similarities mapped to [0, 1]
+};
+
+template <typename T>
+struct ComputeType { // type used for the element-wise arithmetic on vectors stored as "T"s (the sums are always accumulated as "double"s)
+  typedef float type;
+};
+
+template <>
+struct ComputeType<double> {
+  typedef double type;
+};
+
+inline std::size_t SizeOfPrecision(const VecPrecision precision) {
+  return (precision == VecPrecision::kDouble)? 8 : (precision == VecPrecision::kFloat)? 4 : 2;
+}
+
+inline std::size_t RowBytes(const int vec_size, const VecPrecision precision) {
+// Returns the number of bytes per row of a matrix of vectors (rounded up to a
+// multiple of 64, so every row is aligned to a cache line).
+  return (vec_size*SizeOfPrecision(precision)+63)/64*64;
+}
+
+template <typename Function>
+auto DispatchPrecision(const VecPrecision precision, Function&& function) {
+// Calls "function" with a value of the element type corresponding to
+// "precision", so generic code for all element types can be written like:
+//   DispatchPrecision(precision, [&](auto zero) { typedef decltype(zero) T; ... });
+  switch (precision) {
+    case VecPrecision::kFloat:
+      return function(float(0));
+    case VecPrecision::kHalf:
+      return function(Half(0.f));
+    case VecPrecision::kBFloat16:
+      return function(BFloat16(0.f));
+    default:
+      return function(double(0));
+  }
+}
+
+template <typename T>
+class AlignedArray {
+// Array of "T"s (trivially copyable) whose first element is aligned to a cache
+// line (64 bytes).
+ public:
+  AlignedArray() : data_(NULL), size_(0) {}
+
+  explicit AlignedArray(const std::size_t size) : data_(NULL), size_(size) {
+    if (size_)
+      data_ = static_cast<T*>(std::aligned_alloc(64, (size_*sizeof(T)+63) & ~(std::size_t)63));
+  }
+
+  AlignedArray(AlignedArray&& other) : data_(other.data_), size_(other.size_) {
+    other.data_ = NULL;
+    other.size_ = 0;
+  }
+
+  AlignedArray& operator=(AlignedArray&& other) {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+  }
+
+  ~AlignedArray() {
+    std::free(data_);
+  }
+
+  T* Data() const {
+    return data_;
+  }
+
+  std::size_t Size() const {
+    return size_;
+  }
+
+  T& operator[](const std::size_t i) const {
+    return data_[i];
+  }
+
+ private:
+  T* data_;
+  std::size_t size_;
+};
+
+template <typename T>
+class TopK {
+// Selects the k smallest of all values pushed into it (with regard to
+// "operator<" of "T") using a bounded binary max-heap: the largest value kept
+// is always at the root, so most values can be rejected by a single
+// comparison, and no memory is allocated after the construction.
+ public:
+  TopK(const std::size_t k, const std::size_t max_num_of_values) : k_(std::min(k, max_num_of_values)) {
+    heap_.reserve(k_);
+  }
+
+  void Push(const T& value) {
+    if (heap_.size() < k_) {
+      heap_.push_back(value);
+      std::push_heap(heap_.begin(), heap_.end());
+    } else if (k_ > 0 && value < heap_.front()) {
+      ReplaceRoot(value);
+    }
+  }
+
+  std::size_t Size() const {
+    return heap_.size();
+  }
+
+  bool IsFull() const {
+    return (heap_.size() == k_);
+  }
+
+  const T& Largest() const {
+  // Returns the largest value kept (the "TopK" mustn't be empty).
+    return heap_.front();
+  }
+
+  std::vector<T> Take() {
+  // Returns the selected values sorted in ascending order (the "TopK" is empty
+  // afterwards).
+    std::sort_heap(heap_.begin(), heap_.end());
+    return std::move(heap_);
+  }
+
+ private:
+  std::size_t k_;
+  std::vector<T> heap_;
+
+  void ReplaceRoot(const T& value) {
+  // Replaces the largest value by "value" and sifts it down to its place.
+    std::size_t i(0), child;
+    while ((child = 2*i+1) < heap_.size()) {
+      if (child+1 < heap_.size() && heap_[child] < heap_[child+1])
+        ++child;
+      if (!(value < heap_[child]))
+        break;
+      heap_[i] = heap_[child];
+      i = child;
+    }
+    heap_[i] = value;
+  }
+};
+
+class ThreadPool {
+// Persistent worker threads that run the tasks of parallel loops (e.g. the
+// row ranges of a scan of a "VecStore"), so no thread has to be started per
+// loop. A pool can be shared by several "VecStore"s.
+ public:
+  explicit ThreadPool(const unsigned num_of_threads = 0);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  unsigned NumOfThreads() const {
+  // Returns the number of threads running a loop (including the calling one).
+    return workers_.size()+1;
+  }
+
+  void ParallelFor(const unsigned num_of_tasks, const std::function<void(const unsigned)>& task);
+
+ private:
+  std::vector<std::thread> workers_;
+  std::mutex mutex_; // guards all members below
+  std::mutex run_mutex_; // held while a loop runs
+  std::condition_variable start_, done_;
+  const std::function<void(const unsigned)>* task_;
+  unsigned num_of_tasks_, next_task_, unfinished_tasks_;
+  uint64_t generation_; // number of loops started so far
+  bool stop_;
+
+  void RunTasks(std::unique_lock<std::mutex>& lock);
+
+  void Work();
+};
+
+class PairCache {
+// Bounded cache of values of word pairs (e.g. their dot products) keyed by
+// their index in the similarity table of a "VecSimTable". It is set
+// associative: a key can only be stored in the "kWays" slots of its set, and a
+// full set evicts with the CLOCK algorithm (a value that has been read since
+// the hand of the set passed it last gets a second chance). The sets are
+// guarded by "kNumOfLocks" mutexes, so several threads can use the cache at
+// the same time.
+ public:
+  explicit PairCache(const std::size_t capacity = 0);
+
+  void SetCapacity(const std::size_t capacity);
+
+  std::size_t Capacity() const {
+    return sets_.size()*kWays;
+  }
+
+  bool Find(const std::size_t key, double& value);
+
+  void Insert(const std::size_t key, const double value);
+
+ private:
+  static constexpr unsigned kWays = 8;
+  static constexpr unsigned kNumOfLocks = 64;
+  static constexpr std::size_t kEmptyKey = (std::size_t)-1;
+
+  struct Set {
+    std::size_t keys[kWays];
+    double values[kWays];
+    uint8_t referenced; // bit i is set if "values[i]" has been read since the hand passed it last
+    uint8_t hand;
+
+    Set() : referenced(0), hand(0) {
+      std::fill(keys, keys+kWays, kEmptyKey);
+    }
+  };
+
+  std::vector<Set> sets_;
+  std::array<std::mutex, kNumOfLocks> mutexes_; // "sets_[i]" is guarded by "mutexes_[i%kNumOfLocks]"
+
+  std::size_t SetOf(const std::size_t key) const {
+    return (std::size_t)(((uint64_t)key*0x9E3779B97F4A7C15ull) >> 32)%sets_.size();
+  }
+};
+
+enum class MappedFileAccess { // how a "MappedFile" will be read (passed on to "madvise()")
+  kNormal,     // no hint (e.g. for files that are searched in place)
+  kSequential, // once from the beginning to the end (the kernel reads ahead aggressively)
+  kRandom      // at random positions (the kernel doesn't read ahead)
+};
+
+class MappedFile {
+// Read-only memory mapping of a whole file (on systems without "mmap()" the
+// file will be read into a buffer instead).
+ public:
+  explicit MappedFile(const std::string& file, const MappedFileAccess access = MappedFileAccess::kNormal);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool IsOpen() const {
+    return is_open_;
+  }
+
+  const char* Data() const {
+    return data_;
+  }
+
+  std::size_t Size() const {
+    return size_;
+  }
+
+ private:
+  const char* data_;
+  std::size_t size_;
+  bool is_open_, is_mapped_;
+  std::vector<char> buffer_; // only used if the file could not be mapped
+};
+
+struct VecFileContents { // word vectors read from a word vector file
+  int vec_size, vec_num;
+  VecPrecision precision; // element type of "matrix"
+  std::size_t row_bytes;
+  std::vector<std::string> words;
+  AlignedArray<unsigned char> matrix; // the vector of "words[i]" starts at "matrix[i*row_bytes]" (the padding of the rows is 0)
+  VecFileContents() : vec_size(-1), vec_num(0), precision(VecPrecision::kDouble), row_bytes(0) {}
+};
+
+namespace VecFile {
+// Functions to read word vector files. The file gets mapped into memory once;
+// text files get split into line-aligned chunks that are parsed on all
+// available cores (only the lines that are kept), binary word2vec files
+// (".bin") get streamed into memory without any text conversion. The values
+// are converted straight into the rows of a matrix of the given precision,
+// which can be taken over by the caller.
+  VecFileContents Read(const std::string& file, const std::string& reader, const bool case_sensitive = true, const double percentage = 1., const VecPrecision precision = VecPrecision::kDouble);
+  VecFileContents Read(const std::string& file, const std::string& reader, const std::regex& pattern, const bool case_sensitive = true, const VecPrecision precision = VecPrecision::kDouble);
 };
 
 namespace VecPrint {
@@ -46,20 +446,350 @@ namespace VecPrint {
 namespace VecCalc {
 // Functions to perform mathematical operations on (word) vectors.
 
+  // Kernels for contiguous vectors of the same type, using SSE2, AVX2 or
+  // AVX-512 (whatever the CPU supports; see "vec_kernels.cc"). The sums are
+  // accumulated as "double"s.
+  double DotProduct(const float* vec0, const float* vec1, const unsigned size);
+  double DotProduct(const double* vec0, const double* vec1, const unsigned size);
+  int32_t DotProduct(const int8_t* vec0, const int8_t* vec1, const unsigned size); // integer arithmetic only
+  double SquaredEuclideanDistance(const float* vec0, const float* vec1, const unsigned size);
+  double SquaredEuclideanDistance(const double* vec0, const double* vec1, const unsigned size);
+  int32_t SquaredEuclideanDistance(const int8_t* vec0, const int8_t* vec1, const unsigned size); // integer arithmetic only
+  double ManhattanDistance(const float* vec0, const float* vec1, const unsigned size);
+  double ManhattanDistance(const double* vec0, const double* vec1, const unsigned size);
+  double CosineSimilarity(const float* vec0, const float* vec1, const unsigned size);
+  double CosineSimilarity(const double* vec0, const double* vec1, const unsigned size);
+  // Writes the indices of those of the "num_of_rows" packed signatures
+  // ("num_of_words" uint64 each) that have got at least one word within a
+  // Hamming distance of "max_distance" to the corresponding word of "query"
+  // into "rows" and returns their number (using POPCNT or AVX-512 VPOPCNTDQ).
+  std::size_t FilterByHammingDistance(const uint64_t* signatures, const uint64_t* query, const unsigned num_of_words, const std::size_t num_of_rows, const unsigned max_distance, uint32_t* rows);
+  const char* InstructionSet(); // "AVX-512", "AVX2", "SSE2" or "scalar"
+
+  // Scalar versions of the kernels for all other element types (e.g. rows of
+  // the matrix of a "VecStore" stored as "Half"s; the elements of both vectors
+  // get converted to the "ComputeType" of "vec0", so differences and products
+  // of "Half"s aren't rounded to 16 bits).
+
+  template <typename T, typename U>
+  double SquaredEuclideanDistance(const T* vec0, const U* vec1, const unsigned size) {
+  // Calculates and returns the squared Euclidean distance between the first
+  // "size" elements of "vec0" and "vec1".
+    typedef typename ComputeType<T>::type ComputeT;
+    double x(0);
+    for (unsigned i = 0; i < size; ++i) {
+      const ComputeT difference(static_cast<ComputeT>(vec0[i])-static_cast<ComputeT>(vec1[i]));
+      x += difference*difference;
+    }
+    return x;
+  }
+
+  template <typename T, typename U>
+  double DotProduct(const T* vec0, const U* vec1, const unsigned size) {
+  // Calculates and returns the dot product of the first "size" elements of
+  // "vec0" and "vec1".
+    typedef typename ComputeType<T>::type ComputeT;
+    double x(0);
+    for (unsigned i = 0; i < size; ++i)
+      x += static_cast<ComputeT>(vec0[i])*static_cast<ComputeT>(vec1[i]);
+    return x;
+  }
+
+  template <typename T, typename U>
+  double ManhattanDistance(const T* vec0, const U* vec1, const unsigned size) {
+  // Calculates and returns the Manhattan (L1) distance between the first "size"
+  // elements of "vec0" and "vec1".
+    typedef typename ComputeType<T>::type ComputeT;
+    double x(0);
+    for (unsigned i = 0; i < size; ++i)
+      x += std::fabs(static_cast<ComputeT>(vec0[i])-static_cast<ComputeT>(vec1[i]));
+    return x;
+  }
+
+  template <typename T, typename U>
+  double CosineSimilarity(const T* vec0, const U* vec1, const unsigned size) {
+  // Calculates and returns the cosine similarity of the first "size" elements
+  // of "vec0" and "vec1" (in a single pass over both vectors).
+    typedef typename ComputeType<T>::type ComputeT;
+    double dot_product(0), norm0(0), norm1(0);
+    for (unsigned i = 0; i < size; ++i) {
+      const ComputeT x(static_cast<ComputeT>(vec0[i])), y(static_cast<ComputeT>(vec1[i]));
+      dot_product += x*y;
+      norm0 += x*x;
+      norm1 += y*y;
+    }
+    return dot_product/(std::sqrt(norm0)*std::sqrt(norm1));
+  }
+
+  // Lazy vector expressions: "View()" refers to a std::vector, to the vector of
+  // a "WordVec" or to "size" elements at a pointer without copying them, and
+  // "+" and "-" (of two views/expressions or of one and a std::vector or a
+  // "WordVec*") as well as "*" and "/" (by a scalar) only build a tree of
+  // small nodes. The whole tree gets evaluated element by element in a single
+  // loop when it is converted to a std::vector (or passed to "Evaluate()",
+  // "Assign()", "DotProduct()", "EuclideanNorm()" or "CosineSimilarity()"),
+  // so "a-b+c" needs no temporary vectors. An expression of vectors with
+  // different sizes has got the size 0 (i.e. it evaluates to an empty vector).
+  // The views only point to the vectors: an expression referring to temporary
+  // vectors has to be evaluated in the statement it is built in.
+
+  template <typename E>
+  struct VecExpression {
+  // Base of all expressions ("E" being the expression itself).
+    const E& Self() const {
+      return static_cast<const E&>(*this);
+    }
+
+    template <typename U>
+    operator std::vector<U>() const {
+    // Evaluates the expression into a new vector.
+      const E& expression(Self());
+      std::vector<U> vec(expression.Size());
+      for (std::size_t i = 0; i < vec.size(); ++i)
+        vec[i] = static_cast<U>(expression[i]);
+      return vec;
+    }
+  };
+
+  template <typename T>
+  class VecView : public VecExpression<VecView<T>> {
+  // Refers to "size" contiguous elements of type "T".
+   public:
+    typedef T value_type;
+
+    VecView(const T* data, const std::size_t size) : data_(data), size_(size) {}
+
+    T operator[](const std::size_t i) const {
+      return data_[i];
+    }
+
+    std::size_t Size() const {
+      return size_;
+    }
+
+   private:
+    const T* data_;
+    std::size_t size_;
+  };
+
+  template <typename T>
+  VecView<T> View(const T* data, const std::size_t size) {
+    return VecView<T>(data, size);
+  }
+
+  template <typename T>
+  VecView<T> View(const std::vector<T>& vec) {
+    return VecView<T>(vec.data(), vec.size());
+  }
+
+  template <typename T>
+  VecView<T> View(const std::vector<T>&& vec) = delete; // the view would outlive the vector
+
+  inline VecView<double> View(const WordVec* wv) {
+    return View(wv->vec);
+  }
+
+  template <typename L, typename R, typename Operation>
+  class VecBinaryExpression : public VecExpression<VecBinaryExpression<L, R, Operation>> {
+  // Combines the elements of two expressions of the same size.
+   public:
+    typedef decltype(Operation()(std::declval<typename L::value_type>(), std::declval<typename R::value_type>())) value_type;
+
+    VecBinaryExpression(const L& left, const R& right) : left_(left), right_(right), size_((left.Size() == right.Size())? left.Size() : 0) {}
+
+    value_type operator[](const std::size_t i) const {
+      return Operation()(left_[i], right_[i]);
+    }
+
+    std::size_t Size() const {
+      return size_;
+    }
+
+   private:
+    const L left_; // the nodes are small, so they are copied (then no node refers to a temporary node)
+    const R right_;
+    std::size_t size_;
+  };
+
+  template <typename E, typename S, typename Operation>
+  class VecScalarExpression : public VecExpression<VecScalarExpression<E, S, Operation>> {
+  // Combines every element of an expression with a scalar.
+   public:
+    typedef decltype(Operation()(std::declval<typename E::value_type>(), std::declval<S>())) value_type;
+
+    VecScalarExpression(const E& expression, const S scalar) : expression_(expression), scalar_(scalar) {}
+
+    value_type operator[](const std::size_t i) const {
+      return Operation()(expression_[i], scalar_);
+    }
+
+    std::size_t Size() const {
+      return expression_.Size();
+    }
+
+   private:
+    const E expression_;
+    const S scalar_;
+  };
+
+  template <typename T>
+  class VecSumExpression : public VecExpression<VecSumExpression<T>> {
+  // Sum of any number of vectors (added up from the first to the last one).
+   public:
+    typedef T value_type;
+
+    explicit VecSumExpression(std::vector<VecView<T>> views) : views_(std::move(views)), size_((views_.empty())? 0 : views_[0].Size()) {
+      for (auto& view : views_) {
+        if (view.Size() != size_)
+          size_ = 0;
+      }
+    }
+
+    T operator[](const std::size_t i) const {
+      T x(views_[0][i]);
+      for (std::size_t j = 1; j < views_.size(); ++j)
+        x += views_[j][i];
+      return x;
+    }
+
+    std::size_t Size() const {
+      return size_;
+    }
+
+   private:
+    std::vector<VecView<T>> views_;
+    std::size_t size_;
+  };
+
+  template <typename T>
+  struct IsVecExpression : std::is_base_of<VecExpression<T>, T> {};
+
+  template <typename E>
+  const E& AsExpression(const VecExpression<E>& expression) {
+    return expression.Self();
+  }
+
+  template <typename T>
+  VecView<T> AsExpression(const std::vector<T>& vec) {
+    return View(vec);
+  }
+
+  inline VecView<double> AsExpression(const WordVec* wv) {
+    return View(wv);
+  }
+
+  template <typename L, typename R>
+  using VecOperands = std::enable_if_t<IsVecExpression<L>::value || IsVecExpression<R>::value, std::decay_t<decltype(AsExpression(std::declval<L>()))>>; // enables "+" and "-" if at least one operand is an expression
+
+  template <typename L, typename R, typename LeftExpression = VecOperands<L, R>>
+  VecBinaryExpression<LeftExpression, std::decay_t<decltype(AsExpression(std::declval<R>()))>, std::plus<>> operator+(const L& left, const R& right) {
+    return {AsExpression(left), AsExpression(right)};
+  }
+
+  template <typename L, typename R, typename LeftExpression = VecOperands<L, R>>
+  VecBinaryExpression<LeftExpression, std::decay_t<decltype(AsExpression(std::declval<R>()))>, std::minus<>> operator-(const L& left, const R& right) {
+    return {AsExpression(left), AsExpression(right)};
+  }
+
+  template <typename E, typename S, typename = std::enable_if_t<std::is_arithmetic<S>::value>>
+  VecScalarExpression<E, S, std::multiplies<>> operator*(const VecExpression<E>& expression, const S scalar) {
+    return {expression.Self(), scalar};
+  }
+
+  template <typename E, typename S, typename = std::enable_if_t<std::is_arithmetic<S>::value>>
+  VecScalarExpression<E, S, std::multiplies<>> operator*(const S scalar, const VecExpression<E>& expression) {
+    return {expression.Self(), scalar};
+  }
+
+  template <typename E, typename S, typename = std::enable_if_t<std::is_arithmetic<S>::value>>
+  VecScalarExpression<E, S, std::divides<>> operator/(const VecExpression<E>& expression, const S scalar) {
+    return {expression.Self(), scalar};
+  }
+
+  template <typename T>
+  VecSumExpression<T> Sum(const std::vector<std::vector<T>>& vecs) {
+  // Returns the (lazy) sum of all vectors in "vecs".
+    std::vector<VecView<T>> views;
+    views.reserve(vecs.size());
+    for (auto& vec : vecs)
+      views.push_back(View(vec));
+    return VecSumExpression<T>(std::move(views));
+  }
+
+  inline VecSumExpression<double> Sum(const std::list<WordVec*>& wvs) {
+  // Returns the (lazy) sum of the vectors of all "WordVec"s in "wvs".
+    std::vector<VecView<double>> views;
+    views.reserve(wvs.size());
+    for (auto wv : wvs)
+      views.push_back(View(wv));
+    return VecSumExpression<double>(std::move(views));
+  }
+
+  template <typename E>
+  std::vector<typename E::value_type> Evaluate(const VecExpression<E>& expression) {
+  // Evaluates "expression" into a new vector.
+    return expression;
+  }
+
+  template <typename T, typename E>
+  void Assign(std::vector<T>& vec, const VecExpression<E>& expression) {
+  // Evaluates "expression" into "vec" (reusing its memory); "vec" may be one
+  // of the vectors "expression" refers to, as long as its size doesn't change.
+    const E& x(expression.Self());
+    vec.resize(x.Size());
+    for (std::size_t i = 0; i < vec.size(); ++i)
+      vec[i] = static_cast<T>(x[i]);
+  }
+
+  template <typename E0, typename E1>
+  double DotProduct(const VecExpression<E0>& expression0, const VecExpression<E1>& expression1) {
+  // Calculates and returns the dot product of two expressions of the same size
+  // (without evaluating them into vectors first).
+    const E0& x(expression0.Self());
+    const E1& y(expression1.Self());
+    double dot_product(0);
+    if (x.Size() == y.Size()) {
+      for (std::size_t i = 0; i < x.Size(); ++i)
+        dot_product += static_cast<double>(x[i])*y[i];
+    }
+    return dot_product;
+  }
+
+  template <typename E>
+  double EuclideanNorm(const VecExpression<E>& expression) {
+  // Calculates and returns the Euclidean norm of an expression.
+    return std::sqrt(DotProduct(expression, expression));
+  }
+
+  template <typename E0, typename E1>
+  double CosineSimilarity(const VecExpression<E0>& expression0, const VecExpression<E1>& expression1) {
+  // Calculates and returns the cosine similarity of two expressions of the
+  // same size (in a single pass, every element of both being evaluated once).
+    const E0& x(expression0.Self());
+    const E1& y(expression1.Self());
+    double dot_product(0), norm0(0), norm1(0);
+    if (x.Size() == y.Size()) {
+      for (std::size_t i = 0; i < x.Size(); ++i) {
+        const double element0(x[i]), element1(y[i]);
+        dot_product += element0*element1;
+        norm0 += element0*element0;
+        norm1 += element1*element1;
+      }
+    }
+    return dot_product/(std::sqrt(norm0)*std::sqrt(norm1));
+  }
+
   template <typename T>
   double EuclideanNorm(const std::vector<T>& vec) {
   // Calculates and returns the Euclidean norm of "vec" (needed in order to
   // calculate the cosine similarity).
-    T x(0);
-    for (auto& element : vec)
-      x += std::pow(element, 2);
-    return std::sqrt(x);
+    return std::sqrt(DotProduct(vec.data(), vec.data(), vec.size()));
   }
 
   template <typename T>
-  double CosineSimilarity(const std::vector<T> vec0, const std::vector<T> vec1) {
+  double CosineSimilarity(const std::vector<T>& vec0, const std::vector<T>& vec1) {
   // Calculates and returns the cosine similarity of "vec0" and "vec1".
-    return (std::inner_product(vec0.begin(), vec0.end(), vec1.begin(), 0.)/(EuclideanNorm(vec0)*EuclideanNorm(vec1)));
+    return CosineSimilarity(vec0.data(), vec1.data(), vec0.size());
   }
 
   template <typename T>
@@ -70,12 +800,15 @@ namespace VecCalc {
   }
 
   template <typename T>
-  double EuclideanDistance(const std::vector<T> vec0, const std::vector<T> vec1) {
+  double EuclideanDistance(const std::vector<T>& vec0, const std::vector<T>& vec1) {
   // Calculates and returns the Euclidean distance between "vec0" and "vec1".
-    T x(0);
-    for (unsigned i = 0; i < vec0.size(); ++i)
-      x += std::pow((vec0[i]-vec1[i]), 2);
-    return std::sqrt(x);
+    return std::sqrt(SquaredEuclideanDistance(vec0.data(), vec1.data(), vec0.size()));
+  }
+
+  template <typename T>
+  double ManhattanDistance(const std::vector<T>& vec0, const std::vector<T>& vec1) {
+  // Calculates and returns the Manhattan distance between "vec0" and "vec1".
+    return ManhattanDistance(vec0.data(), vec1.data(), vec0.size());
   }
 
   template <typename T>
@@ -86,77 +819,58 @@ namespace VecCalc {
   }
 
   template <typename T>
-  std::vector<T> Add(std::vector<T> vec0, const std::vector<T> vec1) {
+  std::vector<T> Add(const std::vector<T>& vec0, const std::vector<T>& vec1) {
   // Adds two vectors and returns the resulting vector. If both vectors do not
   // got the same size an empty vector will be returned.
-    if (vec0.size() != vec1.size())
-      return std::vector<T>();
-    std::transform(vec0.begin(), vec0.end(), vec1.begin(), vec0.begin(), std::plus<T>());
-    return vec0;
+    return View(vec0)+View(vec1);
   }
 
   template <typename T>
   std::vector<T> Add(const WordVec* wv0, const WordVec* wv1) {
   // Adds two vectors and returns the resulting vector given the "WordVec"s.
-    return Add(wv0->vec, wv1->vec);
+    return View(wv0)+View(wv1);
   }
 
   template <typename T>
-  std::vector<T> Add(std::vector<std::vector<T>> vecs) {
+  std::vector<T> Add(const std::vector<std::vector<T>>& vecs) {
   // Adds all vectors stored in a std::vector ("vecs") and returns the resulting
   // vector. If the vectors do not got the same size an empty vector will be
   // returned.
-    const unsigned vec_size(vecs[0].size());
-    for (unsigned i = 1; i < vecs.size(); ++i) {
-      if (vecs[i].size() != vec_size)
-        return std::vector<T>();
-      for (unsigned j = 0; j < vec_size; ++j)
-        vecs[0][j] += vecs[i][j];
-    }
-    return vecs[0];
+    return Sum(vecs);
   }
 
-  std::vector<double> Add(const std::list<WordVec*> wvs);
+  std::vector<double> Add(const std::list<WordVec*>& wvs);
 
   template <typename T>
-  std::vector<T> Subtract(std::vector<T> minuend_vec, const std::vector<T> subtrahend_vec) {
+  std::vector<T> Subtract(const std::vector<T>& minuend_vec, const std::vector<T>& subtrahend_vec) {
   // Subtracts the second given vector from a first one and returns the
   // resulting vector. If both vectors do not got the same size an empty vector
   // will be returned.
-    if (minuend_vec.size() != subtrahend_vec.size())
-      return std::vector<T>();
-    std::transform(minuend_vec.begin(), minuend_vec.end(), subtrahend_vec.begin(), minuend_vec.begin(), std::minus<T>());
-    return minuend_vec;
+    return View(minuend_vec)-View(subtrahend_vec);
   }
 
   template <typename T>
   std::vector<T> Subtract(const WordVec* minuend_wv, const WordVec* subtrahend_wv) {
   // Given two "WordVec"s the second given vector will be subtracted from a
   // first one and returns the resulting vector.
-    return Subtract(minuend_wv->vec, subtrahend_wv->vec);
+    return View(minuend_wv)-View(subtrahend_wv);
   }
 
   template <typename T>
-  std::vector<T> GetAverageVec(std::vector<T> vec0, const std::vector<T> vec1) {
+  std::vector<T> GetAverageVec(const std::vector<T>& vec0, const std::vector<T>& vec1) {
   // Calculates an average vector of two vectors by adding the vectors and
   // dividing every element of the resulting vector by 2, then returns this
   // resulting vector.
-    vec0 = Add(vec0, vec1);
-    for (auto& element : vec0)
-      element /= 2;
-    return vec0;
+    return (View(vec0)+View(vec1))/T(2);
   }
 
   template <typename T>
-  std::vector<T> GetAverageVec(std::vector<std::vector<T>> vecs) {
+  std::vector<T> GetAverageVec(const std::vector<std::vector<T>>& vecs) {
   // Calculates an average vector of all vectors stored in "vecs" by adding these
   // vectors and dividing every element of the resulting vector by the number of
   // vectors in "vecs", then returns this resulting vector.
-    vecs[0] = Add(vecs);
     const unsigned num_of_vecs(vecs.size());
-    for (auto& element : vecs[0])
-      element /= num_of_vecs;
-    return vecs[0];
+    return Sum(vecs)/num_of_vecs;
   }
 
   template <typename T>
@@ -168,16 +882,13 @@ namespace VecCalc {
   }
 
   template <typename T>
-  std::vector<T> GetAverageVec(const std::list<WordVec*> wvs) {
+  std::vector<T> GetAverageVec(const std::list<WordVec*>& wvs) {
   // Calculates an average vector of the vectors of the given "WordVec"s stored
   // in "wvs" by adding these vectors and dividing every element of the resulting
   // vector by the numer of "WordVec"s in "wvs", then returns this resulting
   // vector.
-    std::vector<T> average_vec(Add(wvs));
     const unsigned num_of_vecs(wvs.size());
-    for (auto& element : average_vec)
-      element /= num_of_vecs;
-    return average_vec;
+    return Sum(wvs)/num_of_vecs;
   }
 };
 
@@ -188,13 +899,34 @@ typedef std::list<WordVec*> WordVecList;
 typedef std::list<std::pair<std::pair<std::string, std::string>, double>> WordPairList;
 
 class VecStore {
-// Class to store word vectors read from a file in a hash table on memory.
+// Class to store word vectors read from a file in a contiguous matrix on memory
+// (the words are found using an open addressing hash table).
  public:
-  VecStore(const std::string& file, const bool case_sensitive = true, const double percentage = 1.);
+  VecStore(const std::string& file, const bool case_sensitive = true, const double percentage = 1., const VecPrecision precision = VecPrecision::kDouble);
   ~VecStore();
 
   void PrintInfo();
 
+  bool Save(const std::string& file);
+
+  bool Quantize(const VecQuantization quantization = VecQuantization::kPerDimension, const unsigned rescoring_factor = 4);
+
+  double QuantizationError() const {
+  // Returns the relative error of the quantized vectors (0 if the "VecStore"
+  // isn't quantized).
+    return quantization_error_;
+  }
+
+  double QuantizedRecall(const unsigned k = 10, const unsigned num_of_queries = 100);
+
+  bool TrainProductQuantization(const unsigned num_of_subspaces = 0, const unsigned rescoring_factor = 4, const unsigned num_of_iterations = 10);
+
+  bool SaveProductQuantization(const std::string& file);
+
+  bool LoadProductQuantization(const std::string& file);
+
+  bool DropMatrix();
+
   double GetSimilarity(const std::vector<std::string>& words, std::string comparison_mode = "");
 
   std::vector<double> GetVec(std::string word);
@@ -217,83 +949,313 @@ class VecStore {
     return VecCalc::Subtract(GetVec(minuend_word), GetVec(subtrahend_word));
   }
 
-  WordVec* ClosestWordVec(std::string word) {
+  WordVec* ClosestWordVec(std::string word, const VecMetric metric = VecMetric::kEuclidean) {
     if (!case_sensitive_)
       word = SetToLowerCase(word);
-    return ClosestWordVec(GetVec(word), word);
+    return ClosestWordVec(GetVec(word), word, metric);
   }
 
-  WordVec* ClosestWordVec(WordVec* wv) {
+  WordVec* ClosestWordVec(WordVec* wv, const VecMetric metric = VecMetric::kEuclidean) {
     if ((int)wv->vec.size() == vec_size_)
-      return ClosestWordVec(wv->vec, ((!case_sensitive_)? SetToLowerCase(wv->word) : wv->word));
+      return ClosestWordVec(wv->vec, ((!case_sensitive_)? SetToLowerCase(wv->word) : wv->word), metric);
     return NULL;
   }
 
-  WordVec* ClosestWordVec(const std::vector<double>& vec, const std::string& word = "");
+  WordVec* ClosestWordVec(const std::vector<double>& vec, const VecMetric metric) {
+    return ClosestWordVec(vec, "", metric);
+  }
 
-  std::list<WordVec*> KClosestWordVecs(std::string word, const unsigned k = 3) {
+  WordVec* ClosestWordVec(const std::vector<double>& vec, const std::string& word = "", const VecMetric metric = VecMetric::kEuclidean);
+
+  std::list<WordVec*> KClosestWordVecs(std::string word, const unsigned k = 3, const VecMetric metric = VecMetric::kEuclidean) {
     if (!case_sensitive_)
       word = SetToLowerCase(word);
-    return KClosestWordVecs(GetVec(word), k, word);
+    return KClosestWordVecs(GetVec(word), k, word, metric);
   }
 
-  std::list<WordVec*> KClosestWordVecs(WordVec* wv, const unsigned k = 3) {
+  std::list<WordVec*> KClosestWordVecs(WordVec* wv, const unsigned k = 3, const VecMetric metric = VecMetric::kEuclidean) {
     if ((int)wv->vec.size() == vec_size_)
-      return KClosestWordVecs(wv->vec, k, ((!case_sensitive_)? SetToLowerCase(wv->word) : wv->word));
+      return KClosestWordVecs(wv->vec, k, ((!case_sensitive_)? SetToLowerCase(wv->word) : wv->word), metric);
     return std::list<WordVec*>();
   }
 
-  std::list<WordVec*> KClosestWordVecs(const std::vector<double>& vec, const unsigned k = 3, const std::string& word = "");
+  std::list<WordVec*> KClosestWordVecs(const std::vector<double>& vec, const unsigned k, const VecMetric metric) {
+    return KClosestWordVecs(vec, k, "", metric);
+  }
+
+  std::list<WordVec*> KClosestWordVecs(const std::vector<double>& vec, const unsigned k = 3, const std::string& word = "", const VecMetric metric = VecMetric::kEuclidean);
 
-  WordVec* MostDistantWordVec(std::string word) {
+  WordVec* MostDistantWordVec(std::string word, const VecMetric metric = VecMetric::kEuclidean) {
     if (!case_sensitive_)
       word = SetToLowerCase(word);
-    return MostDistantWordVec(GetVec(word), word);
+    return MostDistantWordVec(GetVec(word), word, metric);
   }
 
-  WordVec* MostDistantWordVec(WordVec* wv) {
+  WordVec* MostDistantWordVec(WordVec* wv, const VecMetric metric = VecMetric::kEuclidean) {
     if ((int)wv->vec.size() == vec_size_)
-      return MostDistantWordVec(wv->vec, ((!case_sensitive_)? SetToLowerCase(wv->word) : wv->word));
+      return MostDistantWordVec(wv->vec, ((!case_sensitive_)? SetToLowerCase(wv->word) : wv->word), metric);
     return NULL;
   }
 
-  WordVec* MostDistantWordVec(const std::vector<double>& vec, const std::string& word = "");
+  WordVec* MostDistantWordVec(const std::vector<double>& vec, const VecMetric metric) {
+    return MostDistantWordVec(vec, "", metric);
+  }
+
+  WordVec* MostDistantWordVec(const std::vector<double>& vec, const std::string& word = "", const VecMetric metric = VecMetric::kEuclidean);
 
-  std::list<WordVec*> KMostDistantWordVecs(std::string word, const unsigned k = 3) {
+  std::list<WordVec*> KMostDistantWordVecs(std::string word, const unsigned k = 3, const VecMetric metric = VecMetric::kEuclidean) {
   // Returns the k most distant WordVecs to a given word (if there is a vector
   // corresponding to this word stored).
     if (!case_sensitive_)
       word = SetToLowerCase(word);
-    return SearchForMostDistantWordVecs(word, {}, k);
+    return SearchForMostDistantWordVecs(word, {}, k, metric);
   }
 
-  std::list<WordVec*> KMostDistantWordVecs(WordVec* wv, const unsigned k = 3) {
+  std::list<WordVec*> KMostDistantWordVecs(WordVec* wv, const unsigned k = 3, const VecMetric metric = VecMetric::kEuclidean) {
     if ((int)wv->vec.size() == vec_size_)
-      return SearchForMostDistantWordVecs(((!case_sensitive_)? SetToLowerCase(wv->word) : wv->word), wv->vec, k);
+      return SearchForMostDistantWordVecs(((!case_sensitive_)? SetToLowerCase(wv->word) : wv->word), wv->vec, k, metric);
     return std::list<WordVec*>();
   }
 
-  std::list<WordVec*> KMostDistantWordVecs(const std::vector<double>& vec, const unsigned k = 3) {
+  std::list<WordVec*> KMostDistantWordVecs(const std::vector<double>& vec, const unsigned k = 3, const VecMetric metric = VecMetric::kEuclidean) {
   // Returns the k most distant WordVecs to a given vector.
-    return SearchForMostDistantWordVecs("", vec, k);
+    return SearchForMostDistantWordVecs("", vec, k, metric);
+  }
+
+  std::vector<std::list<WordVec*>> KClosestWordVecsBatch(const std::vector<std::vector<double>>& queries, const unsigned k = 3, const VecMetric metric = VecMetric::kEuclidean);
+
+  std::list<WordVec*> Analogy(const std::string& a, const std::string& b, const std::string& c, const unsigned k = 1, const VecAnalogy method = VecAnalogy::k3CosAdd) {
+  // Returns the k WordVecs answering "a is to b as c is to ?" best (see
+  // "AnalogyBatch()").
+    return AnalogyBatch({{a, b, c}}, k, method).front();
+  }
+
+  std::vector<std::list<WordVec*>> AnalogyBatch(const std::vector<std::array<std::string, 3>>& questions, const unsigned k = 1, const VecAnalogy method = VecAnalogy::k3CosAdd);
+
+  bool Normalize(const bool in_place = false);
+
+  bool BuildHnswIndex(const VecMetric metric = VecMetric::kEuclidean, const unsigned m = 16, const unsigned ef_construction = 200);
+
+  bool SaveHnswIndex(const std::string& file);
+
+  bool LoadHnswIndex(const std::string& file);
+
+  std::list<WordVec*> HnswKClosestWordVecs(std::string word, const unsigned k = 3, const unsigned ef = 0) {
+  // Returns the (approximated) k closest WordVecs to a given word (if there is
+  // a vector corresponding to this word stored) found by the HNSW graph.
+    if (!case_sensitive_)
+      word = SetToLowerCase(word);
+    return HnswKClosestWordVecs(GetVec(word), k, ef, word);
+  }
+
+  std::list<WordVec*> HnswKClosestWordVecs(WordVec* wv, const unsigned k = 3, const unsigned ef = 0) {
+    if ((int)wv->vec.size() == vec_size_)
+      return HnswKClosestWordVecs(wv->vec, k, ef, ((!case_sensitive_)? SetToLowerCase(wv->word) : wv->word));
+    return std::list<WordVec*>();
+  }
+
+  std::list<WordVec*> HnswKClosestWordVecs(const std::vector<double>& vec, const unsigned k = 3, const unsigned ef = 0, const std::string& word = "");
+
+  double HnswRecall(const unsigned k = 10, const unsigned ef = 0, const unsigned num_of_queries = 100);
+
+  bool BuildIvfIndex(const VecMetric metric = VecMetric::kEuclidean, const unsigned num_of_lists = 0, const unsigned num_of_iterations = 10);
+
+  void SetIvfProbes(const unsigned num_of_probes);
+
+  double IvfRecall(const unsigned k = 10, const unsigned num_of_queries = 100);
+
+  bool SaveIvfIndex(const std::string& file);
+
+  bool LoadIvfIndex(const std::string& file);
+
+  bool BuildLshIndex(const unsigned num_of_tables = 8, const unsigned num_of_bits = 16);
+
+  std::list<WordVec*> LshKClosestWordVecs(std::string word, const unsigned k = 3, const unsigned max_hamming_distance = 1) {
+  // Returns the (approximated) k closest WordVecs (with regard to the cosine
+  // similarity) to a given word (if there is a vector corresponding to this
+  // word stored) found by the LSH index.
+    if (!case_sensitive_)
+      word = SetToLowerCase(word);
+    return LshKClosestWordVecs(GetVec(word), k, max_hamming_distance, word);
   }
 
+  std::list<WordVec*> LshKClosestWordVecs(WordVec* wv, const unsigned k = 3, const unsigned max_hamming_distance = 1) {
+    if ((int)wv->vec.size() == vec_size_)
+      return LshKClosestWordVecs(wv->vec, k, max_hamming_distance, ((!case_sensitive_)? SetToLowerCase(wv->word) : wv->word));
+    return std::list<WordVec*>();
+  }
+
+  std::list<WordVec*> LshKClosestWordVecs(const std::vector<double>& vec, const unsigned k = 3, const unsigned max_hamming_distance = 1, const std::string& word = "");
+
+  double LshRecall(const unsigned k = 10, const unsigned max_hamming_distance = 1, const unsigned num_of_queries = 100);
+
+  void SetPrunedSearch(const bool pruned_search);
+
+  void SetNumThreads(const unsigned num_of_threads);
+
+  void SetThreadPool(const std::shared_ptr<ThreadPool>& thread_pool);
+
   static std::string SetToLowerCase(std::string& string);
 
  private:
-  struct CloseWordVec {
-    WordVec* word_vec;
+  struct CloseWordVec { // row found by a search (selected by a "TopK")
     double distance;
-    CloseWordVec(WordVec* wv, const double dist) : word_vec(wv), distance(dist) {}
+    int row;
+    bool operator<(const CloseWordVec& other) const {
+    // Orders by the distance; rows at the same distance are ordered by their
+    // index, so the results don't depend on the order of the scan.
+      return (distance < other.distance || (distance == other.distance && row < other.row));
+    }
+  };
+  struct IndexSlot { // slot of the hash table
+    uint32_t fingerprint; // upper half of the hash of the word (so most other words can be skipped without comparing them)
+    uint32_t row; // "kEmptySlot" if the slot is empty
   };
-  std::vector<WordVec*> hash_table_;
+  static const uint32_t kEmptySlot = 0xffffffff;
+  struct VisitedRows { // marks the rows a graph search has visited (cleared in constant time)
+    std::vector<uint32_t> marks;
+    uint32_t mark;
+    explicit VisitedRows(const int vec_num) : marks(vec_num, 0), mark(0) {}
+    void Clear() {
+      if (++mark == 0) {
+        std::fill(marks.begin(), marks.end(), 0);
+        mark = 1;
+      }
+    }
+    bool Visit(const int row) {
+    // Marks "row" as visited and returns "false" if it already was.
+      if (marks[row] == mark)
+        return false;
+      marks[row] = mark;
+      return true;
+    }
+  };
+  template <typename T>
+  struct HnswBuffers { // rows prepared as queries by one thread while the HNSW graph is built (reused by all of its insertions)
+    std::vector<typename ComputeType<T>::type> query, neighbor_query, selected_queries;
+    explicit HnswBuffers(const int vec_size) : query(vec_size), neighbor_query(vec_size) {}
+  };
+  static const std::size_t kBatchBlockBytes = 1 << 17; // size of the blocks of rows compared with a block of queries (fits into the L2 cache)
+  static const std::size_t kBatchQueries = 32; // number of queries compared with a block of rows
+  static const unsigned kAbandonBlockSize = 64; // number of elements added to a partial distance before it is compared with the threshold
+  // The vectors are stored as one contiguous matrix, the words in a separate
+  // pool; both (as well as the hash table) either live in the "owned_"
+  // containers or in the mapped pages of a snapshot file.
+  std::unique_ptr<MappedFile> snapshot_;
+  AlignedArray<unsigned char> owned_matrix_;
+  std::vector<char> owned_word_pool_;
+  std::vector<uint64_t> owned_word_offsets_;
+  std::vector<IndexSlot> owned_index_slots_;
+  const unsigned char* matrix_; // row "r" starts at "matrix_+r*row_bytes_" (each row is aligned to 64 bytes)
+  const char* word_pool_;
+  const uint64_t* word_offsets_; // the word of row "r" is stored in "word_pool_" from "word_offsets_[r]" to "word_offsets_[r+1]"
+  const IndexSlot* index_slots_; // "hash_table_size_" (a power of two) slots; a word is searched from slot "hash%hash_table_size_" on (linear probing)
+  std::vector<std::unique_ptr<WordVec>> word_vecs_; // "WordVec"s handed out by the "VecStore" (created on demand)
+  std::size_t row_bytes_;
+  std::vector<double> owned_norms_;
+  const double* norms_; // Euclidean norms of the rows
+  AlignedArray<unsigned char> normalized_matrix_; // copy of the matrix with all rows divided by their norms (only if "Normalize()" made it)
+  bool normalized_; // "true" if the rows of the matrix itself have got a Euclidean norm of 1 (or 0)
+  // The quantized rows (only used if "quantization_" isn't "kNone"): element
+  // "d" of row "r" is approximated by "code_offsets_[i]+code_scales_[i]*c" with
+  // "c" = "codes_[r*code_bytes_+d]" and "i" = "d" (per dimension) or "r" (per
+  // vector).
+  AlignedArray<int8_t> codes_;
+  std::vector<float> code_scales_, code_offsets_;
+  std::vector<double> code_norms_; // squared Euclidean norms of the approximated rows
+  std::size_t code_bytes_;
+  VecQuantization quantization_;
+  unsigned rescoring_factor_; // "rescoring_factor_*k" candidates found on the codes get rescored on the matrix (0 = no rescoring)
+  double quantization_error_;
+  // The product quantization (only used if "quantization_" is "kProduct"):
+  // dimension "d" of subspace "m" ("pq_subspace_offsets_[m]" <= "d" <
+  // "pq_subspace_offsets_[m+1]") of row "r" is approximated by the centroid
+  // "c" = "pq_codes_[r*M+m]" of this subspace, which is stored in
+  // "pq_centroids_" from "pq_num_of_centroids_*pq_subspace_offsets_[m]+c*size"
+  // on ("size" being the number of dimensions of the subspace).
+  std::vector<uint8_t> pq_codes_;
+  std::vector<float> pq_centroids_;
+  std::vector<int> pq_subspace_offsets_;
+  unsigned pq_num_of_centroids_;
+  // HNSW graph built by "BuildHnswIndex()": every row is a node on layer 0 and
+  // on the "hnsw_levels_[row]" layers above. The links of a node on layer 0
+  // (up to 2*"hnsw_m_") are stored in "hnsw_links_", the ones on the upper
+  // layers (up to "hnsw_m_" per layer) in "hnsw_upper_links_[row]"; every list
+  // of links starts with its length.
+  std::vector<uint32_t> hnsw_links_;
+  std::vector<std::vector<uint32_t>> hnsw_upper_links_;
+  std::vector<uint8_t> hnsw_levels_;
+  unsigned hnsw_m_, hnsw_ef_construction_;
+  int hnsw_entry_point_, hnsw_max_level_; // -1 if there is no graph
+  VecMetric hnsw_metric_;
+  // Inverted file built by "BuildIvfIndex()": the rows are clustered around
+  // "ivf_num_of_lists_" centroids ("vec_size_" floats each) and the rows of
+  // list l are "ivf_rows_[ivf_list_offsets_[l]]" to
+  // "ivf_rows_[ivf_list_offsets_[l+1]-1]" (in ascending order). The vectors
+  // of these rows are copied into "ivf_matrix_" in the same order (normalized
+  // for "VecMetric::kCosine"), so every list is read contiguously.
+  std::vector<float> ivf_centroids_;
+  std::vector<uint32_t> ivf_rows_;
+  AlignedArray<unsigned char> ivf_matrix_;
+  std::vector<uint64_t> ivf_list_offsets_;
+  unsigned ivf_num_of_lists_; // 0 if there is no inverted file
+  unsigned ivf_num_of_probes_; // number of lists searched (0: the default)
+  VecMetric ivf_metric_;
+  // Random hyperplane LSH index built by "BuildLshIndex()": every row gets one
+  // signature of "lsh_num_of_bits_" bits per table (bit i being set if the
+  // dot product of the row with hyperplane i of the table is positive).
+  // "lsh_signatures_" holds the "lsh_num_of_tables_" signatures of every row
+  // next to each other and "lsh_table_rows_" the rows of every table sorted by
+  // their signatures in this table (so the rows of a bucket are neighbors).
+  std::vector<float> lsh_hyperplanes_;
+  std::vector<uint64_t> lsh_signatures_;
+  std::vector<uint32_t> lsh_table_rows_;
+  unsigned lsh_num_of_tables_, lsh_num_of_bits_; // 0 tables if there is no LSH index
+  // Rows sorted by their Euclidean norms (only if "pruned_search_" is "true"):
+  // "sorted_norms_[i]" is the norm of row "rows_by_norm_[i]", whose vector is
+  // copied to row i of "sorted_matrix_" (so the rows visited by a pruned
+  // search are read contiguously).
+  bool pruned_search_;
+  std::vector<uint32_t> rows_by_norm_;
+  std::vector<double> sorted_norms_;
+  AlignedArray<unsigned char> sorted_matrix_;
   const std::string input_file_;
-  const int vec_size_, vec_num_, hash_table_size_;
-  const bool case_sensitive_; // if "false" all chars of all "words" ("std::string"s) will be set to lower case
+  int vec_size_, vec_num_, hash_table_size_; // set once by the constructor
+  bool case_sensitive_; // if "false" all chars of all "words" ("std::string"s) will be set to lower case
+  VecPrecision precision_; // element type of the matrix
+  unsigned num_of_threads_; // number of threads a scan is split over (0: one per core)
+  std::shared_ptr<ThreadPool> thread_pool_; // created on demand unless set by "SetThreadPool()"
+  std::mutex thread_pool_mutex_, word_vecs_mutex_, hnsw_visited_rows_mutex_;
+  std::vector<std::unique_ptr<VisitedRows>> hnsw_visited_rows_; // reused by the searches of the HNSW graph
+  static const std::size_t kMinBytesPerTask = 1 << 20; // scanning less than 1 MiB isn't worth another thread
 
-  const int GetSizeOfVectors();
+  template <typename T>
+  const T* Row(const int row) const {
+    return reinterpret_cast<const T*>(matrix_+row*row_bytes_);
+  }
+
+  template <typename T>
+  const T* NormalizedRow(const int row) const {
+    return reinterpret_cast<const T*>(normalized_matrix_.Data()+row*row_bytes_);
+  }
+
+  const int8_t* Code(const int row) const {
+    return codes_.Data()+row*code_bytes_;
+  }
 
-  const int CountVectors();
+  std::vector<double> GetRowVec(const int row) const;
+
+  std::string_view Word(const int row) const {
+    return std::string_view(word_pool_+word_offsets_[row], word_offsets_[row+1]-word_offsets_[row]);
+  }
+
+  int FindRow(const std::string& word);
+
+  WordVec* GetWordVec(const int row);
+
+  void SetSizes(const int vec_size, const int vec_num, const int hash_table_size);
+
+  bool LoadSnapshot();
 
   bool HashTableIsValid() {
   // Returns "false" if no or only empty vectors were found and "true"
@@ -301,28 +1263,176 @@ class VecStore {
     return (vec_size_ >= 1 && vec_num_ >= 1);
   }
 
-  void ReadVectorFile();
+  void StoreVectors(VecFileContents& contents);
+
+  static uint64_t HashWord(const std::string_view word); // hash function
+
+  static int GetHashTableSize(const int vec_num);
+
+  unsigned GetProbeLength(const int row);
+
+  std::list<WordVec*> SearchForMostDistantWordVecs(const std::string& word, std::vector<double> vec, const unsigned k, const VecMetric metric);
+
+  std::list<WordVec*> SearchWordVecs(const std::vector<double>& vec, const unsigned k, const int excluded_row, const bool most_distant, const VecMetric metric);
+
+  std::vector<CloseWordVec> SearchRows(const std::vector<double>& vec, const unsigned k, const int excluded_row, const bool most_distant, const VecMetric metric, const bool exact = false);
+
+  std::vector<double> PrepareQuery(const std::vector<double>& vec, const VecMetric metric) const;
+
+  template <typename T>
+  double RowDistance(const typename ComputeType<T>::type* query, const int row, const VecMetric metric) const {
+  // Returns the distance between a query prepared by "PrepareQuery()" and "row"
+  // with regard to "metric": the squared Euclidean distance, the negated dot
+  // product or the negated cosine similarity (so the closest row always has got
+  // the smallest distance).
+    switch (metric) {
+      case VecMetric::kCosine:
+        if (normalized_)
+          return -VecCalc::DotProduct(query, Row<T>(row), vec_size_);
+        if (normalized_matrix_.Size() > 0)
+          return -VecCalc::DotProduct(query, NormalizedRow<T>(row), vec_size_);
+        return CosineDistance(VecCalc::DotProduct(query, Row<T>(row), vec_size_), row);
+      case VecMetric::kInnerProduct:
+        return -VecCalc::DotProduct(query, Row<T>(row), vec_size_);
+      default:
+        return VecCalc::SquaredEuclideanDistance(query, Row<T>(row), vec_size_);
+    }
+  }
+
+  template <typename T>
+  std::vector<typename ComputeType<T>::type> HnswQuery(const std::vector<double>& vec) const;
+
+  template <typename T>
+  const typename ComputeType<T>::type* HnswRowQuery(const int row, typename ComputeType<T>::type* query) const;
+
+  void CopyHnswLinks(const int row, const int level, std::vector<std::mutex>* node_locks, std::vector<uint32_t>& links);
+
+  uint32_t* HnswLinks(const int row, const int level) {
+  // Returns the links of "row" on "level" of the HNSW graph (the first element
+  // is the number of links).
+    return (level == 0)? hnsw_links_.data()+(std::size_t)row*(2*hnsw_m_+1) : hnsw_upper_links_[row].data()+(std::size_t)(level-1)*(hnsw_m_+1);
+  }
+
+  template <typename T>
+  CloseWordVec SearchHnswLayerGreedily(const typename ComputeType<T>::type* query, CloseWordVec closest, const int level, std::vector<std::mutex>* node_locks);
+
+  template <typename T>
+  std::vector<CloseWordVec> SearchHnswLayer(const typename ComputeType<T>::type* query, const std::vector<CloseWordVec>& entry_points, const unsigned ef, const int level, VisitedRows& visited_rows, std::vector<std::mutex>* node_locks);
+
+  template <typename T>
+  std::vector<uint32_t> SelectHnswNeighbors(const std::vector<CloseWordVec>& candidates, const unsigned m, std::vector<typename ComputeType<T>::type>& selected_queries) const;
+
+  template <typename T>
+  void InsertHnswNode(const int row, std::vector<std::mutex>& node_locks, std::mutex& entry_point_lock, VisitedRows& visited_rows, HnswBuffers<T>& buffers);
+
+  template <typename T>
+  std::vector<CloseWordVec> SearchHnswGraph(const std::vector<double>& vec, const unsigned k, const unsigned ef, const int excluded_row);
+
+  std::unique_ptr<VisitedRows> AcquireVisitedRows();
+
+  void ReleaseVisitedRows(std::unique_ptr<VisitedRows> visited_rows);
+
+  void ClearHnswIndex();
+
+  std::vector<float> IvfPoint(const int row) const;
+
+  void AssignToIvfLists(const int first_row, std::vector<uint32_t>& lists);
+
+  void StoreIvfLists(const std::vector<uint32_t>& lists);
+
+  std::vector<CloseWordVec> NearestIvfLists(const std::vector<double>& vec, const unsigned num_of_lists) const;
+
+  template <typename T>
+  std::vector<CloseWordVec> ScanIvfLists(const std::vector<double>& vec, const unsigned k, const int excluded_row);
+
+  void ClearIvfIndex();
+
+  void ComputeLshSignature(const std::vector<double>& vec, uint64_t* signature) const;
+
+  std::vector<uint32_t> LshCandidates(const std::vector<double>& vec, const unsigned max_hamming_distance);
+
+  template <typename T>
+  std::vector<CloseWordVec> SearchLshCandidates(const std::vector<double>& vec, const unsigned k, const unsigned max_hamming_distance, const int excluded_row);
+
+  void ClearLshIndex();
+
+  unsigned NumOfTasks(const std::size_t bytes_per_row, const int num_of_rows);
+
+  unsigned NumOfTasks(const std::size_t bytes_per_row) {
+  // Returns the number of ranges a scan of all rows of the matrix gets split
+  // into.
+    return NumOfTasks(bytes_per_row, vec_num_);
+  }
+
+  void ForEachRange(const unsigned num_of_tasks, const int num_of_rows, const std::function<void(const unsigned, const int, const int)>& scan_range);
+
+  void ForEachRowRange(const unsigned num_of_tasks, const std::function<void(const unsigned, const int, const int)>& scan_range) {
+  // Splits all rows of the matrix into "num_of_tasks" ranges (see
+  // "ForEachRange()").
+    ForEachRange(num_of_tasks, vec_num_, scan_range);
+  }
+
+  template <typename ScanRange>
+  std::vector<CloseWordVec> ScanInParallel(const unsigned k, const std::size_t bytes_per_row, const ScanRange& scan_range);
+
+  template <typename T>
+  std::vector<CloseWordVec> ScanRows(const std::vector<double>& vec, const unsigned k, const int excluded_row, const bool most_distant, const VecMetric metric);
+
+  template <typename T>
+  bool DistanceExceeds(const typename ComputeType<T>::type* query, const T* row_vec, const double threshold) const;
+
+  template <typename T>
+  std::vector<CloseWordVec> ScanRowsPruned(const std::vector<double>& vec, const unsigned k, const int excluded_row, const bool most_distant);
+
+  void SortRowsByNorm();
+
+  template <typename T>
+  std::vector<std::vector<CloseWordVec>> ScanRowsBatch(const std::vector<std::vector<double>>& queries, const unsigned k, const VecMetric metric);
+
+  template <typename T>
+  std::vector<std::vector<CloseWordVec>> ScanAnalogies(const std::vector<std::array<int, 3>>& questions, const unsigned k, const VecAnalogy method);
+
+  template <typename T>
+  std::vector<CloseWordVec> ScanQuantizedRows(const std::vector<double>& vec, const unsigned k, const int excluded_row, const bool most_distant, const VecMetric metric);
+
+  template <typename T>
+  std::vector<CloseWordVec> ScanProductCodes(const std::vector<double>& vec, const unsigned k, const int excluded_row, const bool most_distant, const VecMetric metric);
+
+  template <typename T>
+  std::vector<CloseWordVec> RescoreRows(const std::vector<double>& vec, std::vector<CloseWordVec>& candidates, const unsigned k, const bool most_distant, const VecMetric metric);
+
+  double CosineDistance(const double dot_product, const int row) const {
+  // Returns the negated cosine similarity of a vector (with a Euclidean norm
+  // of 1) and "row" given their dot product (0 if the norm of "row" is 0).
+    return (norms_[row] > 0)? -dot_product/norms_[row] : 0;
+  }
+
+  void ComputeNorms();
 
-  void StoreVectors(const std::string& line);
+  unsigned NumOfCandidates(const unsigned k) const {
+  // Returns the number of candidates that have to be found on the codes.
+    return (rescoring_factor_ > 0)? std::max(k, k*rescoring_factor_) : k;
+  }
+
+  void ClearQuantization();
 
-  unsigned GetIndex(const std::string& key); // hash function
+  bool MatrixIsDropped(const std::string& function);
 
-  std::vector<std::string> SplitLine(const std::string& line);
+  uint64_t HashWords(const int num_of_rows) const;
 
-  unsigned GetNumOfWordVecs(const unsigned index);
+  std::vector<float> KMeans(const std::vector<float>& points, const int dim, const unsigned k, const unsigned num_of_iterations);
 
-  std::list<WordVec*> SearchForMostDistantWordVecs(const std::string& word, std::vector<double> vec, const unsigned k);
+  static unsigned NearestCentroid(const float* point, const float* centroids, const int dim, const unsigned k);
 
-  void DeleteList(std::list<CloseWordVec*>& list);
+  std::list<WordVec*> GetWordVecs(const std::vector<CloseWordVec>& closest);
 };
 
 class VecSimTable { // (word) vector similarity table
 // Class to store word vectors read from a file in a vector on memory as well
 // as their similarities that get calculated.
  public:
-  VecSimTable(const std::string& file, const std::regex& pattern);
-  VecSimTable(const std::string& file, const bool case_sensitive = true, const double percentage = 0.1);
-  ~VecSimTable();
+  VecSimTable(const std::string& file, const std::regex& pattern, const VecPrecision precision = VecPrecision::kDouble, const VecSimMeasures measures = VecSimMeasures::kAll);
+  VecSimTable(const std::string& file, const bool case_sensitive = true, const double percentage = 0.1, const VecPrecision precision = VecPrecision::kDouble, const VecSimMeasures measures = VecSimMeasures::kAll);
 
   void PrintInfo();
 
@@ -358,57 +1468,228 @@ class VecSimTable { // (word) vector similarity table
 
   std::list<std::pair<std::pair<std::string, std::string>, double>> MostSimilarPairs(const double similarity, std::string comparison_mode, const unsigned k = 3);
 
+  void SetPairCacheSize(const std::size_t num_of_pairs);
+
+  bool BuildValueIndex();
+
+  void ClearValueIndex();
+
+  bool BuildDiskTable(const std::string& file, const VecPrecision precision = VecPrecision::kFloat, const VecSimMeasures measures = VecSimMeasures::kAll);
+
+  void CloseDiskTable();
+
  private:
-  struct SimMeasures {
-    const double cos_sim;
-    const double eucl_dist;
-    SimMeasures(const double cos, const double eucl) : cos_sim(cos), eucl_dist(eucl) {}
+  friend class VecSimTableTest; // checks the packed pair indices (see "tests/vec_sim_table_test.cc")
+  struct SimilarPair { // pair found by "FindMostSimilarPairs()" (selected by a "TopK")
+    double difference; // difference of its value to the value of interest
+    std::size_t index; // index in the similarity table
+    double value;
+    bool operator<(const SimilarPair& other) const {
+    // Orders by the difference; pairs with the same difference are ordered by
+    // their index, so the results don't depend on the order of the scan.
+      return (difference < other.difference || (difference == other.difference && index < other.index));
+    }
   };
+
   const int vec_size_;
   const bool case_sensitive_; // if "false" all chars of all "words" ("std::string"s) will be set to lower case
+  const VecPrecision precision_; // element type of "matrix_"
+  const VecSimMeasures measures_; // measures stored in the planes of the similarity table
   int vec_num_;
-  std::vector<WordVec*> word_vecs_;
-  std::vector<std::vector<SimMeasures*>> sim_table_; // "sim_table_" will be shaped like a triangle
+  const std::size_t row_bytes_;
+  std::vector<std::string> words_; // sorted
+  AlignedArray<unsigned char> matrix_; // the vector of "words_[i]" starts at "matrix_[i*row_bytes_]"
+  // The similarity table is the packed upper triangle of the matrix of all
+  // word pairs: the pair ("words_[i]", "words_[j]") with i < j is stored at
+  // "PairIndex(i, j)", so the pairs of "words_[i]" with all following words
+  // are contiguous. Every measure has got its own plane (which is empty if the
+  // measure isn't stored).
+  AlignedArray<double> cos_sims_, eucl_dists_;
+  AlignedArray<double> squared_norms_; // squared norm of the vector of "words_[i]" at "squared_norms_[i]"
+  PairCache pair_cache_; // dot products of the pairs calculated on demand (keyed by "PairIndex()")
+  // The value index holds the indices of the pairs of a plane sorted by their
+  // values (empty if not built): as 32 bit values unless the table has got
+  // 2^32 pairs or more (then the "wide_" vectors are used).
+  std::vector<uint32_t> sorted_cos_sims_, sorted_eucl_dists_;
+  std::vector<uint64_t> wide_sorted_cos_sims_, wide_sorted_eucl_dists_;
+  std::unique_ptr<MappedFile> disk_table_; // mapping of the disk table (see "BuildDiskTable()"); NULL if there is none
+  std::string disk_table_file_;
+  VecPrecision disk_precision_; // type of the values of the disk table
+  int disk_num_of_tile_rows_; // number of tiles per row (and column) of the disk table
+  const char* disk_cos_sims_; // planes of the disk table (NULL if not stored)
+  const char* disk_eucl_dists_;
+
+  static const std::size_t kTileBytes = 1 << 16; // size of the blocks of rows a tile of the table is calculated from (the rows of two tiles fit into the L2 cache)
+  static const std::size_t kPairCacheSize = 1 << 20; // default number of pairs cached if not all measures are stored (about 17 MiB)
+  static const std::size_t kMinPairsPerSortRange = 1 << 16; // sorting fewer pairs isn't worth another thread
+  static const std::size_t kPairsPerBucket = 256; // average number of pairs per bucket of the value index sort
+  static const std::size_t kMaxPairsPerBucketBuffer = 1 << 20; // larger buckets are sorted in place
+  static const int kDiskTileRows = 256; // rows of a tile of a disk table (a tile of 4 byte values has got 256 KiB)
+
+  VecSimTable(VecFileContents&& contents, const bool case_sensitive, const VecPrecision precision, const VecSimMeasures measures);
+
+  void StoreWordVecs(VecFileContents& contents);
+
+  template <typename T>
+  const T* Row(const int i) const {
+    return reinterpret_cast<const T*>(matrix_.Data()+i*row_bytes_);
+  }
+
+  void CalculateSimilarities();
 
-  const int GetSizeOfVectors(const std::string& file);
+  int TileRows() const {
+  // Returns the number of rows of a tile (see "ForEachPair()").
+    return (int)std::max<std::size_t>(1, kTileBytes/std::max<std::size_t>(1, row_bytes_));
+  }
 
-  void StoreWordVecs(const std::string& file, const bool case_sensitive, const double percentage);
+  unsigned NumOfTileTasks() const {
+  // Returns the number of tasks "ForEachPair()" splits the table into.
+    return ((vec_num_+TileRows()-1)/TileRows()+1)/2;
+  }
 
-  static bool SortIt(WordVec* wv0, WordVec* wv1) {
-    return (wv0->word < wv1->word);
+  template <typename T, typename PairFunction>
+  void ForEachPair(const PairFunction& pair_function);
+
+  template <typename T, typename PairFunction>
+  void ForEachPairOfTile(const int first_row, const int last_row, const int first_col, const int last_col, std::vector<typename ComputeType<T>::type>& rows, std::vector<typename ComputeType<T>::type>& cols, const PairFunction& pair_function) const {
+  // Calls "pair_function(i, j, dot_product)" for every pair of a row i
+  // ("first_row" <= i < "last_row") and a column j ("first_col" <= j <
+  // "last_col") with i < j. Rows of half precision types are converted (into
+  // "rows" and "cols") first, so the SIMD kernels can be used.
+    typedef typename ComputeType<T>::type ComputeT;
+    const std::size_t row_size((std::is_same<T, ComputeT>::value)? row_bytes_/sizeof(ComputeT) : vec_size_);
+    const ComputeT* row_vecs(ComputeRows<T>(first_row, last_row, rows));
+    const ComputeT* col_vecs(ComputeRows<T>(first_col, last_col, cols));
+    for (int i = first_row; i < last_row; ++i) {
+      const ComputeT* vec(row_vecs+(i-first_row)*row_size);
+      for (int j = std::max(i+1, first_col); j < last_col; ++j)
+        pair_function(i, j, VecCalc::DotProduct(vec, col_vecs+(j-first_col)*row_size, vec_size_));
+    }
   }
 
-  const int CountVectors(const std::string& file);
+  template <typename T>
+  const typename ComputeType<T>::type* ComputeRows(const int first_row, const int last_row, std::vector<typename ComputeType<T>::type>& rows) const {
+  // Returns the rows "first_row" to "last_row"-1 as values of the type the
+  // similarities are calculated in: either "matrix_" itself (then the rows are
+  // "row_bytes_" apart) or their values converted into "rows" (then they are
+  // "vec_size_" values apart).
+    typedef typename ComputeType<T>::type ComputeT;
+    if (std::is_same<T, ComputeT>::value)
+      return reinterpret_cast<const ComputeT*>(Row<T>(first_row));
+    rows.resize((std::size_t)(last_row-first_row)*vec_size_);
+    for (int i = first_row; i < last_row; ++i)
+      std::copy(Row<T>(i), Row<T>(i)+vec_size_, rows.begin()+(std::size_t)(i-first_row)*vec_size_);
+    return rows.data();
+  }
 
-  void StoreVectors(const std::string& line, const unsigned i);
+  template <typename PairFunction>
+  void ForEachPairValue(const bool cos_sim, const PairFunction& pair_function);
 
-  int StoreVecsWithPattern(const std::string& file, const std::regex& pattern);
+  unsigned NumOfScanTasks(const bool cos_sim) const {
+  // Returns the number of tasks "ForEachPairValue()" splits the table into.
+    return (DiskPlane(cos_sim))? NumOfDiskTasks() : NumOfTileTasks();
+  }
 
-  std::vector<std::string> SplitLine(const std::string& line);
+  template <typename S, typename PairFunction>
+  void ForEachDiskPair(const bool cos_sim, const PairFunction& pair_function);
 
-  void CalculateSimilarities();
+  std::size_t NumOfDiskTiles() const {
+    return (std::size_t)disk_num_of_tile_rows_*(disk_num_of_tile_rows_+1)/2;
+  }
+
+  unsigned NumOfDiskTasks() const {
+  // Returns the number of tasks "ForEachDiskPair()" splits the disk table
+  // into (one per core).
+    return (unsigned)std::max<std::size_t>(1, std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()), NumOfDiskTiles()));
+  }
 
-  void SortListOfWordPairs(std::list<std::pair<std::pair<std::string, std::string>, double>>& list_of_pairs, const double central_value);
+  std::size_t DiskTileIndex(const int a, const int b) const {
+  // Returns the index of the tile (a, b) (a <= b) in a plane of the disk
+  // table (the tiles are stored row by row).
+    return (std::size_t)a*(2*disk_num_of_tile_rows_-a+1)/2+(b-a);
+  }
+
+  const char* DiskPlane(const bool cos_sim) const {
+    return (cos_sim)? disk_cos_sims_ : disk_eucl_dists_;
+  }
+
+  double DiskValue(const int i, const int j, const bool cos_sim) const;
+
+  uint64_t HashOfVecs() const;
+
+  double CosSim(const int i, const int j, const double dot_product) const {
+  // Returns the cosine similarity of the pair ("words_[i]", "words_[j]") given
+  // the dot product of their vectors.
+    return dot_product/std::sqrt(squared_norms_[i]*squared_norms_[j]);
+  }
+
+  double EuclDist(const int i, const int j, const double dot_product) const {
+  // Returns the Euclidean distance of the pair ("words_[i]", "words_[j]")
+  // given the dot product of their vectors (||a-b||² = ||a||²+||b||²-2a·b;
+  // rounding errors of nearly identical vectors mustn't make it negative).
+    return std::sqrt(std::max(0., squared_norms_[i]+squared_norms_[j]-2*dot_product));
+  }
+
+  std::list<std::pair<std::pair<std::string, std::string>, double>> FindSimilarPairs(const double value_min, const double value_max, const bool cos_sim, const std::size_t skipped_pair);
+
+  std::list<std::pair<std::pair<std::string, std::string>, double>> FindMostSimilarPairs(const double central_value, const bool cos_sim, const unsigned k, const std::size_t skipped_pair);
+
+  std::vector<SimilarPair> FindMostSimilarPairsInIndex(const double central_value, const bool cos_sim, const unsigned k, const std::size_t skipped_pair) const;
+
+  template <typename Index>
+  void SortPairsByValue(const double* plane, std::vector<Index>& sorted_pairs) const;
+
+  bool HasWideValueIndex() const {
+  // Returns "true" if the indices of the value index need 64 bits.
+    return (NumOfPairs() > 0xffffffffull);
+  }
+
+  template <typename Function>
+  auto DispatchValueIndex(const bool cos_sim, Function&& function) const {
+  // Calls "function(sorted_pairs)" with the value index of the plane of the
+  // cosine similarities (or Euclidean distances), which is either a vector of
+  // 32 or of 64 bit indices (and empty if it hasn't been built).
+    if (HasWideValueIndex())
+      return function((cos_sim)? wide_sorted_cos_sims_ : wide_sorted_eucl_dists_);
+    return function((cos_sim)? sorted_cos_sims_ : sorted_eucl_dists_);
+  }
+
+  bool HasValueIndex(const bool cos_sim) const {
+    return DispatchValueIndex(cos_sim, [](const auto& sorted_pairs) {return !sorted_pairs.empty();});
+  }
 
   int GetIndex(const std::string& word);
 
-  std::pair<int, int> GetSimTableIndices(int i, int j) {
-  // Given the indices of two "WordVec"s in "word_vecs_" the corresponding
-  // indices of the word pair in "sim_table_" will be returned.
+  std::size_t NumOfPairs() const {
+    return (std::size_t)vec_num_*(vec_num_-1)/2;
+  }
+
+  std::size_t RowStart(const int i) const {
+  // Returns the index of the first pair of "words_[i]" (with "words_[i+1]").
+    return (std::size_t)i*(2*vec_num_-i-1)/2;
+  }
+
+  std::size_t PairIndex(int i, int j) const {
+  // Returns the index of the pair ("words_[i]", "words_[j]") (i != j) in the
+  // planes of the similarity table.
     if (i > j)
       std::swap(i, j);
-    j -= i+1;
-    return std::make_pair(i, j);
+    return RowStart(i)+(j-i-1);
   }
 
-  std::pair<int, int> GetWordVecsIndices(int i, int j) {
-  // Given the indices of a word pair in "sim_table_" the corresponding indices
-  // of the word pair in "word_vecs_" will be returned.
-    if (i < j)
-      return std::make_pair(i, ++j);
-    j += i+1;
-    return std::make_pair(i, j);
+  std::pair<int, int> GetPair(const std::size_t index) const;
+
+  const double* Plane(const bool cos_sim) const {
+  // Returns the plane of the cosine similarities (or Euclidean distances) or
+  // NULL if it isn't stored.
+    const AlignedArray<double>& plane((cos_sim)? cos_sims_ : eucl_dists_);
+    return (plane.Size() > 0)? plane.Data() : NULL;
   }
+
+  double PairValue(const int i, const int j, const bool cos_sim);
+
+  template <typename T>
+  double CalculateDotProduct(const int i, const int j) const;
 };
 
 #endif // WORD_VEC_LIB_WORD_VEC_LIB_H_